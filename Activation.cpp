@@ -1,4 +1,6 @@
 #include "Activation.h"
+#include "Simd.h"
+#include <vector>
 
 
 /**
@@ -6,7 +8,7 @@
   */
 Activation::Activation (ActivationType act_type)
 {
-  if (act_type != RELU && act_type != SOFTMAX)
+  if (act_type != RELU && act_type != SOFTMAX && act_type != LOG_SOFTMAX)
     {
       std::cerr << ACT_TYPE_ERR0R << std::endl;
       exit(EXIT_FAILURE);
@@ -15,7 +17,7 @@ Activation::Activation (ActivationType act_type)
   _act_type = act_type;
 }
 /**
- * @return this activation's type (ReLU/Softmax)
+ * @return this activation's type (ReLU/Softmax/LogSoftmax)
  */
 ActivationType Activation::get_activation_type() const
 {
@@ -27,18 +29,94 @@ ActivationType Activation::get_activation_type() const
  * @param input - the vector to apply activation function at.
  * @return copy to the new matrix - the result
  */
-Matrix Activation::operator()(const Matrix &input) const
+Matrix Activation::operator()(MatrixView input) const
 {
-  Matrix output_vector = Matrix(input.get_rows(), input.get_cols());
+  Matrix output_vector = Matrix(input.get_rows(), input.get_cols(), NO_FILL);
+  (*this)(input, output_vector);
+  return output_vector;
+}
+
+/**
+ * Applies activation function on input, writes the result into output.
+ * output must have the size of input, and may be input itself.
+ * @param input - the vector to apply activation function at.
+ * @param output - the vector to insert the result in.
+ */
+void Activation::operator()(MatrixView input, Matrix &output) const
+{
+  if (input.get_rows() != output.get_rows() ||
+      input.get_cols() != output.get_cols())
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit(EXIT_FAILURE);
+    }
   if (_act_type == RELU)
     {
-      relu(input, output_vector);
-      return output_vector;
+      relu(input, output);
     }
   else
     {
-      softmax(input, output_vector);
-      return output_vector;
+      softmax(input, output, _act_type == LOG_SOFTMAX);
+    }
+}
+
+/**
+ * Backward pass: turns grad, the gradient of the loss with respect to
+ * this activation's output, into the gradient with respect to its input.
+ * @param output - the activation's output in the forward pass
+ * @param grad - the gradient to transform in place, the size of output
+ */
+void Activation::backward(MatrixView output, Matrix &grad) const
+{
+  int rows = output.get_rows();
+  int cols = output.get_cols();
+  if (rows != grad.get_rows() || cols != grad.get_cols())
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  float *g = grad.data();
+  if (_act_type == RELU)
+    {
+      // the derivative is 1 where the unit was active, 0 elsewhere.
+      for (int i = 0; i < rows; i++)
+        {
+          for (int j = 0; j < cols; j++)
+            {
+              g[i * cols + j] = output(i, j) > 0 ? g[i * cols + j] : 0;
+            }
+        }
+      return;
+    }
+  if (_act_type == LOG_SOFTMAX)
+    {
+      // per column: g_i = g_i - p_i * sum_j g_j, with p = e^output.
+      for (int j = 0; j < cols; j++)
+        {
+          float sum = 0;
+          for (int i = 0; i < rows; i++)
+            {
+              sum += g[i * cols + j];
+            }
+          for (int i = 0; i < rows; i++)
+            {
+              g[i * cols + j] -= std::exp(output(i, j)) * sum;
+            }
+        }
+      return;
+    }
+  // softmax Jacobian product, per column: g_i = p_i * (g_i - sum_j g_j p_j)
+  for (int j = 0; j < cols; j++)
+    {
+      float dot = 0;
+      for (int i = 0; i < rows; i++)
+        {
+          dot += g[i * cols + j] * output(i, j);
+        }
+      for (int i = 0; i < rows; i++)
+        {
+          g[i * cols + j] = output(i, j) * (g[i * cols + j] - dot);
+        }
     }
 }
 
@@ -49,39 +127,92 @@ Matrix Activation::operator()(const Matrix &input) const
  * @param output - the vector to insert the result in.
  * @return reference to the output vector.
  */
-void Activation::relu(const Matrix& vec, Matrix& output)
+void Activation::relu(MatrixView vec, Matrix& output)
 {
   // apply ReLu function on each element in the vector.
-  for (int i = 0; i < vec.get_rows() * vec.get_cols(); i++)
+  if (vec.is_contiguous())
     {
-      if (vec[i] < 0)
-        {
-          output[i] = 0;
-        }
-      else
-        {
-          output[i] = vec[i];
-        }
+      simd().relu(vec.data(), output.data(), vec.get_rows() * vec.get_cols());
+      return;
+    }
+  for (int i = 0; i < vec.get_rows(); i++)
+    {
+      simd().relu(vec.row(i), output.data() + i * vec.get_cols(),
+                  vec.get_cols());
     }
 }
 
 /**
  * Softmax - activation function that converts a vector of numbers into a
- * vector of probabilities.
+ * vector of probabilities. When vec has several columns (a batch), each
+ * column is normalized on its own. The work runs along rows, so a batch
+ * uses whole SIMD vectors: one exp per element, no temporaries.
  * @param vec - the vector to apply Softmax function at.
- * @param output - the vector to insert the result in.
- * @return reference to the output vector.
+ * @param output - the vector to insert the result in, may be vec.
+ * @param log - write log probabilities (log-softmax) instead.
  */
-void Activation::softmax(const Matrix& vec, Matrix& output)
+void Activation::softmax(MatrixView vec, Matrix& output, bool log)
 {
-  float sum = 0;
-  // apply Softmax function on each element in the vector.
-  for (int i = 0; i < vec.get_rows() * vec.get_cols(); i++)
+  int rows = vec.get_rows();
+  int cols = vec.get_cols();
+  float *out = output.data();
+  const SimdKernels &kernels = simd();
+  // per thread column scratch, reused by every call.
+  static thread_local std::vector<float> col_max, col_sum, exps;
+  col_max.assign(vec.row(0), vec.row(0) + cols);
+  for (int i = 1; i < rows; i++)
+    {
+      const float *row = vec.row(i);
+      for (int j = 0; j < cols; j++)
+        {
+          col_max[j] = row[j] > col_max[j] ? row[j] : col_max[j];
+        }
+    }
+  // shift every column by its max: the exponents are <= 0, e^x <= 1.
+  for (int i = 0; i < rows; i++)
+    {
+      const float *row = vec.row(i);
+      float *out_row = out + i * cols;
+      for (int j = 0; j < cols; j++)
+        {
+          out_row[j] = row[j] - col_max[j];
+        }
+    }
+  float *e = out;
+  if (log)
+    {
+      exps.resize((size_t) rows * cols);
+      e = exps.data();
+    }
+  kernels.exp(out, e, rows * cols);
+  col_sum.assign(cols, 0);
+  for (int i = 0; i < rows; i++)
+    {
+      kernels.add(col_sum.data(), e + i * cols, cols);
+    }
+  if (log)
+    {
+      // log p = (x - max) - log(sum e^(x - max))
+      for (int j = 0; j < cols; j++)
+        {
+          col_sum[j] = std::log(col_sum[j]);
+        }
+      for (int i = 0; i < rows; i++)
+        {
+          float *out_row = out + i * cols;
+          for (int j = 0; j < cols; j++)
+            {
+              out_row[j] -= col_sum[j];
+            }
+        }
+      return;
+    }
+  for (int j = 0; j < cols; j++)
+    {
+      col_sum[j] = 1 / col_sum[j];
+    }
+  for (int i = 0; i < rows; i++)
     {
-      sum += std::exp(vec[i]);
-      output[i] = std::exp(vec[i]);
+      kernels.mul(out + i * cols, col_sum.data(), out + i * cols, cols);
     }
-  // the scalar to duplicate with the vector.
-  float scalar = 1 / sum;
-  output = output*scalar;
 }
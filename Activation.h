@@ -11,7 +11,8 @@
 enum ActivationType
 {
     RELU,
-    SOFTMAX
+    SOFTMAX,
+    LOG_SOFTMAX // log probabilities, for callers that work in log space
 };
 
 class Activation
@@ -22,7 +23,7 @@ class Activation
    */
    explicit Activation(ActivationType act_type);
   /**
-   * @return this activation's type (ReLU/Softmax)
+   * @return this activation's type (ReLU/Softmax/LogSoftmax)
    */
   ActivationType get_activation_type() const;
   /**
@@ -30,7 +31,22 @@ class Activation
    * @param input - the vector to apply activation function at.
    * @return copy to the new matrix - the result
    */
-  Matrix operator()(const Matrix &input) const;
+  Matrix operator()(MatrixView input) const;
+  /**
+   * Applies activation function on input, writes the result into output.
+   * output must have the size of input, and may be input itself.
+   * @param input - the vector to apply activation function at.
+   * @param output - the vector to insert the result in.
+   */
+  void operator()(MatrixView input, Matrix &output) const;
+  /**
+   * Backward pass: turns grad, the gradient of the loss with respect to
+   * this activation's output, into the gradient with respect to its input.
+   * Columns are independent samples.
+   * @param output - the activation's output in the forward pass
+   * @param grad - the gradient to transform in place, the size of output
+   */
+  void backward(MatrixView output, Matrix &grad) const;
 
 
  private:
@@ -42,15 +58,16 @@ class Activation
    * @param output - the vector to insert the result in.
    * @return reference to the output vector.
    */
-  static void relu(const Matrix& vec, Matrix& output);
+  static void relu(MatrixView vec, Matrix& output);
   /**
    * Softmax - activation function that converts a vector of numbers into a
-   * vector of probabilities.
+   * vector of probabilities. Each column is normalized on its own, after
+   * subtracting its max so no exponent can overflow.
    * @param vec - the vector to apply Softmax function at.
-   * @param output - the vector to insert the result in.
-   * @return reference to the output vector.
+   * @param output - the vector to insert the result in, may be vec.
+   * @param log - write log probabilities (log-softmax) instead.
    */
-  static void softmax(const Matrix& vec, Matrix& output);
+  static void softmax(MatrixView vec, Matrix& output, bool log);
 };
 
 #endif //ACTIVATION_H
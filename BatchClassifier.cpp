@@ -0,0 +1,112 @@
+// BatchClassifier.cpp
+
+#include "BatchClassifier.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+
+/**
+ * Reads one raw image file into a row of the batch matrix.
+ * @return false if the file is missing or does not hold exactly one image
+ */
+static bool read_image_row (const std::string &path, Matrix &batch, int row)
+{
+  std::ifstream is (path, std::ios::in | std::ios::binary | std::ios::ate);
+  int size = batch.get_cols ();
+  if (!is.is_open () || is.tellg () != (long) (size * sizeof (float)))
+    {
+      return false;
+    }
+  is.seekg (0, std::ios_base::beg);
+  is.read ((char *) (batch.data () + row * size), size * sizeof (float));
+  return (bool) is;
+}
+
+/**
+ * @param mlp - the network, must outlive the classifier
+ * @param threads - number of workers, 0 means one per hardware thread
+ */
+BatchClassifier::BatchClassifier (const MlpNetwork &mlp, int threads)
+    : _mlp (mlp), _pool (threads), _images_per_second (0)
+{}
+
+double BatchClassifier::images_per_second () const
+{
+  return _images_per_second;
+}
+
+int BatchClassifier::threads () const
+{
+  return _pool.size ();
+}
+
+/**
+ * Classifies every image.
+ * @param paths - raw 28x28 float image files
+ * @return one result per path, in the order of paths
+ */
+std::vector<ImageResult>
+BatchClassifier::classify (const std::vector<std::string> &paths)
+{
+  auto start = std::chrono::steady_clock::now ();
+  int count = (int) paths.size ();
+  // every task writes its own slice, so the results keep the input order.
+  std::vector<ImageResult> results (count, ImageResult{false, digit{0, 0}});
+  for (int first = 0; first < count; first += BATCH_CHUNK)
+    {
+      int last = std::min (first + BATCH_CHUNK, count);
+      _pool.submit ([this, &paths, &results, first, last] ()
+                    {
+                      Matrix batch (last - first,
+                                    img_dims.rows * img_dims.cols);
+                      for (int i = first; i < last; i++)
+                        {
+                          results[i].ok = read_image_row (paths[i], batch,
+                                                          i - first);
+                        }
+                      std::vector<digit> digits = _mlp.classify_batch (batch);
+                      for (int i = first; i < last; i++)
+                        {
+                          results[i].result = digits[i - first];
+                        }
+                    });
+    }
+  _pool.wait ();
+  double seconds = std::chrono::duration<double> (
+      std::chrono::steady_clock::now () - start).count ();
+  _images_per_second = seconds > 0 ? count / seconds : 0;
+  return results;
+}
+
+/**
+ * Expands a list of paths: a directory stands for all the regular files
+ * in it (sorted by name), any other path is kept as is.
+ * @param paths - files and directories
+ * @return image file paths
+ */
+std::vector<std::string>
+BatchClassifier::expand (const std::vector<std::string> &paths)
+{
+  namespace fs = std::filesystem;
+  std::vector<std::string> files;
+  for (const auto &path : paths)
+    {
+      std::error_code error;
+      if (!fs::is_directory (path, error))
+        {
+          files.push_back (path);
+          continue;
+        }
+      std::vector<std::string> entries;
+      for (const auto &entry : fs::directory_iterator (path, error))
+        {
+          if (entry.is_regular_file (error))
+            {
+              entries.push_back (entry.path ().string ());
+            }
+        }
+      std::sort (entries.begin (), entries.end ());
+      files.insert (files.end (), entries.begin (), entries.end ());
+    }
+  return files;
+}
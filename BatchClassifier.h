@@ -0,0 +1,67 @@
+// BatchClassifier.h
+
+#ifndef BATCHCLASSIFIER_H
+#define BATCHCLASSIFIER_H
+
+#include <string>
+#include <vector>
+#include "MlpNetwork.h"
+#include "ThreadPool.h"
+
+// number of images every task reads and classifies as one batch.
+#define BATCH_CHUNK 32
+
+/**
+ * @struct ImageResult
+ * @brief Classification of one image file.
+ * @var ok - false if the file could not be read as an image
+ * @var result - the identified digit, valid only when ok
+ */
+typedef struct ImageResult
+{
+    bool ok;
+    digit result;
+} ImageResult;
+
+/**
+ * Classifies many image files in parallel. The network is shared read
+ * only by all the workers of a work stealing pool; every task reads a
+ * chunk of images and runs it through the network as one batch.
+ */
+class BatchClassifier
+{
+ public:
+  /**
+   * @param mlp - the network, must outlive the classifier
+   * @param threads - number of workers, 0 means one per hardware thread
+   */
+  explicit BatchClassifier(const MlpNetwork &mlp, int threads = 0);
+  /**
+   * Classifies every image.
+   * @param paths - raw 28x28 float image files
+   * @return one result per path, in the order of paths
+   */
+  std::vector<ImageResult> classify(const std::vector<std::string> &paths);
+  /**
+   * @return images per second of the last classify call.
+   */
+  double images_per_second() const;
+  /**
+   * @return number of workers.
+   */
+  int threads() const;
+  /**
+   * Expands a list of paths: a directory stands for all the regular files
+   * in it (sorted by name), any other path is kept as is.
+   * @param paths - files and directories
+   * @return image file paths
+   */
+  static std::vector<std::string> expand(const std::vector<std::string> &paths);
+
+ private:
+  const MlpNetwork &_mlp;
+  ThreadPool _pool;
+  double _images_per_second;
+};
+
+#endif //BATCHCLASSIFIER_H
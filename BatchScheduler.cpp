@@ -0,0 +1,312 @@
+// BatchScheduler.cpp
+
+#include "BatchScheduler.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+
+Histogram::Histogram ()
+{
+  for (auto &bucket : _buckets)
+    {
+      bucket = 0;
+    }
+}
+
+/**
+ * Counts one value, values past the last bucket go to the last one.
+ */
+void Histogram::add (long value)
+{
+  int i = value <= 0 ? 0 : 64 - __builtin_clzl ((unsigned long) value);
+  _buckets[std::min (i, HISTOGRAM_BUCKETS - 1)].fetch_add (
+      1, std::memory_order_relaxed);
+}
+
+long Histogram::count () const
+{
+  long total = 0;
+  for (const auto &bucket : _buckets)
+    {
+      total += bucket.load (std::memory_order_relaxed);
+    }
+  return total;
+}
+
+long Histogram::bucket (int i) const
+{
+  return _buckets[i].load (std::memory_order_relaxed);
+}
+
+long Histogram::lower_bound (int i)
+{
+  return i == 0 ? 0 : 1L << (i - 1);
+}
+
+/**
+ * @param p - fraction of the values, in [0, 1]
+ * @return the upper bound of the bucket holding the p quantile
+ */
+long Histogram::percentile (double p) const
+{
+  long total = count ();
+  long rank = std::max (1L, (long) std::ceil (p * (double) total));
+  long seen = 0;
+  for (int i = 0; i < HISTOGRAM_BUCKETS && total > 0; i++)
+    {
+      seen += bucket (i);
+      if (seen >= rank)
+        {
+          return lower_bound (i + 1) - 1;
+        }
+    }
+  return total > 0 ? lower_bound (HISTOGRAM_BUCKETS - 1) : 0;
+}
+
+/**
+ * Starts the batching thread.
+ * @param mlp - the network, must outlive the scheduler
+ * @param config - batching limits
+ */
+BatchScheduler::BatchScheduler (const MlpNetwork &mlp,
+                                const SchedulerConfig &config)
+    : _mlp (mlp), _config (config), _head (new Node ()), _depth (0),
+      _sleeping (false), _stop (false), _batch_size (config.max_batch),
+      _p99_us (0), _window_batches (0), _window_backlogged (0),
+      _batch (std::max (config.max_batch, 1), img_dims.rows * img_dims.cols)
+{
+  if (config.max_batch <= 0 || config.max_wait_us < 0
+      || config.p99_target_us < 0)
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  // the queue starts with a consumed stub node.
+  _tail = _head.load ();
+  _tail->next = nullptr;
+  _window.reserve (SCHED_WINDOW + config.max_batch);
+  _thread = std::thread (&BatchScheduler::run, this);
+}
+
+/**
+ * Completes every submitted request, then stops the batching thread.
+ */
+BatchScheduler::~BatchScheduler ()
+{
+  {
+    std::lock_guard<std::mutex> guard (_lock);
+    _stop = true;
+  }
+  _wake.notify_one ();
+  _thread.join ();
+  delete _tail;
+}
+
+/**
+ * Queues one image, without taking a lock unless the batching thread
+ * sleeps and needs a wake up.
+ * @param image - 784 pixels, copied before submit returns
+ * @return the future digit of the image
+ */
+std::future<digit> BatchScheduler::submit (const float *image)
+{
+  Node *node = new Node ();
+  node->next.store (nullptr, std::memory_order_relaxed);
+  node->image.assign (image, image + _batch.get_cols ());
+  node->submitted = Clock::now ();
+  std::future<digit> result = node->result.get_future ();
+  _depth++;
+  Node *prev = _head.exchange (node, std::memory_order_acq_rel);
+  // sequentially consistent with the _sleeping flag: either this thread
+  // sees the batching thread asleep, or the batching thread sees the node.
+  prev->next.store (node);
+  if (_sleeping)
+    {
+      std::lock_guard<std::mutex> guard (_lock);
+      _wake.notify_one ();
+    }
+  return result;
+}
+
+int BatchScheduler::batch_size () const
+{
+  return _batch_size;
+}
+
+long BatchScheduler::p99_us () const
+{
+  return _p99_us;
+}
+
+const Histogram &BatchScheduler::queue_depths () const
+{
+  return _queue_depths;
+}
+
+const Histogram &BatchScheduler::batch_sizes () const
+{
+  return _batch_sizes;
+}
+
+const Histogram &BatchScheduler::latencies () const
+{
+  return _latencies;
+}
+
+/**
+ * @return the oldest request, or nullptr if the queue looks empty: a
+ * producer may have swapped in its node without linking it yet.
+ */
+BatchScheduler::Node *BatchScheduler::try_pop ()
+{
+  Node *tail = _tail;
+  Node *next = tail->next.load ();
+  if (next == nullptr)
+    {
+      return nullptr;
+    }
+  // next becomes the stub, its request moves into the old stub.
+  tail->image = std::move (next->image);
+  tail->result = std::move (next->result);
+  tail->submitted = next->submitted;
+  _tail = next;
+  _depth--;
+  return tail;
+}
+
+/**
+ * Takes the oldest request, waiting for one until the deadline.
+ * @return the request, the caller owns it, or nullptr at the deadline or
+ *         when stopping
+ */
+BatchScheduler::Node *BatchScheduler::pop (Clock::time_point deadline)
+{
+  Node *node = try_pop ();
+  if (node != nullptr)
+    {
+      return node;
+    }
+  std::unique_lock<std::mutex> lock (_lock);
+  while (true)
+    {
+      _sleeping = true;
+      node = try_pop ();
+      if (node != nullptr || _stop || Clock::now () >= deadline)
+        {
+          _sleeping = false;
+          return node;
+        }
+      _wake.wait_until (lock, deadline);
+    }
+}
+
+void BatchScheduler::run ()
+{
+  std::vector<Node *> batch;
+  batch.reserve (_config.max_batch);
+  while (true)
+    {
+      Node *first = pop (Clock::now ()
+                         + std::chrono::milliseconds (SCHED_IDLE_MS));
+      if (first == nullptr)
+        {
+          if (_stop && _depth == 0)
+            {
+              break;
+            }
+          continue;
+        }
+      _queue_depths.add (_depth + 1);
+      batch.assign (1, first);
+      Clock::time_point deadline = first->submitted
+                                   + std::chrono::microseconds (
+                                       _config.max_wait_us);
+      int limit = _batch_size;
+      while ((int) batch.size () < limit)
+        {
+          // stopping, the remaining requests go without waiting.
+          Node *node = _stop ? try_pop () : pop (deadline);
+          if (node == nullptr)
+            {
+              break;
+            }
+          batch.push_back (node);
+        }
+      // full with requests left over: the batches do not keep up.
+      process (batch, (int) batch.size () == limit && _depth > 0);
+    }
+}
+
+/**
+ * Runs a batch as one forward pass and completes its futures.
+ */
+void BatchScheduler::process (std::vector<Node *> &batch, bool backlogged)
+{
+  int count = (int) batch.size ();
+  int pixels = _batch.get_cols ();
+  for (int i = 0; i < count; i++)
+    {
+      std::memcpy (_batch.row (i), batch[i]->image.data (),
+                   sizeof (float) * pixels);
+    }
+  std::vector<digit> digits = _mlp.classify_batch (
+      MatrixView (_batch.data (), count, pixels));
+  // recorded first, so the statistics cover every completed future.
+  _batch_sizes.add (count);
+  adapt (batch, backlogged, Clock::now ());
+  for (int i = 0; i < count; i++)
+    {
+      batch[i]->result.set_value (digits[i]);
+      delete batch[i];
+    }
+}
+
+/**
+ * Records the latencies of a batch, and once a window is full adapts the
+ * batch size to the p99 target.
+ */
+void BatchScheduler::adapt (const std::vector<Node *> &batch,
+                            bool backlogged, Clock::time_point done)
+{
+  _window_batches++;
+  _window_backlogged += backlogged;
+  for (const Node *node : batch)
+    {
+      long us = (long) std::chrono::duration_cast<std::chrono::microseconds> (
+          done - node->submitted).count ();
+      _latencies.add (us);
+      _window.push_back (us);
+    }
+  if (_window.size () < SCHED_WINDOW)
+    {
+      return;
+    }
+  auto p99 = _window.begin () + _window.size () * 99 / 100;
+  std::nth_element (_window.begin (), p99, _window.end ());
+  _p99_us = *p99;
+  // mostly backlogged, the latency is queueing: smaller batches would only
+  // lower the throughput and lengthen the queue, larger ones drain it.
+  bool overloaded = 2 * _window_backlogged > _window_batches;
+  _window.clear ();
+  _window_batches = 0;
+  _window_backlogged = 0;
+  if (_config.p99_target_us <= 0)
+    {
+      return;
+    }
+  int size = _batch_size;
+  if (overloaded)
+    {
+      size = std::min (_config.max_batch, (int) (size / SCHED_SHRINK) + 1);
+    }
+  else if (_p99_us > _config.p99_target_us)
+    {
+      size = std::max (1, (int) (size * SCHED_SHRINK));
+    }
+  else if (_p99_us < _config.p99_target_us * SCHED_GROW_BELOW)
+    {
+      size = std::min (_config.max_batch, size + 1);
+    }
+  _batch_size = size;
+}
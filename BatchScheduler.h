@@ -0,0 +1,193 @@
+// BatchScheduler.h
+
+#ifndef BATCHSCHEDULER_H
+#define BATCHSCHEDULER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "MlpNetwork.h"
+
+#define SCHED_MAX_BATCH 64
+#define SCHED_MAX_WAIT_US 1000
+#define SCHED_P99_US 5000
+// completed requests per p99 measurement, and batch size adjustment.
+#define SCHED_WINDOW 256
+// the batch shrinks by this factor when the p99 misses the target, and
+// grows by one while it stays below SCHED_GROW_BELOW of the target.
+#define SCHED_SHRINK 0.75
+#define SCHED_GROW_BELOW 0.8
+// longest sleep of the idle batching thread, between stop checks.
+#define SCHED_IDLE_MS 100
+#define HISTOGRAM_BUCKETS 32
+
+/**
+ * @struct SchedulerConfig
+ * @brief Batching limits of a BatchScheduler.
+ * @var max_batch - most images per forward pass
+ * @var max_wait_us - longest the first request of a batch waits for it to
+ *      fill, in microseconds
+ * @var p99_target_us - wanted 99th percentile of the latency from submit
+ *      to completion, 0 keeps the batch size at max_batch
+ */
+typedef struct SchedulerConfig
+{
+    int max_batch;
+    long max_wait_us;
+    long p99_target_us;
+} SchedulerConfig;
+
+/**
+ * Counts of non negative values in power of two buckets: bucket 0 holds
+ * 0, bucket i holds [2^(i-1), 2^i). Safe to add to and read from several
+ * threads at once.
+ */
+class Histogram
+{
+ public:
+  Histogram();
+  /**
+   * Counts one value, values past the last bucket go to the last one.
+   */
+  void add(long value);
+  /**
+   * @return number of values counted.
+   */
+  long count() const;
+  /**
+   * @param i - bucket index, 0 .. HISTOGRAM_BUCKETS - 1
+   * @return number of values in the i'th bucket
+   */
+  long bucket(int i) const;
+  /**
+   * @return the smallest value of the i'th bucket.
+   */
+  static long lower_bound(int i);
+  /**
+   * @param p - fraction of the values, in [0, 1]
+   * @return the upper bound of the bucket holding the p quantile, 0 when
+   *         nothing was counted
+   */
+  long percentile(double p) const;
+
+ private:
+  std::atomic<long> _buckets[HISTOGRAM_BUCKETS];
+};
+
+/**
+ * Collects single image requests from any number of threads into batches
+ * that run through the network as one forward pass, on a thread of its
+ * own. Requests wait in a lock free multi producer, single consumer queue;
+ * a batch is closed when it reaches the current batch size or when its
+ * first request has waited max_wait_us. Every SCHED_WINDOW requests the
+ * batch size adapts to the latency target: it shrinks multiplicatively
+ * when the measured p99 misses the target, and grows back one image at a
+ * time while there is slack. When most batches close full with requests
+ * still queued the latency is queueing, which only larger batches drain,
+ * so the batch size grows multiplicatively instead.
+ */
+class BatchScheduler
+{
+ public:
+  /**
+   * Starts the batching thread.
+   * Exits (code == 1) if max_batch is not positive or a time is negative.
+   * @param mlp - the network, must outlive the scheduler
+   * @param config - batching limits
+   */
+  BatchScheduler(const MlpNetwork &mlp, const SchedulerConfig &config);
+  /**
+   * Completes every submitted request, then stops the batching thread.
+   */
+  ~BatchScheduler();
+  BatchScheduler(const BatchScheduler&) = delete;
+  BatchScheduler& operator=(const BatchScheduler&) = delete;
+
+  /**
+   * Queues one image. The queue takes no lock, only waking up a sleeping
+   * batching thread does.
+   * @param image - 784 pixels, copied before submit returns
+   * @return the future digit of the image
+   */
+  std::future<digit> submit(const float *image);
+  /**
+   * @return the current batch size limit.
+   */
+  int batch_size() const;
+  /**
+   * @return the p99 latency of the last full window, in microseconds.
+   */
+  long p99_us() const;
+  /**
+   * @return the number of queued requests seen as each batch started.
+   */
+  const Histogram &queue_depths() const;
+  /**
+   * @return the number of images of each batch run.
+   */
+  const Histogram &batch_sizes() const;
+  /**
+   * @return the latency of every completed request, in microseconds.
+   */
+  const Histogram &latencies() const;
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Node
+  {
+    std::atomic<Node *> next;
+    std::vector<float> image;
+    std::promise<digit> result;
+    Clock::time_point submitted;
+  };
+
+  void run();
+  /**
+   * Takes the oldest request, waiting for one until the deadline.
+   * @return the request, the caller owns it, or nullptr at the deadline
+   */
+  Node *pop(Clock::time_point deadline);
+  /**
+   * @return the oldest request, or nullptr if the queue looks empty.
+   */
+  Node *try_pop();
+  /**
+   * Runs a batch and completes its futures.
+   * @param backlogged - the batch closed full with requests still queued
+   */
+  void process(std::vector<Node *> &batch, bool backlogged);
+  /**
+   * Records the latencies of a batch and adapts the batch size.
+   */
+  void adapt(const std::vector<Node *> &batch, bool backlogged,
+             Clock::time_point done);
+
+  const MlpNetwork &_mlp;
+  SchedulerConfig _config;
+  // Vyukov's intrusive queue: producers swap themselves into _head, the
+  // consumer follows next pointers from _tail, which is a consumed node.
+  std::atomic<Node *> _head;
+  Node *_tail;
+  std::atomic<long> _depth; // submitted and not yet taken requests
+  std::atomic<bool> _sleeping; // the batching thread waits on _wake
+  std::atomic<bool> _stop;
+  std::mutex _lock;
+  std::condition_variable _wake;
+  std::atomic<int> _batch_size;
+  std::atomic<long> _p99_us;
+  std::vector<long> _window; // latencies of the current window
+  int _window_batches;
+  int _window_backlogged; // batches of the window that were backlogged
+  Matrix _batch; // max_batch x 784
+  Histogram _queue_depths;
+  Histogram _batch_sizes;
+  Histogram _latencies;
+  std::thread _thread;
+};
+
+#endif //BATCHSCHEDULER_H
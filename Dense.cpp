@@ -1,45 +1,508 @@
 // Dense.cpp
 
 #include "Dense.h"
+#include "Gemm.h"
+#include "Simd.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
 
 
 /**
- * Inits a new layer with given parameters.
+ * @return a view of m's elements if m is a view (a mapped model's pages
+ * are shared, not copied), otherwise a copy of m.
+ */
+static Matrix share (const Matrix &m)
+{
+  if (m.is_view ())
+    {
+      return Matrix::view (const_cast<float *> (m.data ()), m.get_rows (),
+                           m.get_cols ());
+    }
+  return m;
+}
+
+/**
+ * Inits a new layer with given parameters, and lays the weights out for
+ * the forward pass. Exits (code == 1) if bias is not a column of w's rows.
  * @param w - Matrix of weights
  * @param bias - matrix of bias
  * @param act_type - activation type
+ * @param layout - the weights' layout for the forward pass
  */
-Dense::Dense (Matrix &w, Matrix &bias, ActivationType act_type) :
+Dense::Dense (const Matrix &w, const Matrix &bias, ActivationType act_type,
+              WeightLayout layout) :
+    _rows (w.get_rows ()), _cols (w.get_cols ()), _layout (layout),
     _activation (Activation (act_type))
 // inits Activation in member list cause it does not have default ctor.
 {
-  _weights = w;
-  _bias = bias;
+  // the forward passes read a bias per row of w.
+  if (bias.get_rows () != _rows || bias.get_cols () != 1)
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  _bias = share (bias);
+  // the half layouts only read w here, a view of it is enough.
+  lay_out (_layout == HALF_FP16 || _layout == HALF_BF16
+           ? Matrix::view (const_cast<float *> (w.data ()), _rows, _cols)
+           : share (w));
+}
+
+/**
+ * Inits a new layer from weights rounded to 16 bits, kept as they are in
+ * their own half layout. Exits (code == 1) if the sizes do not match.
+ * @param half - rows x cols weights' bits, row major
+ * @param format - HALF_FP16 or HALF_BF16, the bits' format
+ * @param rows - number of outputs
+ * @param cols - number of inputs
+ * @param bias - matrix of bias
+ * @param act_type - activation type
+ * @param layout - the weights' layout for the forward pass, AUTO for format
+ */
+Dense::Dense (std::vector<uint16_t> half, WeightLayout format, int rows,
+              int cols, const Matrix &bias, ActivationType act_type,
+              WeightLayout layout) :
+    _rows (rows), _cols (cols), _layout (layout == AUTO ? format : layout),
+    _activation (Activation (act_type))
+{
+  if ((format != HALF_FP16 && format != HALF_BF16) || rows <= 0 || cols <= 0
+      || half.size () != (size_t) rows * cols || bias.get_rows () != rows
+      || bias.get_cols () != 1)
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  _bias = share (bias);
+  if (_layout == format)
+    {
+      _half = std::move (half);
+      return;
+    }
+  // any other layout starts from the widened weights.
+  Matrix w (rows, cols, NO_FILL);
+  const SimdKernels &kernels = simd ();
+  (format == HALF_FP16 ? kernels.fp16_to_fp32 : kernels.bf16_to_fp32) (
+      half.data (), w.data (), rows * cols);
+  lay_out (std::move (w));
+}
+
+/**
+ * Lays w out in _layout, resolving AUTO by w's density first. Every layout
+ * but the half ones keeps w as the row major weights.
+ */
+void Dense::lay_out (Matrix w)
+{
+  if (_layout == AUTO)
+    {
+      double density = SparseMatrix::density (w);
+      // dense weights stay as given, so views are not copied.
+      _layout = ROW_MAJOR;
+      if (density <= SPARSE_BLOCKS_DENSITY
+          && SparseMatrix::block_fill (w) >= SPARSE_BLOCK_FILL)
+        {
+          _layout = SPARSE_BLOCKS;
+        }
+      else if (density <= SPARSE_CSR_DENSITY)
+        {
+          _layout = SPARSE_CSR;
+        }
+    }
+  if (_layout == HALF_FP16 || _layout == HALF_BF16)
+    {
+      // only the rounded weights stay, _weights is left a placeholder.
+      _half.resize ((size_t) _rows * _cols);
+      const SimdKernels &kernels = simd ();
+      (_layout == HALF_FP16 ? kernels.fp32_to_fp16 : kernels.fp32_to_bf16) (
+          w.data (), _half.data (), _rows * _cols);
+      return;
+    }
+  _weights = std::move (w);
+  if (_layout == SPARSE_CSR || _layout == SPARSE_BLOCKS)
+    {
+      _sparse = SparseMatrix (_weights, _layout == SPARSE_CSR ? CSR : BLOCKS);
+    }
+  else if (_layout == COL_MAJOR)
+    {
+      _packed = Matrix (_cols, _rows, NO_FILL);
+      simd ().transpose (_weights.data (), _cols, _packed.data (), _rows,
+                         _rows, _cols);
+    }
+  else if (_layout == PANEL_PACKED)
+    {
+      _packed = Matrix (1, (int) gemm_packed_size (_rows, _cols), NO_FILL);
+      gemm_pack_a (_rows, _cols, _weights.data (), _cols, _packed.data ());
+    }
+}
+
+/**
+ * @return the layout named by WEIGHT_LAYOUT_ENV, fallback if it is not set.
+ */
+WeightLayout Dense::layout_from_environment (WeightLayout fallback)
+{
+  const char *name = std::getenv (WEIGHT_LAYOUT_ENV);
+  if (name == nullptr || *name == '\0')
+    {
+      return fallback;
+    }
+  const char *names[] = {"row", "col", "panel", "csr", "blocks",
+                          "fp16", "bf16", "auto"};
+  for (int i = ROW_MAJOR; i <= AUTO; i++)
+    {
+      if (std::strcmp (name, names[i]) == 0)
+        {
+          return (WeightLayout) i;
+        }
+    }
+  std::cerr << WEIGHT_LAYOUT_ERROR << std::endl;
+  exit (EXIT_FAILURE);
 }
 
 // getters
 
-Matrix Dense::get_weights () const
+/**
+ * @return the weights, row major: a read only view of the layer's own, or
+ * for the half layouts of widened, set to them widened to fp32 here.
+ */
+MatrixView Dense::get_weights (Matrix &widened) const
 {
-  return _weights;
+  if (_layout != HALF_FP16 && _layout != HALF_BF16)
+    {
+      return _weights;
+    }
+  widened = Matrix (_rows, _cols, NO_FILL);
+  widen_rows (0, _rows, widened.data ());
+  return widened;
 }
 
-Matrix Dense::get_bias () const
+const Matrix &Dense::get_bias () const
 {
   return _bias;
 }
 
-Activation Dense::get_activation () const
+const Activation &Dense::get_activation () const
 {
   return _activation;
 }
 
+WeightLayout Dense::get_layout () const
+{
+  return _layout;
+}
+
+int Dense::get_rows () const
+{
+  return _rows;
+}
+
+int Dense::get_cols () const
+{
+  return _cols;
+}
+
 /**
- * Applies the layer on input and returns output matrix
- * @param input - the vector to apply  the layer on
+ * @return floating point operations of applying the layer on columns
+ * input vectors: the product, the bias and the activation.
+ */
+double Dense::flops (int columns) const
+{
+  return (2.0 * _cols + 2) * _rows * columns;
+}
+
+/**
+ * Applies the layer on input and returns output matrix.
+ * input may hold several column vectors (a batch), in which case the bias
+ * is added to every column and the whole batch is one matrix product.
+ * @param input - the vector (or columns batch) to apply the layer on
  * @return output matrix
  */
-Matrix Dense::operator() (const Matrix &input) const
+Matrix Dense::operator() (MatrixView input) const
+{
+  Matrix output (_rows, input.get_cols (), NO_FILL);
+  (*this) (input, output);
+  return output;
+}
+
+/**
+ * Applies the layer on input, writing into a caller provided output of
+ * (weights rows) x (input cols). For a single contiguous vector, W*x + b
+ * and the activation are computed in one pass with no temporaries. A
+ * batch is one product, in the loop order of the weights' layout.
+ * @param input - the vector (or columns batch) to apply the layer on
+ * @param output - the matrix to write the result in
+ */
+void Dense::operator() (MatrixView input, Matrix &output) const
+{
+  int rows = _rows;
+  int k = _cols;
+  if (input.get_rows () != k || output.get_rows () != rows
+      || output.get_cols () != input.get_cols ())
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  const float *w = _weights.data ();
+  const float *b = _bias.data ();
+  float *out = output.data ();
+  if (input.get_cols () != 1 || input.get_stride () != 1)
+    {
+      int n = input.get_cols ();
+      if (_layout == SPARSE_CSR || _layout == SPARSE_BLOCKS)
+        {
+          _sparse.multiply_batch (input.data (), input.get_stride (), n, out,
+                                  n);
+        }
+      else if ((n < DENSE_DOT_COLUMNS && _layout != COL_MAJOR)
+               || (n < HALF_DOT_COLUMNS
+                   && (_layout == HALF_FP16 || _layout == HALF_BF16)))
+        {
+          dot_columns (input, out);
+        }
+      else if (_layout == HALF_FP16 || _layout == HALF_BF16)
+        {
+          // widened a cache block at a time, as gemm packs it.
+          const SimdKernels &kernels = simd ();
+          gemm_half (rows, n, k, _half.data (), k,
+                     _layout == HALF_FP16 ? kernels.fp16_to_fp32
+                                          : kernels.bf16_to_fp32,
+                     input.data (), input.get_stride (), out, n);
+        }
+      else if (_layout == PANEL_PACKED)
+        {
+          gemm_prepacked (rows, n, k, _packed.data (), input.data (),
+                          input.get_stride (), out, n);
+        }
+      else if (_layout == COL_MAJOR)
+        {
+          // packing the transpose reads the weights along their rows.
+          gemm_transposed (true, false, rows, n, k, _packed.data (), rows,
+                           input.data (), input.get_stride (), out, n);
+        }
+      else
+        {
+          gemm (rows, n, k, w, k, input.data (), input.get_stride (), out,
+                n);
+        }
+      // broadcast the bias over all the columns of the batch.
+      for (int i = 0; i < rows; i++)
+        {
+          for (int j = 0; j < output.get_cols (); j++)
+            {
+              out[i * output.get_cols () + j] += b[i];
+            }
+        }
+      _activation (output, output);
+      return;
+    }
+  forward (input.data (), out);
+}
+
+/**
+ * W * input for a few columns: the columns are made contiguous, then every
+ * row of W, read (and widened, for half weights) once, is dotted with each
+ * of them.
+ * @param out - rows x (input cols), row major
+ */
+void Dense::dot_columns (MatrixView input, float *out) const
+{
+  int rows = _rows;
+  int k = _cols;
+  int n = input.get_cols ();
+  const SimdKernels &kernels = simd ();
+  static thread_local std::vector<float> columns;
+  columns.resize ((size_t) n * k);
+  kernels.transpose (input.data (), input.get_stride (), columns.data (), k,
+                     k, n);
+  if (_layout == HALF_FP16 || _layout == HALF_BF16)
+    {
+      // every row widened once, then dotted from L1 with each column.
+      static thread_local std::vector<float> row;
+      row.resize (k);
+      for (int i = 0; i < rows; i++)
+        {
+          widen_rows (i, 1, row.data ());
+          for (int j = 0; j < n; j++)
+            {
+              out[i * n + j] = kernels.dot (row.data (),
+                                            columns.data () + (long) j * k,
+                                            k);
+            }
+        }
+      return;
+    }
+  for (int i = 0; i < rows; i++)
+    {
+      const float *w_i = _weights.row (i);
+      for (int j = 0; j < n; j++)
+        {
+          out[i * n + j] = kernels.dot (w_i, columns.data () + (long) j * k,
+                                        k);
+        }
+    }
+}
+
+/**
+ * Widens count rows of the half weights, from row first on, to fp32.
+ * @param out - count x (weights cols) floats, row major
+ */
+void Dense::widen_rows (int first, int count, float *out) const
 {
-  return _activation (_weights * input + _bias);
+  int k = _cols;
+  const SimdKernels &kernels = simd ();
+  (_layout == HALF_FP16 ? kernels.fp16_to_fp32 : kernels.bf16_to_fp32) (
+      _half.data () + (long) first * k, out, count * k);
 }
+
+/**
+ * Applies the layer on a single vector given as raw arrays, in one pass.
+ * Row major and panel packed layers take a dot product per output (the
+ * panels only pay off over a batch); column major ones add up the columns
+ * of W scaled by the non zero inputs; sparse ones see sparse_forward;
+ * half ones take a dot product per output too, widening the weights in
+ * registers.
+ * @param input - (weights cols) floats
+ * @param output - (weights rows) floats, must not overlap input
+ */
+void Dense::forward (const float *input, float *output) const
+{
+  int rows = _rows;
+  int k = _cols;
+  const float *w = _weights.data ();
+  const float *b = _bias.data ();
+  const SimdKernels &kernels = simd ();
+  if (_layout == SPARSE_CSR || _layout == SPARSE_BLOCKS)
+    {
+      sparse_forward (input, output);
+      for (int i = 0; i < rows; i++)
+        {
+          output[i] += b[i];
+        }
+      Matrix outputs = Matrix::view (output, rows, 1);
+      _activation (outputs, outputs);
+      return;
+    }
+  if (_layout == HALF_FP16 || _layout == HALF_BF16)
+    {
+      float (*dot_half) (const uint16_t *, const float *, int)
+          = _layout == HALF_FP16 ? kernels.dot_fp16 : kernels.dot_bf16;
+      for (int i = 0; i < rows; i++)
+        {
+          output[i] = dot_half (_half.data () + (long) i * k, input, k) + b[i];
+        }
+      Matrix outputs = Matrix::view (output, rows, 1);
+      _activation (outputs, outputs);
+      return;
+    }
+  if (_layout == COL_MAJOR)
+    {
+      std::copy (b, b + rows, output);
+      const float *wt = _packed.data ();
+      for (int l = 0; l < k; l++)
+        {
+          if (input[l] != 0)
+            {
+              kernels.axpy (input[l], wt + (long) l * rows, output, rows);
+            }
+        }
+      Matrix outputs = Matrix::view (output, rows, 1);
+      _activation (outputs, outputs);
+      return;
+    }
+  if (_activation.get_activation_type () == RELU)
+    {
+      for (int i = 0; i < rows; i++)
+        {
+          float v = kernels.dot (w + i * k, input, k) + b[i];
+          output[i] = v < 0 ? 0 : v;
+        }
+      return;
+    }
+  // softmax: the logits first, the activation needs their max.
+  for (int i = 0; i < rows; i++)
+    {
+      output[i] = kernels.dot (w + i * k, input, k) + b[i];
+    }
+  Matrix logits = Matrix::view (output, rows, 1);
+  _activation (logits, logits);
+}
+
+/**
+ * W * input with sparse weights. CSR weights and an input with at most
+ * SPARSE_INPUT_DENSITY non zeros (ReLU outputs, mostly black images) visit
+ * only the weights of the non zeros' columns; otherwise every non zero
+ * weight is multiplied with its input.
+ */
+void Dense::sparse_forward (const float *input, float *output) const
+{
+  int k = _cols;
+  if (_layout == SPARSE_CSR)
+    {
+      static thread_local std::vector<int> x_index;
+      static thread_local std::vector<float> x_values;
+      x_index.resize (k);
+      x_values.resize (k);
+      // every element is written, the count only moves past non zeros: no
+      // branch on the input's zeros, which change from input to input.
+      int count = 0;
+      for (int l = 0; l < k; l++)
+        {
+          x_index[count] = l;
+          x_values[count] = input[l];
+          count += input[l] != 0;
+        }
+      if (count <= SPARSE_INPUT_DENSITY * k)
+        {
+          _sparse.multiply_sparse (x_index.data (), x_values.data (), count,
+                                   output);
+          return;
+        }
+    }
+  _sparse.multiply (input, output);
+}
+
+/**
+ * Backward pass over a batch, one sample per column.
+ * @param input - the layer's input in the forward pass, (weights cols) x N
+ * @param delta - gradient of the loss with respect to W*x + b, rows x N
+ * @param grad_weights - overwritten with delta * input^T
+ * @param grad_bias - overwritten with the row sums of delta
+ * @param grad_input - if not null, overwritten with W^T * delta
+ */
+void Dense::backward (MatrixView input, MatrixView delta,
+                      Matrix &grad_weights, Matrix &grad_bias,
+                      Matrix *grad_input) const
+{
+  int rows = _rows;
+  int k = _cols;
+  int n = input.get_cols ();
+  if (input.get_rows () != k || delta.get_rows () != rows
+      || delta.get_cols () != n || grad_weights.get_rows () != rows
+      || grad_weights.get_cols () != k || grad_bias.get_rows () != rows
+      || (grad_input != nullptr && (grad_input->get_rows () != k
+                                    || grad_input->get_cols () != n)))
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  gemm_transposed (false, true, rows, k, n, delta.data (),
+                   delta.get_stride (), input.data (), input.get_stride (),
+                   grad_weights.data (), k);
+  for (int i = 0; i < rows; i++)
+    {
+      float sum = 0;
+      for (int j = 0; j < n; j++)
+        {
+          sum += delta (i, j);
+        }
+      *grad_bias.row (i) = sum;
+    }
+  if (grad_input != nullptr)
+    {
+      Matrix widened; // for the half layouts
+      const MatrixView w = get_weights (widened);
+      gemm_transposed (true, false, k, n, rows, w.data (), k,
+                       delta.data (), delta.get_stride (), grad_input->data (),
+                       n);
+    }
+}
\ No newline at end of file
@@ -1,7 +1,47 @@
 #ifndef C___PROJECT_DENSE_H
 #define C___PROJECT_DENSE_H
 
+#include <cstdint>
+#include <vector>
 #include "Activation.h"
+#include "Sparse.h"
+
+// batches narrower than this skip gemm: a dot product per output and
+// column, streaming the weights once, beats padding them to register tiles.
+#define DENSE_DOT_COLUMNS 8
+// the same for half weights, which gemm widens block by block on every
+// call (no panels to skip packing), so dot products win for longer.
+#define HALF_DOT_COLUMNS 32
+// AUTO keeps weights with at most these fractions of non zeros sparse:
+// SPARSE_BLOCKS if their non zero blocks are at least SPARSE_BLOCK_FILL
+// full, else SPARSE_CSR. Set where single images get faster than with
+// PANEL_PACKED (mlpprune --report); batches gain from about half density.
+#define SPARSE_CSR_DENSITY 0.05
+#define SPARSE_BLOCKS_DENSITY 0.4
+#define SPARSE_BLOCK_FILL 0.6
+// single inputs with at most this fraction of non zeros skip the zeros'
+// columns of CSR weights, denser ones gather their elements.
+#define SPARSE_INPUT_DENSITY 0.4
+#define WEIGHT_LAYOUT_ENV "MLP_WEIGHT_LAYOUT"
+#define WEIGHT_LAYOUT_ERROR "Error: unknown weight layout in " WEIGHT_LAYOUT_ENV
+
+/**
+ * @enum WeightLayout
+ * @brief How a Dense layer keeps its weights for the forward pass.
+ */
+enum WeightLayout
+{
+    ROW_MAJOR, // as given: a dot product per output, gemm packs per call
+    COL_MAJOR, // transposed: a single input scales unit stride columns
+    // packed for the gemm kernel once, batches skip packing; opt in, it
+    // keeps a second copy of the weights that single inputs never read
+    PANEL_PACKED,
+    SPARSE_CSR, // the non zeros only, for pruned weights
+    SPARSE_BLOCKS, // the non zero 1 x SPARSE_BLOCK blocks, for pruned weights
+    HALF_FP16, // rounded to IEEE half, widened to fp32 as they are read
+    HALF_BF16, // rounded to bfloat16, widened to fp32 as they are read
+    AUTO // a sparse layout if the weights are sparse, ROW_MAJOR if not
+};
 
 class Dense
 {
@@ -9,27 +49,146 @@ class Dense
 
   /**
    * Inits a new layer with given parameters.
+   * A view w or bias is shared, not copied, otherwise they are copied.
+   * Every layout but ROW_MAJOR copies the weights into its layout here,
+   * so later writes to w's elements (through a view) are not seen by the
+   * forward pass: layers whose weights change keep ROW_MAJOR.
+   * The half layouts keep only the rounded weights, the others keep the
+   * row major ones too, for get_weights() and the backward pass.
+   * Exits (code == 1) if bias is not a column with a row per row of w.
    * @param w - Matrix of weights
    * @param bias - matrix of bias
    * @param act_type - activation type
+   * @param layout - the weights' layout for the forward pass, AUTO picks
+   *        one by the weights' density
+   */
+   Dense(const Matrix& w, const Matrix& bias, ActivationType act_type,
+         WeightLayout layout = ROW_MAJOR);
+  /**
+   * Inits a new layer from weights already rounded to 16 bits, as half
+   * weights files hold them. In their own half layout they are kept as
+   * they are, no fp32 copy of them is made; any other layout widens them.
+   * Exits (code == 1) if the sizes do not match.
+   * @param half - rows x cols weights' bits, row major
+   * @param format - HALF_FP16 or HALF_BF16, the bits' format
+   * @param rows - number of outputs
+   * @param cols - number of inputs
+   * @param bias - matrix of bias
+   * @param act_type - activation type
+   * @param layout - the weights' layout for the forward pass, AUTO keeps
+   *        format
+   */
+   Dense(std::vector<uint16_t> half, WeightLayout format, int rows,
+         int cols, const Matrix& bias, ActivationType act_type,
+         WeightLayout layout = AUTO);
+
+  /**
+   * @return the layout named by the MLP_WEIGHT_LAYOUT environment variable
+   * ("row", "col", "panel", "csr", "blocks", "fp16", "bf16" or "auto"),
+   * fallback if it is not set. Exits (code == 1) if it names none.
    */
-   Dense( Matrix& w, Matrix& bias, ActivationType act_type);
+  static WeightLayout layout_from_environment(WeightLayout fallback);
 
   // getters
-  Matrix get_weights() const;
-  Matrix get_bias() const;
-  Activation get_activation() const;
   /**
-   * Applies the layer on input and returns output matrix
-   * @param input - the vector to apply  the layer on
+   * @param widened - for the half layouts, set to the weights widened to
+   *        fp32; untouched otherwise
+   * @return the weights, row major: a read only view of the layer's own
+   * (valid as long as the layer), or for the half layouts of widened.
+   */
+  MatrixView get_weights(Matrix &widened) const;
+  const Matrix& get_bias() const;
+  const Activation& get_activation() const;
+  /**
+   * @return the layout the forward pass uses, never AUTO.
+   */
+  WeightLayout get_layout() const;
+  /**
+   * @return the number of outputs, the rows of the weights.
+   */
+  int get_rows() const;
+  /**
+   * @return the number of inputs, the columns of the weights.
+   */
+  int get_cols() const;
+  /**
+   * Applies the layer on input and returns output matrix.
+   * input may hold several column vectors (a batch), in which case the bias
+   * is added to every column and the whole batch is one matrix product.
+   * @param input - the vector (or columns batch) to apply the layer on
    * @return output matrix
    */
-  Matrix operator()(const Matrix &input) const;
+  Matrix operator()(MatrixView input) const;
+  /**
+   * Applies the layer on input, writing into a caller provided output of
+   * (weights rows) x (input cols). For a single contiguous vector, W*x + b
+   * and the activation are computed in one pass with no temporaries.
+   * @param input - the vector (or columns batch) to apply the layer on
+   * @param output - the matrix to write the result in
+   */
+  void operator()(MatrixView input, Matrix &output) const;
+  /**
+   * Applies the layer on a single vector given as raw arrays, in one pass.
+   * @param input - (weights cols) floats
+   * @param output - (weights rows) floats, must not overlap input
+   */
+  void forward(const float *input, float *output) const;
+  /**
+   * Backward pass over a batch, one sample per column.
+   * @param input - the layer's input in the forward pass, (weights cols) x N
+   * @param delta - gradient of the loss with respect to W*x + b (before the
+   *        activation), (weights rows) x N
+   * @param grad_weights - overwritten with delta * input^T
+   * @param grad_bias - overwritten with the row sums of delta
+   * @param grad_input - if not null, overwritten with W^T * delta, the
+   *        gradient with respect to the input
+   */
+  void backward(MatrixView input, MatrixView delta, Matrix &grad_weights,
+                Matrix &grad_bias, Matrix *grad_input) const;
+  /**
+   * @param columns - number of input vectors
+   * @return floating point operations of applying the layer on them: the
+   *         product, the bias and the activation (one per output)
+   */
+  double flops(int columns) const;
 
 
  private:
+  /**
+   * W * input without the bias, for batches of fewer than
+   * DENSE_DOT_COLUMNS (HALF_DOT_COLUMNS for half weights) columns.
+   * @param out - (weights rows) x (input cols), row major
+   */
+  void dot_columns(MatrixView input, float *out) const;
+  /**
+   * W * input for a single vector with sparse weights, skipping the zeros
+   * of input too when there are enough of them.
+   */
+  void sparse_forward(const float *input, float *output) const;
+  /**
+   * Widens count rows of the half weights, from row first on, to fp32.
+   * @param out - count x (weights cols) floats, row major
+   */
+  void widen_rows(int first, int count, float *out) const;
+  /**
+   * Lays w out in _layout (resolving AUTO first), the constructors' part
+   * after the bias and shape checks.
+   * @param w - the weights, kept as _weights unless the layout is half
+   */
+  void lay_out(Matrix w);
+
+  int _rows, _cols;
+  // the row major weights, or a 1x1 placeholder for the half layouts.
   Matrix _weights;
   Matrix _bias;
+  WeightLayout _layout;
+  // the weights in _layout: transposed for COL_MAJOR, gemm_pack_a's panels
+  // (one row) for PANEL_PACKED, unused for the others.
+  Matrix _packed;
+  SparseMatrix _sparse; // the weights for SPARSE_CSR and SPARSE_BLOCKS
+  // the weights' fp16 or bf16 bits for HALF_FP16 and HALF_BF16, row major:
+  // half the bytes the forward pass streams, products still fp32.
+  std::vector<uint16_t> _half;
   Activation _activation; // This filed is an Activation object represent
   // the activation function of the layer.
 };
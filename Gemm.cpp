@@ -0,0 +1,281 @@
+// Gemm.cpp
+
+#include "Gemm.h"
+#include "Simd.h"
+#include <vector>
+
+/**
+ * Copies a kc x nc block of op(B) into NR wide column slivers, each sliver
+ * is stored row after row so the micro kernel reads it with unit stride.
+ * The last sliver is padded with zeros.
+ * @param b - the block's (0, 0) element of op(B), as stored
+ */
+static void pack_b (bool trans, int kc, int nc, const float *b, int ldb,
+                    float *bp)
+{
+  for (int jr = 0; jr < nc; jr += GEMM_NR)
+    {
+      int nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+      for (int p = 0; p < kc; p++)
+        {
+          for (int j = 0; j < GEMM_NR; j++)
+            {
+              *bp++ = j >= nr ? 0 : trans ? b[(jr + j) * ldb + p]
+                                          : b[p * ldb + jr + j];
+            }
+        }
+    }
+}
+
+/**
+ * Copies a mc x kc block of op(A) into MR tall row slivers, each sliver is
+ * stored column after column so the micro kernel reads it with unit stride.
+ * The last sliver is padded with zeros.
+ * @param a - the block's (0, 0) element of op(A), as stored
+ */
+static void pack_a (bool trans, int mc, int kc, const float *a, int lda,
+                    float *ap)
+{
+  for (int ir = 0; ir < mc; ir += GEMM_MR)
+    {
+      int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+      for (int p = 0; p < kc; p++)
+        {
+          for (int i = 0; i < GEMM_MR; i++)
+            {
+              *ap++ = i >= mr ? 0 : trans ? a[p * lda + ir + i]
+                                          : a[(ir + i) * lda + p];
+            }
+        }
+    }
+}
+
+/**
+ * Computes a MR x NR tile of C from packed slivers of A and B, keeping the
+ * whole tile in registers. Only the mr x nr valid corner is written back.
+ * A row of the tile is 8 floats: built with 512 bit vectors (-march of an
+ * AVX-512 cpu) gcc shuffles it into code several times slower, so it keeps
+ * to 256 bit ones. Not inlined, or link time optimization drops the
+ * preference.
+ * @param accumulate - add to C instead of overwriting it
+ */
+__attribute__((noinline, target ("prefer-vector-width=256")))
+static void micro_kernel (int kc, const float *ap, const float *bp, float *c,
+                          int ldc, int mr, int nr, bool accumulate)
+{
+  float acc[GEMM_MR][GEMM_NR] = {};
+  for (int p = 0; p < kc; p++)
+    {
+      for (int i = 0; i < GEMM_MR; i++)
+        {
+          float a_i = ap[i];
+          for (int j = 0; j < GEMM_NR; j++)
+            {
+              acc[i][j] += a_i * bp[j];
+            }
+        }
+      ap += GEMM_MR;
+      bp += GEMM_NR;
+    }
+  for (int i = 0; i < mr; i++)
+    {
+      for (int j = 0; j < nr; j++)
+        {
+          c[i * ldc + j] = accumulate ? c[i * ldc + j] + acc[i][j]
+                                      : acc[i][j];
+        }
+    }
+}
+
+/**
+ * y = A * x, where A is m x k and x is a vector of k elements.
+ */
+void gemv (int m, int k, const float *a, int lda, const float *x, int incx,
+           float *y)
+{
+  const float *xs = x;
+  // the kernel wants a contiguous x, gather it once if it is strided.
+  static thread_local std::vector<float> x_buf;
+  if (incx != 1)
+    {
+      x_buf.resize (k);
+      for (int l = 0; l < k; l++)
+        {
+          x_buf[l] = x[l * incx];
+        }
+      xs = x_buf.data ();
+    }
+  const SimdKernels &kernels = simd ();
+  for (int i = 0; i < m; i++)
+    {
+      y[i] = kernels.dot (a + i * lda, xs, k);
+    }
+}
+
+/**
+ * C = A * B, where A is m x k, B is k x n and C is m x n.
+ */
+void gemm (int m, int n, int k, const float *a, int lda, const float *b,
+           int ldb, float *c, int ldc)
+{
+  gemm_transposed (false, false, m, n, k, a, lda, b, ldb, c, ldc);
+}
+
+/**
+ * @return m rounded up to whole MR tall slivers.
+ */
+static int padded_rows (int m)
+{
+  return (m + GEMM_MR - 1) / GEMM_MR * GEMM_MR;
+}
+
+/**
+ * Where the cache blocked loops read A from: a itself, gemm_pack_a's
+ * panels, or 16 bit floats widened block by block.
+ */
+typedef struct Source
+{
+    const float *a;
+    const float *packed;
+    const uint16_t *half;
+    void (*widen)(const uint16_t *a, float *out, int n);
+} Source;
+
+/**
+ * The cache blocked loops of gemm_transposed. With source.packed set, A
+ * was packed by gemm_pack_a and a is not read: the MC x KC block at
+ * (ic, pc) starts pc * padded_rows (m) + ic * kc floats into packed, as
+ * every KC deep slab holds padded_rows (m) rows. With source.half set,
+ * every block of A is widened into fp32 rows, then packed.
+ */
+static void blocked (bool trans_a, bool trans_b, int m, int n, int k,
+                     const Source &source, int lda, const float *b, int ldb,
+                     float *c, int ldc)
+{
+  // packing buffers are reused between calls of the same thread.
+  static thread_local std::vector<float> a_pack;
+  static thread_local std::vector<float> a_wide;
+  static thread_local std::vector<float> b_pack;
+  const float *a = source.a;
+  const float *packed = source.packed;
+  if (packed == nullptr)
+    {
+      a_pack.resize ((GEMM_MC + GEMM_MR) * GEMM_KC);
+    }
+  if (source.half != nullptr)
+    {
+      a_wide.resize (GEMM_MC * GEMM_KC);
+    }
+  b_pack.resize ((GEMM_NC + GEMM_NR) * GEMM_KC);
+
+  for (int jc = 0; jc < n; jc += GEMM_NC)
+    {
+      int nc = n - jc < GEMM_NC ? n - jc : GEMM_NC;
+      for (int pc = 0; pc < k; pc += GEMM_KC)
+        {
+          int kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+          pack_b (trans_b, kc, nc,
+                  trans_b ? b + jc * ldb + pc : b + pc * ldb + jc, ldb,
+                  b_pack.data ());
+          for (int ic = 0; ic < m; ic += GEMM_MC)
+            {
+              int mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;
+              const float *ap = a_pack.data ();
+              if (packed != nullptr)
+                {
+                  ap = packed + (long) pc * padded_rows (m) + (long) ic * kc;
+                }
+              else if (source.half != nullptr)
+                {
+                  for (int i = 0; i < mc; i++)
+                    {
+                      source.widen (source.half + (long) (ic + i) * lda + pc,
+                                    a_wide.data () + i * kc, kc);
+                    }
+                  pack_a (false, mc, kc, a_wide.data (), kc, a_pack.data ());
+                }
+              else
+                {
+                  pack_a (trans_a, mc, kc,
+                          trans_a ? a + pc * lda + ic : a + ic * lda + pc,
+                          lda, a_pack.data ());
+                }
+              for (int jr = 0; jr < nc; jr += GEMM_NR)
+                {
+                  int nr = nc - jr < GEMM_NR ? nc - jr : GEMM_NR;
+                  for (int ir = 0; ir < mc; ir += GEMM_MR)
+                    {
+                      int mr = mc - ir < GEMM_MR ? mc - ir : GEMM_MR;
+                      micro_kernel (kc, ap + ir * kc,
+                                    b_pack.data () + jr * kc,
+                                    c + (ic + ir) * ldc + jc + jr, ldc,
+                                    mr, nr, pc != 0);
+                    }
+                }
+            }
+        }
+    }
+}
+
+/**
+ * C = op(A) * op(B), where op(X) is X or its transpose.
+ */
+void gemm_transposed (bool trans_a, bool trans_b, int m, int n, int k,
+                      const float *a, int lda, const float *b, int ldb,
+                      float *c, int ldc)
+{
+  if (n == 1 && ldc == 1 && !trans_a)
+    {
+      // a column op(B) is the same vector whether transposed or not.
+      gemv (m, k, a, lda, b, trans_b ? 1 : ldb, c);
+      return;
+    }
+  blocked (trans_a, trans_b, m, n, k, Source{a, nullptr, nullptr, nullptr},
+           lda, b, ldb, c, ldc);
+}
+
+/**
+ * @return floats of the packed copy of an m x k matrix.
+ */
+long gemm_packed_size (int m, int k)
+{
+  return (long) padded_rows (m) * k;
+}
+
+/**
+ * Packs A block by block, in the order and layout blocked reads them.
+ */
+void gemm_pack_a (int m, int k, const float *a, int lda, float *packed)
+{
+  for (int pc = 0; pc < k; pc += GEMM_KC)
+    {
+      int kc = k - pc < GEMM_KC ? k - pc : GEMM_KC;
+      for (int ic = 0; ic < m; ic += GEMM_MC)
+        {
+          int mc = m - ic < GEMM_MC ? m - ic : GEMM_MC;
+          pack_a (false, mc, kc, a + ic * lda + pc, lda,
+                  packed + (long) pc * padded_rows (m) + (long) ic * kc);
+        }
+    }
+}
+
+/**
+ * C = A * B, with A packed by gemm_pack_a.
+ */
+void gemm_prepacked (int m, int n, int k, const float *packed,
+                     const float *b, int ldb, float *c, int ldc)
+{
+  blocked (false, false, m, n, k, Source{nullptr, packed, nullptr, nullptr},
+           0, b, ldb, c, ldc);
+}
+
+/**
+ * C = A * B, with A's 16 bit floats widened as blocked packs them.
+ */
+void gemm_half (int m, int n, int k, const uint16_t *a, int lda,
+                void (*widen) (const uint16_t *a, float *out, int n),
+                const float *b, int ldb, float *c, int ldc)
+{
+  blocked (false, false, m, n, k, Source{nullptr, nullptr, a, widen}, lda, b,
+           ldb, c, ldc);
+}
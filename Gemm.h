@@ -0,0 +1,95 @@
+// Gemm.h
+
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <cstdint>
+
+/**
+ * Dense matrix multiplication kernels used by Matrix::operator*.
+ * All matrices are row major, ld* is the distance (in floats) between the
+ * beginnings of two consecutive rows.
+ */
+
+// register tile: every micro kernel call computes a GEMM_MR x GEMM_NR block.
+#define GEMM_MR 4
+#define GEMM_NR 8
+// cache blocks: a KC x NC panel of B stays in L2/L3, a MC x KC block of A
+// stays in L2, and one KC x NR sliver of B stays in L1.
+#define GEMM_MC 64
+#define GEMM_KC 256
+#define GEMM_NC 1024
+
+/**
+ * C = A * B, where A is m x k, B is k x n and C is m x n.
+ * Runs the gemv kernel when n == 1, otherwise a packed, cache blocked,
+ * register tiled kernel.
+ * @param m - rows of A and C
+ * @param n - cols of B and C
+ * @param k - cols of A, rows of B
+ * @param a - A's elements
+ * @param lda - A's row stride
+ * @param b - B's elements
+ * @param ldb - B's row stride
+ * @param c - C's elements, overwritten with the result
+ * @param ldc - C's row stride
+ */
+void gemm(int m, int n, int k, const float *a, int lda, const float *b,
+          int ldb, float *c, int ldc);
+
+/**
+ * C = op(A) * op(B), where op(X) is X or its transpose, op(A) is m x k and
+ * op(B) is k x n. The transposes are folded into the packing, so they cost
+ * nothing extra. a, b and their strides describe the matrices as stored.
+ * @param trans_a - use A's transpose, A is then stored k x m
+ * @param trans_b - use B's transpose, B is then stored n x k
+ */
+void gemm_transposed(bool trans_a, bool trans_b, int m, int n, int k,
+                     const float *a, int lda, const float *b, int ldb,
+                     float *c, int ldc);
+
+/**
+ * y = A * x, where A is m x k and x is a vector of k elements.
+ * @param m - rows of A
+ * @param k - cols of A
+ * @param a - A's elements
+ * @param lda - A's row stride
+ * @param x - the vector, x[i * incx] is its i'th element
+ * @param incx - the stride of x (ldb of a k x 1 matrix)
+ * @param y - the result, m contiguous floats
+ */
+void gemv(int m, int k, const float *a, int lda, const float *x, int incx,
+          float *y);
+
+/**
+ * @return number of floats gemm_pack_a writes for an m x k matrix.
+ */
+long gemm_packed_size(int m, int k);
+
+/**
+ * Packs A, m x k, into the MR tall panels the blocked kernel reads, once,
+ * so products with a fixed left matrix (a layer's weights) skip packing it
+ * on every call.
+ * @param packed - gemm_packed_size(m, k) floats, overwritten
+ */
+void gemm_pack_a(int m, int k, const float *a, int lda, float *packed);
+
+/**
+ * C = A * B as gemm does, with A given packed by gemm_pack_a(m, k, ...).
+ */
+void gemm_prepacked(int m, int n, int k, const float *packed,
+                    const float *b, int ldb, float *c, int ldc);
+
+/**
+ * C = A * B as gemm does, with A given as 16 bit floats (fp16 or bf16
+ * bits) that are widened MC x KC block by block as they are packed, so no
+ * fp32 copy of the whole of A is ever made.
+ * @param a - A's bits, lda of them between the beginnings of two rows
+ * @param widen - widens n bits to fp32, SimdKernels::fp16_to_fp32 or
+ *        bf16_to_fp32
+ */
+void gemm_half(int m, int n, int k, const uint16_t *a, int lda,
+               void (*widen)(const uint16_t *a, float *out, int n),
+               const float *b, int ldb, float *c, int ldc);
+
+#endif //GEMM_H
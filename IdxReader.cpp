@@ -0,0 +1,144 @@
+// IdxReader.cpp
+
+#include "IdxReader.h"
+#include "MlpNetwork.h"
+#include "Simd.h"
+#include <cstring>
+
+#define MAX_PIXEL 255.0f
+
+/**
+ * Reads one big endian 32 bit header field.
+ * @return false on a short read
+ */
+static bool read_be32 (std::istream &is, int &value)
+{
+  unsigned char bytes[4];
+  if (!is.read ((char *) bytes, sizeof (bytes)))
+    {
+      return false;
+    }
+  value = (int) (((unsigned) bytes[0] << 24) | ((unsigned) bytes[1] << 16)
+                 | ((unsigned) bytes[2] << 8) | bytes[3]);
+  return true;
+}
+
+/**
+ * Prints the IDX error for path and exits.
+ */
+static void idx_error (const std::string &path)
+{
+  std::cerr << IDX_FILE_ERROR << path << std::endl;
+  exit (EXIT_FAILURE);
+}
+
+/**
+ * Opens both files and validates their headers.
+ * @param images_path - IDX3 ubyte images file
+ * @param labels_path - IDX1 ubyte labels file
+ * @param chunk - maximal number of images per chunk
+ */
+IdxReader::IdxReader (const std::string &images_path,
+                      const std::string &labels_path, int chunk)
+    : _images_path (images_path), _labels_path (labels_path),
+      _images (images_path, std::ios::in | std::ios::binary),
+      _labels (labels_path, std::ios::in | std::ios::binary),
+      _size (0), _rows (0), _cols (0), _read (0), _count (0)
+{
+  int magic = 0;
+  if (!read_be32 (_images, magic) || magic != IDX_IMAGES_MAGIC
+      || !read_be32 (_images, _size) || !read_be32 (_images, _rows)
+      || !read_be32 (_images, _cols) || _size < 0 || _rows <= 0 || _cols <= 0)
+    {
+      idx_error (images_path);
+    }
+  int labels = 0;
+  if (!read_be32 (_labels, magic) || magic != IDX_LABELS_MAGIC
+      || !read_be32 (_labels, labels) || labels != _size)
+    {
+      idx_error (labels_path);
+    }
+  if (chunk <= 0)
+    {
+      std::cerr << ROWS_COLS_ERROR << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  _pixels.resize ((size_t) chunk * image_size ());
+  _label_bytes.resize (chunk);
+  _batch = Matrix (chunk, image_size ());
+}
+
+int IdxReader::size () const
+{
+  return _size;
+}
+
+int IdxReader::image_size () const
+{
+  return _rows * _cols;
+}
+
+/**
+ * Reads the next chunk of images and labels.
+ * @return number of images read, 0 at the end of the data set
+ */
+int IdxReader::next ()
+{
+  int chunk = _batch.get_rows ();
+  _count = _size - _read < chunk ? _size - _read : chunk;
+  if (_count == 0)
+    {
+      return 0;
+    }
+  size_t pixels = (size_t) _count * image_size ();
+  if (!_images.read ((char *) _pixels.data (), (std::streamsize) pixels))
+    {
+      idx_error (_images_path);
+    }
+  if (!_labels.read ((char *) _label_bytes.data (), _count))
+    {
+      idx_error (_labels_path);
+    }
+  simd ().u8_to_fp32 (_pixels.data (), 1 / MAX_PIXEL, 0, _batch.data (),
+                      (int) pixels);
+  _read += _count;
+  return _count;
+}
+
+MatrixView IdxReader::images () const
+{
+  return MatrixView (_batch.data (), _count, image_size ());
+}
+
+const unsigned char *IdxReader::labels () const
+{
+  return _label_bytes.data ();
+}
+
+/**
+ * Reads a whole IDX data set into memory.
+ * Exits (code == 1) if the files are invalid or the images are not 28x28.
+ * @param images - set to N x 784, one image per row
+ * @param labels - set to the N labels
+ */
+void load_set (const std::string &images_path, const std::string &labels_path,
+               Matrix &images, std::vector<unsigned char> &labels)
+{
+  IdxReader reader (images_path, labels_path);
+  int pixels = img_dims.rows * img_dims.cols;
+  if (reader.image_size () != pixels)
+    {
+      std::cerr << ERROR_IDX_SIZE << images_path << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  images = Matrix (reader.size (), pixels);
+  labels.resize (reader.size ());
+  int row = 0;
+  for (int count = reader.next (); count > 0; count = reader.next ())
+    {
+      std::memcpy (images.data () + (size_t) row * pixels,
+                   reader.images ().data (), sizeof (float) * count * pixels);
+      std::memcpy (labels.data () + row, reader.labels (), count);
+      row += count;
+    }
+}
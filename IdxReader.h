@@ -0,0 +1,83 @@
+// IdxReader.h
+
+#ifndef IDXREADER_H
+#define IDXREADER_H
+
+#include <fstream>
+#include <string>
+#include <vector>
+#include "Matrix.h"
+
+#define IDX_IMAGES_MAGIC 0x00000803 // unsigned byte, 3 dimensions
+#define IDX_LABELS_MAGIC 0x00000801 // unsigned byte, 1 dimension
+#define IDX_CHUNK 256
+#define IDX_FILE_ERROR "Error: invalid IDX file: "
+#define ERROR_IDX_SIZE "Error: IDX images are not 28x28: "
+
+/**
+ * Streams an IDX (MNIST ubyte) image file and its label file in chunks.
+ * Pixels are decoded to floats in [0, 1], one image per row of a
+ * chunk x (rows * cols) batch, so memory use is bounded by the chunk size
+ * whatever the size of the data set.
+ */
+class IdxReader
+{
+ public:
+  /**
+   * Opens both files and validates their headers.
+   * Exits (code == 1) if a file is missing, malformed, or the counts differ.
+   * @param images_path - IDX3 ubyte images file
+   * @param labels_path - IDX1 ubyte labels file
+   * @param chunk - maximal number of images per chunk
+   */
+  IdxReader(const std::string &images_path, const std::string &labels_path,
+            int chunk = IDX_CHUNK);
+
+  /**
+   * @return number of images in the data set.
+   */
+  int size() const;
+  /**
+   * @return pixels per image (rows * cols).
+   */
+  int image_size() const;
+  /**
+   * Reads the next chunk of images and labels.
+   * Exits (code == 1) if the files are shorter than their headers claim.
+   * @return number of images read, 0 at the end of the data set
+   */
+  int next();
+  /**
+   * @return the images of the last chunk, one normalized image per row;
+   *         no rows before the first chunk and after the last one.
+   */
+  MatrixView images() const;
+  /**
+   * @return the labels of the last chunk.
+   */
+  const unsigned char *labels() const;
+
+ private:
+  std::string _images_path;
+  std::string _labels_path;
+  std::ifstream _images;
+  std::ifstream _labels;
+  int _size, _rows, _cols;
+  int _read; // images read so far
+  int _count; // images in the last chunk
+  std::vector<unsigned char> _pixels;
+  std::vector<unsigned char> _label_bytes;
+  Matrix _batch;
+};
+
+/**
+ * Reads a whole IDX data set into memory, for the tools that go over it
+ * several times.
+ * Exits (code == 1) if the files are invalid or the images are not 28x28.
+ * @param images - set to N x 784, one image per row
+ * @param labels - set to the N labels
+ */
+void load_set(const std::string &images_path, const std::string &labels_path,
+              Matrix &images, std::vector<unsigned char> &labels);
+
+#endif //IDXREADER_H
@@ -0,0 +1,448 @@
+// InferenceServer.cpp
+
+#include "InferenceServer.h"
+#include "Preprocess.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define ERROR_SOCKET "Error: failed to listen on socket: "
+// bytes read from a connection per call.
+#define RECV_CHUNK 65536
+
+/**
+ * Binds and listens on the socket, replacing a stale socket file, and
+ * starts the reader thread.
+ * Exits (code == 1) if the socket cannot be created.
+ */
+InferenceServer::InferenceServer (const MlpNetwork &mlp,
+                                  const std::string &socket_path,
+                                  long budget_us, int max_batch)
+    : _mlp (mlp), _path (socket_path), _listen (-1), _budget_us (budget_us),
+      _max_batch (max_batch), _next_id (0),
+      _batch (max_batch, img_dims.rows * img_dims.cols),
+      _probs ((size_t) max_batch * TEN),
+      _stop (false), _requests (0), _batches (0), _closing (false),
+      _wake (-1)
+{
+  sockaddr_un address{};
+  address.sun_family = AF_UNIX;
+  if (mlp.get_classes () != TEN || max_batch <= 0 || budget_us < 0)
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  if (_path.empty () || _path.size () >= sizeof (address.sun_path))
+    {
+      std::cerr << ERROR_SOCKET << _path << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  std::strcpy (address.sun_path, _path.c_str ());
+  unlink (_path.c_str ());
+  _listen = socket (AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (_listen < 0 || bind (_listen, (sockaddr *) &address, sizeof (address))
+      || listen (_listen, SOMAXCONN))
+    {
+      std::cerr << ERROR_SOCKET << _path << ": " << std::strerror (errno)
+                << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  _wake = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (_wake < 0)
+    {
+      std::cerr << ERROR_SOCKET << _path << ": " << std::strerror (errno)
+                << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  _reader = std::thread (&InferenceServer::read_paths, this);
+}
+
+/**
+ * Stops the reader thread, after the path it is reading, closes every
+ * connection and removes the socket file.
+ */
+InferenceServer::~InferenceServer ()
+{
+  {
+    std::lock_guard<std::mutex> guard (_lock);
+    _closing = true;
+  }
+  _requested.notify_one ();
+  _reader.join ();
+  close (_wake);
+  for (const auto &entry : _connections)
+    {
+      close (entry.second.fd);
+    }
+  close (_listen);
+  unlink (_path.c_str ());
+}
+
+void InferenceServer::stop ()
+{
+  _stop = true;
+}
+
+long InferenceServer::requests () const
+{
+  return _requests;
+}
+
+long InferenceServer::batches () const
+{
+  return _batches;
+}
+
+/**
+ * Serves requests until stop is called.
+ */
+void InferenceServer::run ()
+{
+  std::vector<pollfd> fds;
+  std::vector<long> ids; // ids[i] is the connection of fds[i + 2]
+  while (!_stop)
+    {
+      fds.assign (1, pollfd{_listen, POLLIN, 0});
+      fds.push_back (pollfd{_wake, POLLIN, 0});
+      ids.clear ();
+      for (const auto &entry : _connections)
+        {
+          const Connection &connection = entry.second;
+          short events = connection.eof || backlogged (connection)
+                         ? 0 : POLLIN;
+          events |= connection.sent < connection.out.size () ? POLLOUT : 0;
+          // a negative socket is skipped, nothing is expected of it.
+          fds.push_back (pollfd{events ? connection.fd : -1, events, 0});
+          ids.push_back (entry.first);
+        }
+      long remaining = remaining_us ();
+      timespec timeout{0, 0};
+      if (remaining < 0)
+        {
+          timeout.tv_nsec = SERVE_IDLE_MS * 1000000L;
+        }
+      else
+        {
+          timeout.tv_sec = remaining / 1000000;
+          timeout.tv_nsec = remaining % 1000000 * 1000;
+        }
+      // a signal interrupts the wait (EINTR), then the loop checks _stop.
+      if (ppoll (fds.data (), fds.size (), &timeout, nullptr) < 0)
+        {
+          continue;
+        }
+
+      for (size_t i = 2; i < fds.size (); i++)
+        {
+          auto found = _connections.find (ids[i - 2]);
+          Connection &connection = found->second;
+          bool alive = !(fds[i].revents & (POLLERR | POLLNVAL));
+          if (alive && fds[i].revents & (POLLIN | POLLHUP))
+            {
+              alive = receive (found->first, connection);
+            }
+          if (!alive)
+            {
+              // its pending requests are answered to nobody.
+              close (connection.fd);
+              _connections.erase (found);
+            }
+        }
+      if (fds[1].revents & POLLIN)
+        {
+          take_loaded ();
+        }
+      if (!_pending.empty () && remaining_us () == 0)
+        {
+          flush ();
+        }
+      for (auto it = _connections.begin (); it != _connections.end ();)
+        {
+          Connection &connection = it->second;
+          bool alive = send_replies (connection);
+          // requests left unread while it was backlogged.
+          if (alive && !connection.in.empty () && !backlogged (connection))
+            {
+              alive = queue_requests (it->first, connection);
+            }
+          if (!alive || (connection.eof && connection.waiting == 0
+                         && connection.loading == 0
+                         && connection.out.empty ()))
+            {
+              close (connection.fd);
+              it = _connections.erase (it);
+            }
+          else
+            {
+              ++it;
+            }
+        }
+      if (fds[0].revents & POLLIN)
+        {
+          accept_connections ();
+        }
+    }
+}
+
+void InferenceServer::accept_connections ()
+{
+  int fd;
+  while ((fd = accept4 (_listen, nullptr, nullptr,
+                        SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+    {
+      _connections[_next_id++] = Connection{fd, {}, {}, 0, 0, 0, false};
+    }
+}
+
+/**
+ * Reads what the connection has, a chunk at a time, and queues its
+ * complete requests, until it is backlogged. Its input then holds at most
+ * a chunk and a partial request.
+ * @return false if the connection is broken or sent an invalid request
+ */
+bool InferenceServer::receive (long id, Connection &connection)
+{
+  char chunk[RECV_CHUNK];
+  while (!backlogged (connection))
+    {
+      ssize_t count = recv (connection.fd, chunk, sizeof (chunk), 0);
+      if (count == 0)
+        {
+          connection.eof = true;
+          break;
+        }
+      if (count < 0)
+        {
+          return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+      connection.in.insert (connection.in.end (), chunk, chunk + count);
+      if (!queue_requests (id, connection))
+        {
+          return false;
+        }
+    }
+  return true;
+}
+
+/**
+ * Queues the complete requests read from the connection, until it is
+ * backlogged; the rest stay in its input.
+ * @return false if the connection sent an invalid request
+ */
+bool InferenceServer::queue_requests (long id, Connection &connection)
+{
+  const size_t image_bytes = _batch.get_cols () * sizeof (float);
+  const std::vector<char> &in = connection.in;
+  size_t used = 0;
+  while (used < in.size () && !backlogged (connection))
+    {
+      size_t left = in.size () - used;
+      if (in[used] == SERVE_IMAGE)
+        {
+          // it is answered after the paths before it.
+          if (left < 1 + image_bytes || connection.loading > 0)
+            {
+              break;
+            }
+          enqueue (id, in.data () + used + 1, true);
+          used += 1 + image_bytes;
+        }
+      else if (in[used] == SERVE_PATH)
+        {
+          uint32_t length;
+          if (left < 1 + sizeof (length))
+            {
+              break;
+            }
+          std::memcpy (&length, in.data () + used + 1, sizeof (length));
+          if (length > SERVE_MAX_PATH)
+            {
+              return false;
+            }
+          if (left < 1 + sizeof (length) + length)
+            {
+              break;
+            }
+          {
+            std::lock_guard<std::mutex> guard (_lock);
+            _to_load.push_back (Load{id, std::string (in.data () + used + 1
+                                                      + sizeof (length),
+                                                      length), {}, false});
+          }
+          _requested.notify_one ();
+          connection.loading++;
+          used += 1 + sizeof (length) + length;
+        }
+      else
+        {
+          return false;
+        }
+    }
+  connection.in.erase (connection.in.begin (), connection.in.begin () + used);
+  return true;
+}
+
+/**
+ * @return true if the connection has SERVE_BACKLOG requests loading,
+ *         waiting or unsent, so no more of its requests are read
+ */
+bool InferenceServer::backlogged (const Connection &connection) const
+{
+  size_t unsent = (connection.out.size () - connection.sent)
+                  / sizeof (ServeResponse);
+  return connection.loading + connection.waiting + unsent >= SERVE_BACKLOG;
+}
+
+/**
+ * Queues one image, and runs the pending batch once it is full.
+ */
+void InferenceServer::enqueue (long id, const char *pixels, bool ok)
+{
+  if (_pending.empty ())
+    {
+      _oldest = Clock::now ();
+    }
+  if (ok)
+    {
+      // the payload may not be aligned for floats.
+      std::memcpy (_batch.row ((int) _pending.size ()), pixels,
+                   _batch.get_cols () * sizeof (float));
+    }
+  _pending.push_back (Pending{id, ok});
+  _connections[id].waiting++;
+  if ((int) _pending.size () == _max_batch)
+    {
+      flush ();
+    }
+}
+
+/**
+ * Queues the images the reader thread has read since the last call, in
+ * request order. Those of closed connections are dropped.
+ */
+void InferenceServer::take_loaded ()
+{
+  eventfd_t signals;
+  eventfd_read (_wake, &signals);
+  std::vector<Load> loaded;
+  {
+    std::lock_guard<std::mutex> guard (_lock);
+    loaded.swap (_loaded);
+  }
+  for (const Load &load : loaded)
+    {
+      auto found = _connections.find (load.connection);
+      if (found == _connections.end ())
+        {
+          continue;
+        }
+      found->second.loading--;
+      enqueue (load.connection, (const char *) load.image.data (), load.ok);
+    }
+}
+
+/**
+ * Reader thread: takes the requested paths in order, reads each without
+ * the lock, and wakes run with the result, until the server is destroyed.
+ */
+void InferenceServer::read_paths ()
+{
+  std::unique_lock<std::mutex> guard (_lock);
+  while (true)
+    {
+      _requested.wait (guard, [this] ()
+      { return _closing || !_to_load.empty (); });
+      if (_closing)
+        {
+          return;
+        }
+      Load load = std::move (_to_load.front ());
+      _to_load.pop_front ();
+      guard.unlock ();
+      load.image.resize ((size_t) img_dims.rows * img_dims.cols);
+      load.ok = read_image (load.path, load.image.data ());
+      guard.lock ();
+      _loaded.push_back (std::move (load));
+      eventfd_write (_wake, 1);
+    }
+}
+
+/**
+ * Runs the pending batch as one forward pass and queues the replies.
+ */
+void InferenceServer::flush ()
+{
+  int count = (int) _pending.size ();
+  _mlp.distribution_batch (MatrixView (_batch.data (), count,
+                                       _batch.get_cols ()), _probs.data ());
+  _batches++;
+  for (int i = 0; i < count; i++)
+    {
+      auto found = _connections.find (_pending[i].connection);
+      if (found == _connections.end ())
+        {
+          continue;
+        }
+      ServeResponse response{SERVE_BAD_IMAGE, 0, 0, {}};
+      if (_pending[i].ok)
+        {
+          digit top;
+          const float *probs = _probs.data () + (size_t) i * TEN;
+          MlpNetwork::top_k (probs, TEN, &top, 1);
+          response.status = SERVE_OK;
+          response.value = top.value;
+          response.probability = top.probability;
+          std::memcpy (response.probs, probs, sizeof (response.probs));
+        }
+      Connection &connection = found->second;
+      const char *bytes = (const char *) &response;
+      connection.out.insert (connection.out.end (), bytes,
+                             bytes + sizeof (response));
+      connection.waiting--;
+      _requests++;
+    }
+  _pending.clear ();
+}
+
+/**
+ * Sends what the connection's socket accepts of its replies.
+ * @return false if the connection is broken
+ */
+bool InferenceServer::send_replies (Connection &connection)
+{
+  while (connection.sent < connection.out.size ())
+    {
+      ssize_t count = send (connection.fd,
+                            connection.out.data () + connection.sent,
+                            connection.out.size () - connection.sent,
+                            MSG_NOSIGNAL);
+      if (count < 0)
+        {
+          return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+      connection.sent += count;
+    }
+  connection.out.clear ();
+  connection.sent = 0;
+  return true;
+}
+
+/**
+ * @return microseconds until the oldest pending request's budget expires,
+ *         -1 when nothing is pending
+ */
+long InferenceServer::remaining_us () const
+{
+  if (_pending.empty ())
+    {
+      return -1;
+    }
+  long waited = (long) std::chrono::duration_cast<std::chrono::microseconds> (
+      Clock::now () - _oldest).count ();
+  return waited >= _budget_us ? 0 : _budget_us - waited;
+}
@@ -0,0 +1,209 @@
+// InferenceServer.h
+
+#ifndef INFERENCESERVER_H
+#define INFERENCESERVER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "MlpNetwork.h"
+
+#define SERVE_MAX_BATCH 64
+#define SERVE_BUDGET_US 1000
+// longest image path a request may carry.
+#define SERVE_MAX_PATH 4096
+// longest wait for a socket when nothing is pending, between stop checks.
+#define SERVE_IDLE_MS 100
+// requests of a connection in the pending batch or answered but not sent,
+// past which it is not read until its client takes the replies.
+#define SERVE_BACKLOG (4 * SERVE_MAX_BATCH)
+
+// request types, the first byte of every request.
+#define SERVE_IMAGE 'I' // followed by 784 native endian floats
+// followed by a uint32 length and the path's bytes, of a raw 784 float
+// file or a PGM file (see read_image).
+#define SERVE_PATH 'P'
+
+#define SERVE_OK 0
+#define SERVE_BAD_IMAGE 1
+
+/**
+ * @struct ServeResponse
+ * @brief Reply to one request, in native byte order. Replies on a
+ *        connection come in the order of its requests.
+ * @var status - SERVE_OK, or SERVE_BAD_IMAGE if the path could not be read
+ *      as an image, then the other fields are zero
+ * @var value - the identified digit
+ * @var probability - its probability
+ * @var probs - the whole output distribution
+ */
+typedef struct ServeResponse
+{
+    int32_t status;
+    uint32_t value;
+    float probability;
+    float probs[TEN];
+} ServeResponse;
+
+/**
+ * A long running server that answers classification requests over a Unix
+ * domain stream socket, so the network is loaded once for all of them.
+ * One thread multiplexes every connection with poll; the requests of all
+ * connections gather in a pending batch that runs through the network as
+ * one batched forward pass when it holds max_batch images, or when its
+ * oldest request has waited the latency budget. Path requests are read in
+ * order by a reader thread, so a slow file delays only path requests,
+ * never the poll loop, image requests or the batch budget.
+ */
+class InferenceServer
+{
+ public:
+  /**
+   * Binds and listens on the socket, replacing a stale socket file, and
+   * starts the reader thread.
+   * Exits (code == 1) if the socket cannot be created, or the network does
+   * not have 10 classes.
+   * @param mlp - the network, must outlive the server
+   * @param socket_path - file system path of the socket
+   * @param budget_us - longest a request waits for its batch to fill, in
+   *        microseconds
+   * @param max_batch - most images per forward pass
+   */
+  InferenceServer(const MlpNetwork &mlp, const std::string &socket_path,
+                  long budget_us = SERVE_BUDGET_US,
+                  int max_batch = SERVE_MAX_BATCH);
+  InferenceServer(const InferenceServer&) = delete;
+  InferenceServer& operator=(const InferenceServer&) = delete;
+  /**
+   * Stops the reader thread, closes every connection and removes the
+   * socket file.
+   */
+  ~InferenceServer();
+
+  /**
+   * Serves requests until stop is called.
+   */
+  void run();
+  /**
+   * Makes run return, after the pass in progress. Safe to call from a
+   * signal handler, which interrupts the wait, or from another thread,
+   * which is noticed within SERVE_IDLE_MS.
+   */
+  void stop();
+  /**
+   * @return number of requests answered.
+   */
+  long requests() const;
+  /**
+   * @return number of forward passes run.
+   */
+  long batches() const;
+
+ private:
+  typedef std::chrono::steady_clock Clock;
+
+  struct Connection
+  {
+    int fd;
+    std::vector<char> in; // bytes of incomplete requests
+    std::vector<char> out; // replies not yet sent
+    size_t sent; // bytes of out already sent
+    int waiting; // requests in the pending batch
+    // path requests at the reader thread; its image requests wait for them
+    // so the replies keep the requests' order.
+    int loading;
+    bool eof; // the peer will send nothing more
+  };
+  struct Pending
+  {
+    long connection; // id of the requesting connection
+    bool ok; // false if its image could not be read
+  };
+  struct Load
+  {
+    long connection; // id of the requesting connection
+    std::string path;
+    std::vector<float> image; // set by the reader thread
+    bool ok; // false if the image could not be read
+  };
+
+  void accept_connections();
+  /**
+   * Reads what the connection has, and queues its complete requests,
+   * until it is backlogged.
+   * @return false if the connection is broken or sent an invalid request
+   */
+  bool receive(long id, Connection &connection);
+  /**
+   * Queues the complete requests read from the connection, until it is
+   * backlogged; the rest stay in its input.
+   * @return false if the connection sent an invalid request
+   */
+  bool queue_requests(long id, Connection &connection);
+  /**
+   * @return true if the connection has SERVE_BACKLOG requests loading,
+   *         waiting or unsent, so no more of its requests are read
+   */
+  bool backlogged(const Connection &connection) const;
+  /**
+   * Queues one image, and runs the pending batch once it is full.
+   */
+  void enqueue(long id, const char *pixels, bool ok);
+  /**
+   * Queues the images the reader thread has read since the last call.
+   */
+  void take_loaded();
+  /**
+   * Reader thread: reads the requested paths in order until the server
+   * is destroyed.
+   */
+  void read_paths();
+  /**
+   * Runs the pending batch and queues the replies.
+   */
+  void flush();
+  /**
+   * Sends what the connection's socket accepts of its replies.
+   * @return false if the connection is broken
+   */
+  bool send_replies(Connection &connection);
+  /**
+   * @return microseconds until the oldest pending request's budget
+   *         expires, -1 when nothing is pending
+   */
+  long remaining_us() const;
+
+  const MlpNetwork &_mlp;
+  std::string _path;
+  int _listen;
+  long _budget_us;
+  int _max_batch;
+  // by id: a closed connection's socket number may be reused while its
+  // requests are still pending.
+  std::map<long, Connection> _connections;
+  long _next_id;
+  std::vector<Pending> _pending;
+  Clock::time_point _oldest; // arrival of _pending[0]
+  Matrix _batch; // max_batch x 784, row i is _pending[i]'s image
+  std::vector<float> _probs;
+  std::atomic<bool> _stop;
+  long _requests;
+  long _batches;
+  // the reader thread's requests and results, in request order.
+  std::deque<Load> _to_load;
+  std::vector<Load> _loaded;
+  bool _closing; // the reader thread must return
+  int _wake; // eventfd the reader thread signals, polled by run
+  std::mutex _lock; // guards _to_load, _loaded and _closing
+  std::condition_variable _requested; // a path was queued, or closing
+  std::thread _reader;
+};
+
+#endif //INFERENCESERVER_H
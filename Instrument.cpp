@@ -0,0 +1,462 @@
+// Instrument.cpp
+
+#include "Instrument.h"
+
+#ifdef MLP_INSTRUMENT
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <vector>
+
+// constant initialized, so allocations made before main are counted too.
+static std::atomic<long> total_allocations (0);
+static std::atomic<long> total_bytes (0);
+static thread_local long thread_allocation_count = 0;
+
+/**
+ * @struct LayerTotals
+ * @brief Running totals of one layer's spans.
+ */
+typedef struct LayerTotals
+{
+    long calls;
+    long duration_ns;
+    double flops;
+    long allocations;
+} LayerTotals;
+
+/**
+ * Running totals of one layer's spans on one thread. Only that thread
+ * writes them, so it adds with a relaxed load and store, no locked
+ * instruction; exports read them at any time.
+ */
+struct LayerCounters
+{
+  std::atomic<long> calls;
+  std::atomic<long> duration_ns;
+  std::atomic<double> flops;
+  std::atomic<long> allocations;
+};
+
+/**
+ * One thread's ring buffer and layer totals, written by that thread with
+ * no lock. A span's slot is written first and published by storing
+ * recorded, so an export reads the slots below recorded and drops the
+ * ones the thread may have been overwriting meanwhile.
+ */
+struct ThreadTrace
+{
+  int thread; // small number of the thread, for the trace
+  TraceEvent events[TRACE_CAPACITY];
+  // spans ever recorded, the next goes to recorded % capacity
+  std::atomic<long> recorded;
+  LayerCounters layers[TRACE_MAX_LAYERS];
+  // what the last reset saw, exports count from there. Under the lock.
+  long first;
+  LayerTotals cleared[TRACE_MAX_LAYERS];
+
+  explicit ThreadTrace (int number) : thread (number), events (),
+                                      recorded (0), layers (), first (0),
+                                      cleared ()
+  {}
+};
+
+/**
+ * The threads' traces, created on first use. The lock is only taken by
+ * the exports, reset, and a thread's first span; the traces are kept
+ * after their threads exit. At exit it writes the trace file named by
+ * TRACE_ENV, if set.
+ */
+struct TraceState
+{
+  std::chrono::steady_clock::time_point start;
+  std::mutex lock;
+  std::vector<ThreadTrace *> threads;
+
+  TraceState () : start (std::chrono::steady_clock::now ())
+  {}
+
+  ~TraceState ()
+  {
+    const char *path = std::getenv (TRACE_ENV);
+    if (path != nullptr && *path != '\0')
+      {
+        std::ofstream os (path);
+        Instrument::write_chrome_trace (os);
+        Instrument::report (std::cerr);
+      }
+    for (ThreadTrace *trace : threads)
+      {
+        delete trace;
+      }
+  }
+};
+
+static TraceState &state ()
+{
+  static TraceState trace_state;
+  return trace_state;
+}
+
+/**
+ * Adds value to a counter only the calling thread writes.
+ */
+template<typename T>
+static void add (std::atomic<T> &counter, T value)
+{
+  counter.store (counter.load (std::memory_order_relaxed) + value,
+                 std::memory_order_relaxed);
+}
+
+/**
+ * @return the calling thread's trace, registered on its first span.
+ */
+static ThreadTrace &thread_trace ()
+{
+  static thread_local ThreadTrace *mine = nullptr;
+  if (mine == nullptr)
+    {
+      TraceState &trace = state ();
+      std::lock_guard<std::mutex> guard (trace.lock);
+      mine = new ThreadTrace ((int) trace.threads.size ());
+      trace.threads.push_back (mine);
+    }
+  return *mine;
+}
+
+/**
+ * @return the spans of trace an export can trust, oldest first: those
+ * since the last reset that are still in the ring and were not being
+ * overwritten while they were copied. Called under the lock.
+ */
+static std::vector<TraceEvent> snapshot (const ThreadTrace &trace)
+{
+  long end = trace.recorded.load (std::memory_order_acquire);
+  long begin = std::max (trace.first, end - TRACE_CAPACITY);
+  std::vector<TraceEvent> events;
+  events.reserve (end - begin);
+  for (long i = begin; i < end; i++)
+    {
+      events.push_back (trace.events[i % TRACE_CAPACITY]);
+    }
+  std::atomic_thread_fence (std::memory_order_acquire);
+  // span i's slot is reused by span i + capacity, which may be under way
+  // once recorded reached it.
+  long reused = trace.recorded.load (std::memory_order_relaxed)
+                - TRACE_CAPACITY + 1;
+  if (reused > begin)
+    {
+      events.erase (events.begin (),
+                    events.begin () + std::min (reused - begin,
+                                                (long) events.size ()));
+    }
+  return events;
+}
+
+/**
+ * @return the totals of layer l over all threads since the last reset.
+ * Called under the lock.
+ */
+static LayerTotals layer_totals (const TraceState &trace, int l)
+{
+  LayerTotals totals{0, 0, 0, 0};
+  for (const ThreadTrace *thread : trace.threads)
+    {
+      const LayerCounters &c = thread->layers[l];
+      const LayerTotals &cleared = thread->cleared[l];
+      totals.calls += c.calls.load (std::memory_order_relaxed)
+                      - cleared.calls;
+      totals.duration_ns += c.duration_ns.load (std::memory_order_relaxed)
+                            - cleared.duration_ns;
+      totals.flops += c.flops.load (std::memory_order_relaxed)
+                      - cleared.flops;
+      totals.allocations += c.allocations.load (std::memory_order_relaxed)
+                            - cleared.allocations;
+    }
+  return totals;
+}
+
+static void count_allocation (std::size_t size)
+{
+  total_allocations.fetch_add (1, std::memory_order_relaxed);
+  total_bytes.fetch_add ((long) size, std::memory_order_relaxed);
+  thread_allocation_count++;
+}
+
+void *operator new (std::size_t size)
+{
+  count_allocation (size);
+  void *p = std::malloc (size ? size : 1);
+  if (p == nullptr)
+    {
+      throw std::bad_alloc ();
+    }
+  return p;
+}
+
+void *operator new[] (std::size_t size)
+{
+  return operator new (size);
+}
+
+void *operator new (std::size_t size, const std::nothrow_t &) noexcept
+{
+  count_allocation (size);
+  return std::malloc (size ? size : 1);
+}
+
+void *operator new[] (std::size_t size, const std::nothrow_t &) noexcept
+{
+  return operator new (size, std::nothrow);
+}
+
+void operator delete (void *p) noexcept
+{
+  std::free (p);
+}
+
+void operator delete[] (void *p) noexcept
+{
+  std::free (p);
+}
+
+void operator delete (void *p, std::size_t) noexcept
+{
+  std::free (p);
+}
+
+void operator delete[] (void *p, std::size_t) noexcept
+{
+  std::free (p);
+}
+
+void operator delete (void *p, const std::nothrow_t &) noexcept
+{
+  std::free (p);
+}
+
+void operator delete[] (void *p, const std::nothrow_t &) noexcept
+{
+  std::free (p);
+}
+
+// the aligned forms, which Matrix's allocators use, are counted too.
+void *operator new (std::size_t size, std::align_val_t alignment,
+                    const std::nothrow_t &) noexcept
+{
+  count_allocation (size);
+  void *p = nullptr;
+  if (posix_memalign (&p, (std::size_t) alignment, size ? size : 1) != 0)
+    {
+      return nullptr;
+    }
+  return p;
+}
+
+void *operator new[] (std::size_t size, std::align_val_t alignment,
+                      const std::nothrow_t &) noexcept
+{
+  return operator new (size, alignment, std::nothrow);
+}
+
+void *operator new (std::size_t size, std::align_val_t alignment)
+{
+  void *p = operator new (size, alignment, std::nothrow);
+  if (p == nullptr)
+    {
+      throw std::bad_alloc ();
+    }
+  return p;
+}
+
+void *operator new[] (std::size_t size, std::align_val_t alignment)
+{
+  return operator new (size, alignment);
+}
+
+void operator delete (void *p, std::align_val_t) noexcept
+{
+  std::free (p);
+}
+
+void operator delete[] (void *p, std::align_val_t) noexcept
+{
+  std::free (p);
+}
+
+void operator delete (void *p, std::size_t, std::align_val_t) noexcept
+{
+  std::free (p);
+}
+
+void operator delete[] (void *p, std::size_t, std::align_val_t) noexcept
+{
+  std::free (p);
+}
+
+void operator delete (void *p, std::align_val_t,
+                      const std::nothrow_t &) noexcept
+{
+  std::free (p);
+}
+
+void operator delete[] (void *p, std::align_val_t,
+                        const std::nothrow_t &) noexcept
+{
+  std::free (p);
+}
+
+long Instrument::now_ns ()
+{
+  return (long) std::chrono::duration_cast<std::chrono::nanoseconds> (
+      std::chrono::steady_clock::now () - state ().start).count ();
+}
+
+long Instrument::thread_allocations ()
+{
+  return thread_allocation_count;
+}
+
+long Instrument::allocations ()
+{
+  return total_allocations;
+}
+
+long Instrument::allocated_bytes ()
+{
+  return total_bytes;
+}
+
+/**
+ * Records a finished span into the calling thread's ring buffer and
+ * totals, without taking a lock.
+ */
+void Instrument::record (const TraceEvent &event)
+{
+  ThreadTrace &trace = thread_trace ();
+  long recorded = trace.recorded.load (std::memory_order_relaxed);
+  TraceEvent &slot = trace.events[recorded % TRACE_CAPACITY];
+  slot = event;
+  slot.thread = trace.thread;
+  trace.recorded.store (recorded + 1, std::memory_order_release);
+  if (event.layer >= 0)
+    {
+      LayerCounters &counters = trace.layers[event.layer < TRACE_MAX_LAYERS
+                                             ? event.layer
+                                             : TRACE_MAX_LAYERS - 1];
+      add (counters.calls, 1L);
+      add (counters.duration_ns, event.duration_ns);
+      add (counters.flops, event.flops);
+      add (counters.allocations, event.allocations);
+    }
+}
+
+/**
+ * Writes the spans in the ring buffers, in start order, as complete ("X")
+ * events of the Chrome trace event format. Times are in microseconds.
+ */
+void Instrument::write_chrome_trace (std::ostream &os)
+{
+  TraceState &trace = state ();
+  std::vector<TraceEvent> events;
+  {
+    std::lock_guard<std::mutex> guard (trace.lock);
+    for (const ThreadTrace *thread : trace.threads)
+      {
+        std::vector<TraceEvent> spans = snapshot (*thread);
+        events.insert (events.end (), spans.begin (), spans.end ());
+      }
+  }
+  std::stable_sort (events.begin (), events.end (),
+                    [] (const TraceEvent &a, const TraceEvent &b)
+                    { return a.start_ns < b.start_ns; });
+  os << "{\"traceEvents\": [" << std::endl << std::fixed
+     << std::setprecision (3);
+  for (size_t i = 0; i < events.size (); i++)
+    {
+      const TraceEvent &e = events[i];
+      os << "  {\"name\": \"" << e.name;
+      if (e.layer >= 0)
+        {
+          os << "." << e.layer + 1;
+        }
+      os << "\", \"cat\": \"" << (e.layer >= 0 ? "layer" : "pass")
+         << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << e.thread
+         << ", \"ts\": " << e.start_ns / 1000.0 << ", \"dur\": "
+         << e.duration_ns / 1000.0 << ", \"args\": {\"flops\": "
+         << std::setprecision (0) << e.flops << ", \"allocations\": "
+         << e.allocations << "}}" << std::setprecision (3)
+         << (i + 1 < events.size () ? "," : "") << std::endl;
+    }
+  os << "], \"displayTimeUnit\": \"ns\"}" << std::defaultfloat << std::endl;
+}
+
+/**
+ * Prints the calls, mean time, GFLOP/s and allocations per call of every
+ * layer that ran, summed over the threads, and the process' allocation
+ * totals.
+ */
+void Instrument::report (std::ostream &os)
+{
+  TraceState &trace = state ();
+  std::lock_guard<std::mutex> guard (trace.lock);
+  os << std::setw (6) << "layer" << std::setw (10) << "calls"
+     << std::setw (12) << "mean ns" << std::setw (10) << "GFLOP/s"
+     << std::setw (14) << "allocs/call" << std::endl;
+  for (int l = 0; l < TRACE_MAX_LAYERS; l++)
+    {
+      const LayerTotals t = layer_totals (trace, l);
+      if (t.calls == 0)
+        {
+          continue;
+        }
+      os << std::setw (6) << l + 1 << std::setw (10) << t.calls << std::fixed
+         << std::setprecision (0) << std::setw (12)
+         << (double) t.duration_ns / t.calls << std::setprecision (2)
+         << std::setw (10)
+         << (t.duration_ns > 0 ? t.flops / t.duration_ns : 0)
+         << std::setw (14) << (double) t.allocations / t.calls
+         << std::defaultfloat << std::endl;
+    }
+  os << "allocations: " << allocations () << " (" << allocated_bytes ()
+     << " bytes)" << std::endl;
+}
+
+/**
+ * Clears the ring buffers and the totals, not the allocation counters:
+ * the exports then count from what every thread had recorded by now.
+ */
+void Instrument::reset ()
+{
+  TraceState &trace = state ();
+  std::lock_guard<std::mutex> guard (trace.lock);
+  for (ThreadTrace *thread : trace.threads)
+    {
+      thread->first = thread->recorded.load (std::memory_order_acquire);
+      for (int l = 0; l < TRACE_MAX_LAYERS; l++)
+        {
+          const LayerCounters &c = thread->layers[l];
+          thread->cleared[l] = LayerTotals{
+              c.calls.load (std::memory_order_relaxed),
+              c.duration_ns.load (std::memory_order_relaxed),
+              c.flops.load (std::memory_order_relaxed),
+              c.allocations.load (std::memory_order_relaxed)};
+        }
+    }
+}
+
+TraceScope::~TraceScope ()
+{
+  long end = Instrument::now_ns ();
+  Instrument::record (TraceEvent{_name, _layer, _start, end - _start, _flops,
+                                 Instrument::thread_allocations ()
+                                 - _allocations, 0});
+}
+
+#endif //MLP_INSTRUMENT
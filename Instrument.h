@@ -0,0 +1,128 @@
+// Instrument.h
+// Optional instrumentation of the inference path. Built with MLP_INSTRUMENT
+// defined (make INSTRUMENT=1), the MLP_TRACE_* macros time spans of the
+// forward pass, count their FLOPs and heap allocations, and keep the recent
+// spans in per thread ring buffers; without it the macros expand to nothing
+// and this header declares nothing, so the hot path is unchanged.
+
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#ifdef MLP_INSTRUMENT
+
+#include <atomic>
+#include <ostream>
+
+// spans kept per thread, older ones are overwritten.
+#define TRACE_CAPACITY 4096
+// layers with their own statistics, deeper ones share the last slot.
+#define TRACE_MAX_LAYERS 16
+// when set, the Chrome trace is written to this file at exit and the layer
+// statistics are printed to stderr.
+#define TRACE_ENV "MLP_TRACE"
+
+/**
+ * @struct TraceEvent
+ * @brief One finished span.
+ * @var name - static string naming the span
+ * @var layer - index of the layer the span ran, -1 for whole passes
+ * @var start_ns - start, in nanoseconds since the first span
+ * @var duration_ns - length of the span
+ * @var flops - floating point operations the span did
+ * @var allocations - heap allocations the span's thread made in it
+ * @var thread - small number of the thread that ran it
+ */
+typedef struct TraceEvent
+{
+    const char *name;
+    int layer;
+    long start_ns;
+    long duration_ns;
+    double flops;
+    long allocations;
+    int thread;
+} TraceEvent;
+
+/**
+ * Process wide instrumentation state. Every heap allocation is counted
+ * through replaced global operator new; spans record into their thread's
+ * ring buffer and, for layers, its running per layer totals, without a
+ * lock. Only the exports and reset lock, to gather the threads'.
+ */
+class Instrument
+{
+ public:
+  /**
+   * @return nanoseconds since the first span started.
+   */
+  static long now_ns();
+  /**
+   * @return heap allocations made by the calling thread so far.
+   */
+  static long thread_allocations();
+  /**
+   * @return heap allocations and bytes allocated by all threads so far.
+   */
+  static long allocations();
+  static long allocated_bytes();
+  /**
+   * Records a finished span.
+   */
+  static void record(const TraceEvent &event);
+  /**
+   * Writes the spans in the ring buffers as Chrome trace event JSON, which
+   * chrome://tracing and Perfetto load.
+   */
+  static void write_chrome_trace(std::ostream &os);
+  /**
+   * Prints the calls, mean time, GFLOP/s and allocations per call of
+   * every layer, and the process' allocation totals.
+   */
+  static void report(std::ostream &os);
+  /**
+   * Clears the ring buffers and the totals, not the allocation counters.
+   */
+  static void reset();
+};
+
+/**
+ * Times its own lifetime as a span, and counts the allocations of its
+ * thread in between.
+ */
+class TraceScope
+{
+ public:
+  TraceScope(const char *name, int layer, double flops)
+      : _name(name), _layer(layer), _flops(flops),
+        _allocations(Instrument::thread_allocations()),
+        _start(Instrument::now_ns())
+  {}
+  ~TraceScope();
+  TraceScope(const TraceScope&) = delete;
+  TraceScope& operator=(const TraceScope&) = delete;
+
+ private:
+  const char *_name;
+  int _layer;
+  double _flops;
+  long _allocations;
+  long _start;
+};
+
+#define MLP_TRACE_CONCAT_(a, b) a##b
+#define MLP_TRACE_CONCAT(a, b) MLP_TRACE_CONCAT_(a, b)
+// times the rest of the enclosing scope as a span of a whole pass.
+#define MLP_TRACE_SCOPE(name, flops) \
+  TraceScope MLP_TRACE_CONCAT(trace_scope_, __LINE__) (name, -1, flops)
+// times the rest of the enclosing scope as the given layer's span.
+#define MLP_TRACE_LAYER(layer, flops) \
+  TraceScope MLP_TRACE_CONCAT(trace_scope_, __LINE__) ("dense", layer, flops)
+
+#else
+
+#define MLP_TRACE_SCOPE(name, flops) ((void) 0)
+#define MLP_TRACE_LAYER(layer, flops) ((void) 0)
+
+#endif //MLP_INSTRUMENT
+
+#endif //INSTRUMENT_H
@@ -1,31 +1,78 @@
 #include "Matrix.h"
+#include "Gemm.h"
+#include "Simd.h"
+#include <algorithm>
 
 #define ZERO_DOT_ONE 0.1
 
 /**
- * Constructor - inits matrix with r rows and c cols, inits all elements
- * with zero.
+ * @param data - the first element
  * @param r - number of rows
  * @param c - number of columns
+ * @param stride - floats between the beginnings of two rows, at least c
  */
-Matrix::Matrix (int r, int c)
+MatrixView::MatrixView (const float *data, int r, int c, int stride)
+    : _data (data), _rows (r), _cols (c), _stride (stride)
 {
-  if (r <= 0 || c <= 0)
+  if (r <= 0 || c <= 0 || stride < c)
     {
       std::cerr << ROWS_COLS_ERROR << std::endl;
       exit(EXIT_FAILURE);
     }
-  _rows = r;
-  _cols = c;
-  _matrix = new(std::nothrow) float[_rows * _cols];
-  if (_matrix == nullptr)
+}
+
+/**
+ * View of r*c contiguous floats, row after row.
+ */
+MatrixView::MatrixView (const float *data, int r, int c)
+    : MatrixView (data, r, c, c)
+{}
+
+/**
+ * View of all the elements of a matrix.
+ */
+MatrixView::MatrixView (const Matrix &m)
+    : _data (m._matrix), _rows (m._rows), _cols (m._cols), _stride (m._cols)
+{}
+
+/**
+ * @return a buffer of count floats from allocator, exits (code == 1) if
+ * it is out of memory.
+ */
+float *Matrix::allocate (MatrixAllocator *allocator, long count)
+{
+  float *buffer = allocator->allocate (count);
+  if (buffer == nullptr)
     {
       std::cerr << ALLOC_ERROR << std::endl;
       exit(EXIT_FAILURE);
     }
-  for (int i = 0; i < _cols * _rows; i++)
+  return buffer;
+}
+
+/**
+ * Constructor - inits matrix with r rows and c cols, inits all elements
+ * with zero unless init is NO_FILL.
+ * @param r - number of rows
+ * @param c - number of columns
+ * @param init - whether to zero the elements
+ * @param allocator - source of the elements, nullptr for the default
+ */
+Matrix::Matrix (int r, int c, MatrixInit init, MatrixAllocator *allocator)
+{
+  if (r <= 0 || c <= 0)
     {
-      _matrix[i] = 0;
+      std::cerr << ROWS_COLS_ERROR << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  _rows = r;
+  _cols = c;
+  _allocator = allocator != nullptr ? allocator
+                                    : &MatrixAllocator::get_default ();
+  _matrix = allocate (_allocator, (long) _rows * _cols);
+  if (init == ZERO_FILL)
+    {
+      std::fill (_matrix, _matrix + (long) _rows * _cols, 0.0f);
     }
 }
 
@@ -37,31 +84,69 @@ Matrix::Matrix () : Matrix (1, 1)
 {}
 
 /**
- *  copy ctor
+ *  copy ctor - the copy always owns its elements, a view's come from the
+ *  default allocator.
  * @param other - other matrix to copy from
  */
 Matrix::Matrix (const Matrix &other)
 {
   _rows = other._rows;
   _cols = other._cols;
-  _matrix = new(std::nothrow) float[_rows * _cols];
-  if (_matrix == nullptr)
+  _allocator = other._allocator != nullptr
+               ? other._allocator : &MatrixAllocator::get_default ();
+  _matrix = allocate (_allocator, (long) _rows * _cols);
+  // copy values from the other matrix
+  std::copy (other._matrix, other._matrix + (long) _rows * _cols, _matrix);
+}
+
+/**
+ * Inits a matrix around existing elements, used by view.
+ */
+Matrix::Matrix (float *data, int r, int c)
+    : _rows (r), _cols (c), _matrix (data), _allocator (nullptr)
+{
+  if (r <= 0 || c <= 0)
     {
-      std::cerr << ALLOC_ERROR << std::endl;
+      std::cerr << ROWS_COLS_ERROR << std::endl;
       exit(EXIT_FAILURE);
     }
-  for (int i = 0; i < _rows * _cols; i++)
-    {
-      _matrix[i] = other._matrix[i]; // copy values from the other matrix
-    }
 }
 
 /**
- * Destructor - delete the matrix array.
+ * Returns a matrix that uses the given r*c floats as its elements,
+ * without copying or owning them.
+ * @param data - r*c floats, row after row
+ * @param r - number of rows
+ * @param c - number of columns
+ * @return the view
+ */
+Matrix Matrix::view (float *data, int r, int c)
+{
+  return Matrix (data, r, c);
+}
+
+/**
+ * move ctor - takes other's array without copying, other is left empty.
+ * @param other - other matrix to move from
+ */
+Matrix::Matrix (Matrix &&other) noexcept
+    : _rows (other._rows), _cols (other._cols), _matrix (other._matrix),
+      _allocator (other._allocator)
+{
+  other._rows = 0;
+  other._cols = 0;
+  other._matrix = nullptr;
+}
+
+/**
+ * Destructor - returns the matrix array to its allocator.
  */
 Matrix::~Matrix ()
 {
-  delete[] _matrix;
+  if (_allocator != nullptr)
+    {
+      _allocator->deallocate (_matrix, (long) _rows * _cols);
+    }
 }
 
 // getters
@@ -75,34 +160,46 @@ int Matrix::get_cols () const
   return _cols;
 }
 
+float *Matrix::data ()
+{
+  return _matrix;
+}
+
+const float *Matrix::data () const
+{
+  return _matrix;
+}
+
+bool Matrix::is_view () const
+{
+  return _allocator == nullptr;
+}
+
 /**
   * Transforms a matrix into its transpose matrix.
   * @return reference to this.
   */
 Matrix &Matrix::transpose ()
 {
-  // initialize new array for the transpose matrix.
-  auto *new_matrix = new(std::nothrow) float[_cols * _rows];
-  if (new_matrix == nullptr)
-    {
-      std::cerr << ALLOC_ERROR << std::endl;
-      exit(EXIT_FAILURE);
-    }
-  for (int i = 0; i < _cols; i++)
-    {
-      for (int j = 0; j < _rows; j++)
-        {
-          // inits the row of original matrix into column of transposed matrix.
-          new_matrix[i * _rows + j] = _matrix[j * _cols + i];
-        }
-    }
+  // initialize new array for the transpose matrix, a view's comes from
+  // the default allocator.
+  MatrixAllocator *allocator = _allocator != nullptr
+                               ? _allocator : &MatrixAllocator::get_default ();
+  float *new_matrix = allocate (allocator, (long) _cols * _rows);
+  // every row of the original matrix becomes a column of the transposed
+  // one, in cache blocks of register tiles.
+  simd ().transpose (_matrix, _cols, new_matrix, _rows, _rows, _cols);
   int c = _cols;
   // change the rows to cols, and the cols to rows.
   _cols = _rows;
   _rows = c;
-  // delete the oldest matrix.
-  delete[] _matrix;
+  // free the oldest matrix, a view's elements are left untouched.
+  if (_allocator != nullptr)
+    {
+      _allocator->deallocate (_matrix, (long) _rows * _cols);
+    }
   _matrix = new_matrix;
+  _allocator = allocator;
   return *this;
 }
 
@@ -141,19 +238,25 @@ void Matrix::plain_print () const
  * matrix.
  * @return new Matrix object
  */
-Matrix Matrix::dot (const Matrix &m) const
+Matrix Matrix::dot (MatrixView m) const
 {
-  if (_rows != m._rows || _cols != m._cols) // validity check
+  if (_rows != m.get_rows () || _cols != m.get_cols ()) // validity check
     {
       std::cerr << UN_MUCH_MATRIX << std::endl;
       exit(EXIT_FAILURE);
     }
   // create new matrix.
-  Matrix dot_matrix = Matrix (_rows, _cols);
-  for (int i = 0; i < _cols * _rows; i++)
+  Matrix dot_matrix = Matrix (_rows, _cols, NO_FILL);
+  // multiple each element in this with the relevant element in m.
+  if (m.is_contiguous ())
     {
-      // multiple each element in this with the relevant element in m.
-      dot_matrix._matrix[i] = _matrix[i] * m._matrix[i];
+      simd ().mul (_matrix, m.data (), dot_matrix._matrix, _rows * _cols);
+      return dot_matrix;
+    }
+  for (int i = 0; i < _rows; i++)
+    {
+      simd ().mul (_matrix + i * _cols, m.row (i),
+                   dot_matrix._matrix + i * _cols, _cols);
     }
   return dot_matrix;
 }
@@ -164,12 +267,8 @@ Matrix Matrix::dot (const Matrix &m) const
  */
 float Matrix::norm () const
 {
-  float norm = 0;
-  for (int i = 0; i < _rows * _cols; i++)
-    {
-      // multiple each element with itself, and add to the norm.
-      norm += _matrix[i] * _matrix[i];
-    }
+  // multiple each element with itself, and add to the norm.
+  float norm = simd ().dot (_matrix, _matrix, _rows * _cols);
   return sqrtf (norm);
 }
 
@@ -178,17 +277,20 @@ float Matrix::norm () const
  * @param m - the matrix to add
  * @return new matrix - the sum of both matrix.
  */
-Matrix Matrix::operator+ (const Matrix &m) const
+Matrix Matrix::operator+ (MatrixView m) const
 {
-  // create new matrix with the content of this.
-  Matrix temp = *this;
+  // create new matrix with the content of this, in storage of its own.
+  Matrix temp = Matrix (_rows, _cols, NO_FILL);
+  std::copy (_matrix, _matrix + (long) _rows * _cols, temp._matrix);
   // add m to the new matrix by += operator
   temp += m;
   return temp;
 }
 
 /**
- * assignment operator.
+ * assignment operator. Copies m's elements into this matrix's allocator,
+ * reusing its storage when it owns elements of m's count. A view is
+ * never written through: it gets storage of the default allocator.
  * @param m the matrix to assign to this matrix.
  * @return reference to the matrix.
  */
@@ -199,21 +301,51 @@ Matrix &Matrix::operator= (const Matrix &m)
     {
       return *this;
     }
+  long count = (long) m._rows * m._cols;
+  bool reuse = _allocator != nullptr && (long) _rows * _cols == count;
+  // otherwise free the current matrix, and create new in the correct size.
+  if (!reuse)
+    {
+      if (_allocator != nullptr)
+        {
+          _allocator->deallocate (_matrix, (long) _rows * _cols);
+        }
+      else
+        {
+          _allocator = &MatrixAllocator::get_default ();
+        }
+      _matrix = allocate (_allocator, count);
+    }
   _rows = m._rows;
   _cols = m._cols;
-  // delete the current matrix, and create new in the correct size.
-  delete[] _matrix;
-  _matrix = new(std::nothrow) float[_rows * _cols];
-  if (_matrix == nullptr)
+  // fill the matrix with m's matrix values.
+  std::copy (m._matrix, m._matrix + count, _matrix);
+  return *this;
+}
+
+/**
+ * move assignment operator - takes m's array without copying, m is left
+ * empty.
+ * @param m the matrix to move into this matrix.
+ * @return reference to the matrix.
+ */
+Matrix &Matrix::operator= (Matrix &&m) noexcept
+{
+  if (this == &m)
     {
-      std::cerr << ALLOC_ERROR << std::endl;
-      exit(EXIT_FAILURE);
+      return *this;
     }
-  // fill the new matrix with m's matrix values.
-  for (int i = 0; i < _cols * _rows; i++)
+  if (_allocator != nullptr)
     {
-      _matrix[i] = m._matrix[i];
+      _allocator->deallocate (_matrix, (long) _rows * _cols);
     }
+  _rows = m._rows;
+  _cols = m._cols;
+  _matrix = m._matrix;
+  _allocator = m._allocator;
+  m._rows = 0;
+  m._cols = 0;
+  m._matrix = nullptr;
   return *this;
 }
 
@@ -222,28 +354,18 @@ Matrix &Matrix::operator= (const Matrix &m)
  * @param m the matrix to duplicate with the current matrix.
  * @return new matrix - the result.
  */
-Matrix Matrix::operator* (const Matrix &m) const
+Matrix Matrix::operator* (MatrixView m) const
 {
-  if (_cols != m._rows) // validity check
+  if (_cols != m.get_rows ()) // validity check
     {
       std::cerr << UN_MUCH_MATRIX << std::endl;
       exit(EXIT_FAILURE);
     }
   // create new matrix for the result
-  Matrix new_matrix = Matrix (_rows, m._cols);
-  for (int i = 0; i < _rows; i++)
-    {
-      for (int j = 0; j < m._cols; j++)
-        {
-          // the sum for each row*col
-          float sum = 0;
-          for (int l = 0; l < _cols; l++)
-            {
-              sum += _matrix[i * _cols + l] * m._matrix[l * m._cols + j];
-            }
-          new_matrix._matrix[i * new_matrix._cols + j] = sum;
-        }
-    }
+  Matrix new_matrix = Matrix (_rows, m.get_cols (), NO_FILL);
+  // blocked kernel, or gemv when m is a column vector.
+  gemm (_rows, m.get_cols (), _cols, _matrix, _cols, m.data (),
+        m.get_stride (), new_matrix._matrix, new_matrix._cols);
   return new_matrix;
 }
 
@@ -255,12 +377,9 @@ Matrix Matrix::operator* (const Matrix &m) const
 Matrix Matrix::operator* (float c) const
 {
   // create new matrix
-  Matrix new_matrix = Matrix (_rows, _cols);
+  Matrix new_matrix = Matrix (_rows, _cols, NO_FILL);
   // fill the new matrix with the duplicate of every element with the scalar c.
-  for (int i = 0; i < _cols * _rows; i++)
-    {
-      new_matrix._matrix[i] = _matrix[i] * c;
-    }
+  simd ().scale (_matrix, c, new_matrix._matrix, _rows * _cols);
   return new_matrix;
 }
 
@@ -281,73 +400,32 @@ Matrix operator* (float c, const Matrix &m)
  * @param m - the other matrix.
  * @return this matrix.
  */
-Matrix &Matrix::operator+= (const Matrix &m)
+Matrix &Matrix::operator+= (MatrixView m)
 {
-  if (_rows != m._rows || _cols != m._cols) // validity check
+  if (_rows != m.get_rows () || _cols != m.get_cols ()) // validity check
     {
       std::cerr << UN_MUCH_MATRIX << std::endl;
       exit(EXIT_FAILURE);
     }
-  for (int i = 0; i < _cols * _rows; i++)
+  if (m.is_contiguous ())
     {
-      _matrix[i] += m._matrix[i];
-    }
-  return *this;
-}
-
-/**
- * this method will return the i,j element in the matrix.
- * this is the non - const version.
- * @param i - the row index
- * @param j - the col index
- * @return the item in the i'th row, j'th col.
- */
-float &Matrix::operator() (int i, int j)
-{
-  if (i < 0 || i >= _rows || j < 0 || j >= _cols)
-    {
-      std::cerr << OUT_OF_RANGE << std::endl;
-      exit(EXIT_FAILURE);
+      simd ().add (_matrix, m.data (), _rows * _cols);
+      return *this;
     }
-  return _matrix[i * _cols + j];
-}
-
-// the const version of the function above.
-float Matrix::operator() (int i, int j) const
-{
-  if (i < 0 || i >= _rows || j < 0 || j >= _cols)
+  for (int i = 0; i < _rows; i++)
     {
-      std::cerr << OUT_OF_RANGE << std::endl;
-      exit(EXIT_FAILURE);
+      simd ().add (_matrix + i * _cols, m.row (i), _cols);
     }
-  return _matrix[i * _cols + j];
+  return *this;
 }
 
 /**
-* this method will return the i'th element in the matrix.
-* this is the non - const version.
-* @param i - the index of the element we return
-* @return the item in the index i in the matrix.
-*/
-float &Matrix::operator[] (int i)
-{
-  if (i<0 || i >= _cols*_rows)
-    {
-      std::cerr << OUT_OF_RANGE << std::endl;
-      exit(EXIT_FAILURE);
-    }
-  return _matrix[i];
-}
-
-// the const version of the function above.
-float Matrix::operator[] (int i) const
+ * Prints the range error and exits, for the checked element accessors.
+ */
+void Matrix::out_of_range ()
 {
-  if (i<0 || i >= _cols*_rows)
-    {
-      std::cerr << OUT_OF_RANGE << std::endl;
-      exit(EXIT_FAILURE);
-    }
-  return _matrix[i];
+  std::cerr << OUT_OF_RANGE << std::endl;
+  exit(EXIT_FAILURE);
 }
 
 /**
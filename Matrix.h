@@ -6,6 +6,7 @@
 #include <iostream>
 #include <fstream>
 #include <cmath>
+#include "MatrixAllocator.h"
 #define FLOAT 4
 #define ROWS_COLS_ERROR "Error: number of rows or columns is Invalid."
 #define UN_MUCH_MATRIX "Error: matrix are not at the same size."
@@ -22,6 +23,66 @@ typedef struct matrix_dims
     int rows, cols;
 } matrix_dims;
 
+/**
+ * @enum MatrixInit
+ * @brief What a new matrix's elements start as.
+ */
+enum MatrixInit
+{
+    ZERO_FILL,
+    NO_FILL // left as allocated, for matrices that are overwritten anyway
+};
+
+class Matrix;
+
+/**
+ * Non owning, read only view of a rows x cols block of floats, row i
+ * starts at data + i * stride. Views are cheap to copy, pass them by
+ * value. Read only operations take a MatrixView so callers can pass a
+ * Matrix or their own buffers without copying.
+ */
+class MatrixView
+{
+ public:
+  /**
+   * @param data - the first element
+   * @param r - number of rows
+   * @param c - number of columns
+   * @param stride - floats between the beginnings of two rows, at least c
+   */
+  MatrixView(const float* data, int r, int c, int stride);
+  /**
+   * View of r*c contiguous floats, row after row.
+   */
+  MatrixView(const float* data, int r, int c);
+  /**
+   * View of all the elements of a matrix (implicit on purpose).
+   */
+  MatrixView(const Matrix& m);
+
+  // getters
+  const float* data() const { return _data; }
+  int get_rows() const { return _rows; }
+  int get_cols() const { return _cols; }
+  int get_stride() const { return _stride; }
+  /**
+   * @return true if the rows follow each other with no gap.
+   */
+  bool is_contiguous() const { return _stride == _cols || _rows == 1; }
+  /**
+   * @return pointer to the first element of the i'th row.
+   */
+  const float* row(int i) const { return _data + (long) i * _stride; }
+  /**
+   * @return the i,j element, without range checks.
+   */
+  float operator()(int i, int j) const { return row(i)[j]; }
+
+ private:
+  const float* _data;
+  int _rows, _cols, _stride;
+};
+
 /**
  * This class represents a matrix that contains floats.
  */
@@ -33,24 +94,57 @@ class Matrix
    * with zero.
    * @param r - number of rows
    * @param c - number of columns
+   * @param init - NO_FILL skips the zeroing, the elements are then
+   *        undefined until written
+   * @param allocator - source of the elements, nullptr for
+   *        MatrixAllocator::get_default()
    */
-  Matrix(int r, int c);
+  Matrix(int r, int c, MatrixInit init = ZERO_FILL,
+         MatrixAllocator* allocator = nullptr);
   /**
    * Default Ctor - Inits matrix of 1x1, with 0.
    */
   Matrix();
   /**
-   *  copy ctor
+   *  copy ctor - copies the elements into storage of other's allocator,
+   *  or of the default one when other is a view: a copy always owns its
+   *  elements.
    * @param other - other matrix to copy from
    */
   Matrix(const Matrix& other);
   /**
-   * Destructor - delete the matrix array.
+   * Returns a matrix that uses the given r*c floats as its elements,
+   * without copying or owning them: the memory must outlive the view.
+   * Copies of it own copied elements, only moving it keeps the alias.
+   * Used to point matrices straight into a mapped file.
+   * @param data - r*c floats, row after row
+   * @param r - number of rows
+   * @param c - number of columns
+   * @return the view
+   */
+  static Matrix view(float* data, int r, int c);
+  /**
+   * move ctor - takes other's array without copying, other is left empty
+   * (0x0) and may only be assigned to or destroyed.
+   * @param other - other matrix to move from
+   */
+  Matrix(Matrix&& other) noexcept;
+  /**
+   * Destructor - returns the matrix array to its allocator.
    */
   ~Matrix();
   // getters
   int get_rows() const;
   int get_cols() const;
+  /**
+   * @return the elements array, row after row.
+   */
+  float* data();
+  const float* data() const;
+  /**
+   * @return true if this matrix does not own its elements (see view).
+   */
+  bool is_view() const;
   /**
    * Transforms a matrix into its transpose matrix.
    * @return reference to this.
@@ -71,7 +165,7 @@ class Matrix
    * matrix.
    * @return new Matrix object
    */
-  Matrix dot(const Matrix& m) const;
+  Matrix dot(MatrixView m) const;
   /**
    * Returns the norm of the given matrix
    * @return norm from type of float.
@@ -82,19 +176,29 @@ class Matrix
    * @param m - the matrix to add
    * @return new matrix - the sum of both matrix.
    */
-  Matrix operator+(const Matrix& m) const;
+  Matrix operator+(MatrixView m) const;
   /**
-   * assignment operator.
+   * assignment operator. m's elements are copied into this matrix's
+   * storage, with no allocation when it owns elements of the same count.
+   * A view is not written through, it gets storage of the default
+   * allocator; to alias on purpose, assign from Matrix::view(...).
    * @param m the matrix to assign to this matrix.
    * @return reference to the matrix.
    */
   Matrix& operator=(const Matrix& m);
+  /**
+   * move assignment operator - takes m's array without copying, m is left
+   * empty (0x0).
+   * @param m the matrix to move into this matrix.
+   * @return reference to the matrix.
+   */
+  Matrix& operator=(Matrix&& m) noexcept;
   /**
    * duplicate to matrix with the matrix m.
    * @param m the matrix to duplicate with the current matrix.
    * @return new matrix - the result.
    */
-  Matrix operator*(const Matrix& m) const;
+  Matrix operator*(MatrixView m) const;
   /**
    * Scalar multiplication on the right
    * @param c - the scalar
@@ -113,26 +217,50 @@ class Matrix
    * @param m - the other matrix.
    * @return this matrix.
    */
-  Matrix& operator+=(const Matrix& m);
+  Matrix& operator+=(MatrixView m);
   /**
    * this method will return the i,j element in the matrix.
-   * this is the non - const version.
+   * this is the non - const version. The indices are range checked in
+   * debug builds only (without NDEBUG).
    * @param i - the row index
    * @param j - the col index
    * @return the item in the i'th row, j'th col.
    */
-  float& operator()(int i, int j);
+  float& operator()(int i, int j)
+  {
+    check_index(i, j);
+    return _matrix[i * _cols + j];
+  }
   // the const version of the function above.
-  float operator()(int i, int j) const;
+  float operator()(int i, int j) const
+  {
+    check_index(i, j);
+    return _matrix[i * _cols + j];
+  }
   /**
  * this method will return the i'th element in the matrix.
- * this is the non - const version.
+ * this is the non - const version. The index is range checked in debug
+ * builds only (without NDEBUG).
  * @param i - the index of the element we return
  * @return the item in the index i in the matrix.
  */
-  float& operator[](int i);
+  float& operator[](int i)
+  {
+    check_offset(i);
+    return _matrix[i];
+  }
   // the const version of the function above.
-  float operator[](int i) const;
+  float operator[](int i) const
+  {
+    check_offset(i);
+    return _matrix[i];
+  }
+  /**
+   * @return pointer to the first element of the i'th row, without range
+   * checks. For kernels that walk whole rows.
+   */
+  float* row(int i) { return _matrix + (long) i * _cols; }
+  const float* row(int i) const { return _matrix + (long) i * _cols; }
 
   /**
    * method that prints the image that the matrix represent.
@@ -149,8 +277,53 @@ class Matrix
   friend std::istream& read_binary_file(std::istream& file_stream, Matrix& m);
 
  private:
+  friend class MatrixView;
+  /**
+   * Inits a matrix around existing elements, used by view.
+   */
+  Matrix(float* data, int r, int c);
+  /**
+   * @return a buffer of count floats from allocator, exits (code == 1) if
+   * it is out of memory.
+   */
+  static float* allocate(MatrixAllocator* allocator, long count);
+  /**
+   * Exits (code == 1) if i,j is outside the matrix. Compiled out with
+   * NDEBUG, so release builds pay nothing per element access.
+   */
+  void check_index(int i, int j) const
+  {
+#ifndef NDEBUG
+    if (i < 0 || i >= _rows || j < 0 || j >= _cols)
+      {
+        out_of_range();
+      }
+#else
+    (void) i;
+    (void) j;
+#endif
+  }
+  /**
+   * Exits (code == 1) if i is not an element index, debug builds only.
+   */
+  void check_offset(int i) const
+  {
+#ifndef NDEBUG
+    if (i < 0 || i >= _rows * _cols)
+      {
+        out_of_range();
+      }
+#else
+    (void) i;
+#endif
+  }
+  [[noreturn]] static void out_of_range();
+
   int _rows, _cols;
   float* _matrix;
+  // made _matrix, and takes it back. nullptr for views, which must not
+  // free _matrix.
+  MatrixAllocator* _allocator;
 
 };
 
@@ -0,0 +1,205 @@
+// MatrixAllocator.cpp
+
+#include "MatrixAllocator.h"
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+/**
+ * @return count floats in bytes, rounded up to whole cache lines.
+ */
+static std::size_t aligned_bytes (long count)
+{
+  std::size_t bytes = (std::size_t) count * sizeof (float);
+  return (bytes + MATRIX_ALIGNMENT - 1) / MATRIX_ALIGNMENT * MATRIX_ALIGNMENT;
+}
+
+static float *heap_allocate (std::size_t bytes)
+{
+  return (float *) ::operator new[] (bytes,
+                                     std::align_val_t (MATRIX_ALIGNMENT),
+                                     std::nothrow);
+}
+
+static void heap_deallocate (float *buffer)
+{
+  ::operator delete[] (buffer, std::align_val_t (MATRIX_ALIGNMENT));
+}
+
+/**
+ * Every buffer is a heap call of its own.
+ */
+class AlignedAllocator : public MatrixAllocator
+{
+ public:
+  float *allocate (long count) override
+  {
+    return heap_allocate (aligned_bytes (count));
+  }
+
+  void deallocate (float *buffer, long) override
+  {
+    heap_deallocate (buffer);
+  }
+
+  const char *name () const override
+  {
+    return "aligned";
+  }
+};
+
+/**
+ * The buffers one thread freed, per size class.
+ */
+struct PoolCache
+{
+  float *blocks[POOL_CLASSES][POOL_BLOCKS];
+  int counts[POOL_CLASSES];
+
+  PoolCache () : blocks (), counts ()
+  {}
+
+  ~PoolCache ();
+};
+
+// set once the calling thread's cache is destroyed: matrices freed later in
+// the thread's exit (or, on the main thread, by static destructors) go
+// straight back to the heap. Constant initialized, so it is safe to read
+// at any point of the thread's life.
+static thread_local bool cache_gone = false;
+static thread_local PoolCache cache;
+
+PoolCache::~PoolCache ()
+{
+  for (int c = 0; c < POOL_CLASSES; c++)
+    {
+      for (int i = 0; i < counts[c]; i++)
+        {
+          heap_deallocate (blocks[c][i]);
+        }
+    }
+  cache_gone = true;
+}
+
+/**
+ * @return the size class of count floats, POOL_CLASSES if too large.
+ */
+static int size_class (long count)
+{
+  std::size_t bytes = (std::size_t) count * sizeof (float);
+  int c = 0;
+  for (std::size_t size = MATRIX_ALIGNMENT; size < bytes; size <<= 1)
+    {
+      if (++c == POOL_CLASSES)
+        {
+          break;
+        }
+    }
+  return c;
+}
+
+/**
+ * Per thread size class caches in front of the heap. A buffer freed by
+ * another thread than the one that allocated it joins the freeing thread's
+ * cache, which is fine since all of them come from the same heap.
+ */
+class PoolAllocator : public MatrixAllocator
+{
+ public:
+  float *allocate (long count) override
+  {
+    int c = size_class (count);
+    if (c == POOL_CLASSES)
+      {
+        return heap_allocate (aligned_bytes (count));
+      }
+    if (!cache_gone && cache.counts[c] > 0)
+      {
+        return cache.blocks[c][--cache.counts[c]];
+      }
+    return heap_allocate ((std::size_t) MATRIX_ALIGNMENT << c);
+  }
+
+  void deallocate (float *buffer, long count) override
+  {
+    if (buffer == nullptr)
+      {
+        return;
+      }
+    int c = size_class (count);
+    if (c == POOL_CLASSES || cache_gone || cache.counts[c] == POOL_BLOCKS)
+      {
+        heap_deallocate (buffer);
+        return;
+      }
+    cache.blocks[c][cache.counts[c]++] = buffer;
+  }
+
+  const char *name () const override
+  {
+    return "pool";
+  }
+};
+
+// the allocators are never destroyed, matrices with static storage may
+// still free into them at exit.
+MatrixAllocator &MatrixAllocator::aligned ()
+{
+  static MatrixAllocator *allocator = new AlignedAllocator ();
+  return *allocator;
+}
+
+MatrixAllocator &MatrixAllocator::pool ()
+{
+  static MatrixAllocator *allocator = new PoolAllocator ();
+  return *allocator;
+}
+
+static std::atomic<MatrixAllocator *> default_allocator (nullptr);
+
+/**
+ * @return the allocator named by ALLOCATOR_ENV, the pool if it is not set.
+ */
+static MatrixAllocator &from_environment ()
+{
+  const char *forced = std::getenv (ALLOCATOR_ENV);
+  if (forced == nullptr || *forced == '\0')
+    {
+      return MatrixAllocator::pool ();
+    }
+  for (MatrixAllocator *allocator : {&MatrixAllocator::aligned (),
+                                     &MatrixAllocator::pool ()})
+    {
+      if (std::strcmp (forced, allocator->name ()) == 0)
+        {
+          return *allocator;
+        }
+    }
+  std::cerr << ALLOCATOR_ENV_ERROR << std::endl;
+  exit (EXIT_FAILURE);
+}
+
+MatrixAllocator &MatrixAllocator::get_default ()
+{
+  MatrixAllocator *allocator = default_allocator.load (
+      std::memory_order_acquire);
+  if (allocator != nullptr)
+    {
+      return *allocator;
+    }
+  MatrixAllocator *expected = nullptr;
+  allocator = &from_environment ();
+  // a set_default that raced with the first call wins.
+  if (!default_allocator.compare_exchange_strong (expected, allocator))
+    {
+      return *expected;
+    }
+  return *allocator;
+}
+
+void MatrixAllocator::set_default (MatrixAllocator &allocator)
+{
+  default_allocator.store (&allocator, std::memory_order_release);
+}
@@ -0,0 +1,61 @@
+// MatrixAllocator.h
+
+#ifndef MATRIXALLOCATOR_H
+#define MATRIXALLOCATOR_H
+
+// every Matrix buffer starts on a cache line, so full width vector loads
+// of a row that starts at a multiple of 16 floats never split a line.
+#define MATRIX_ALIGNMENT 64
+// the pool rounds requests up to a power of two from MATRIX_ALIGNMENT
+// bytes, over POOL_CLASSES classes (64 B .. 1 MB); larger buffers bypass it.
+#define POOL_CLASSES 15
+// freed buffers every thread keeps per class, more are returned to the heap.
+#define POOL_BLOCKS 8
+#define ALLOCATOR_ENV "MLP_ALLOCATOR"
+#define ALLOCATOR_ENV_ERROR "Error: unknown allocator in " ALLOCATOR_ENV
+
+/**
+ * Source of Matrix element buffers. Buffers are MATRIX_ALIGNMENT aligned;
+ * a buffer is returned to the allocator that made it, with the count it was
+ * asked for. Allocators are used from many threads at once and must outlive
+ * every matrix they allocated for.
+ */
+class MatrixAllocator
+{
+ public:
+  virtual ~MatrixAllocator() = default;
+  /**
+   * @param count - number of floats, positive
+   * @return uninitialized, aligned buffer, or nullptr if out of memory
+   */
+  virtual float *allocate(long count) = 0;
+  /**
+   * Takes back a buffer of allocate(count), nullptr is ignored.
+   */
+  virtual void deallocate(float *buffer, long count) = 0;
+  virtual const char *name() const = 0;
+
+  /**
+   * @return the allocator that goes straight to the heap on every call.
+   */
+  static MatrixAllocator &aligned();
+  /**
+   * @return the size class pool: every thread keeps the buffers it frees in
+   * a cache of its own and reuses them for requests of the same class, so
+   * the steady state of inference makes no heap calls and threads never
+   * contend for a lock.
+   */
+  static MatrixAllocator &pool();
+  /**
+   * @return the allocator of matrices that are not given one. The pool,
+   * unless the MLP_ALLOCATOR environment variable names another ("aligned"
+   * or "pool") on the first call; exits if it names none.
+   */
+  static MatrixAllocator &get_default();
+  /**
+   * Makes allocator the default of matrices created from now on.
+   */
+  static void set_default(MatrixAllocator &allocator);
+};
+
+#endif //MATRIXALLOCATOR_H
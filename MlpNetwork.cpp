@@ -1,41 +1,220 @@
 // MlpNetwork.cpp
 #include "MlpNetwork.h"
+#include "Instrument.h"
+#include "Simd.h"
 
 /**
- * Constructor - Inits MlpNetwork with the given parameters
+ * Builds the layers, after checking that they chain.
+ */
+static std::vector<Dense> make_layers(const Matrix weights[],
+                                      const Matrix biases[],
+                                      const ActivationType activations[],
+                                      int depth, WeightLayout layout)
+{
+  if (!MlpNetwork::is_valid(weights, biases, depth))
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  std::vector<Dense> layers;
+  layers.reserve(depth);
+  for (int i = 0; i < depth; i++)
+    {
+      layers.emplace_back(weights[i], biases[i], activations[i], layout);
+    }
+  return layers;
+}
+
+/**
+ * @return layers, after checking that they chain as is_valid checks
+ * weights: the first takes 784 inputs, each takes the previous one's
+ * outputs and the last has 10 outputs.
+ */
+static std::vector<Dense> check_layers(std::vector<Dense> layers)
+{
+  bool valid = !layers.empty()
+               && layers[0].get_cols() == img_dims.rows * img_dims.cols
+               && layers.back().get_rows() == TEN;
+  for (size_t i = 1; valid && i < layers.size(); i++)
+    {
+      valid = layers[i].get_cols() == layers[i - 1].get_rows();
+    }
+  if (!valid)
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  return layers;
+}
+
+/**
+ * @return the probability of an output of the last layer, which holds log
+ * probabilities when its activation is log-softmax.
+ */
+static float probability(const Dense &last, float output)
+{
+  return last.get_activation().get_activation_type() == LOG_SOFTMAX ?
+         std::exp(output) : output;
+}
+
+/**
+ * @return the number of rows of the widest layer output.
+ */
+static int max_layer_rows(const std::vector<Dense> &layers)
+{
+  int rows = 0;
+  for (const auto & layer : layers)
+    {
+      int layer_rows = layer.get_rows();
+      rows = layer_rows > rows ? layer_rows : rows;
+    }
+  return rows;
+}
+
+/**
+ * Allocates both buffers for the network's widest layer.
+ * @param mlp - the network the workspace is used with
+ */
+MlpWorkspace::MlpWorkspace(const MlpNetwork &mlp):
+    _ping(mlp.get_width(), 1),
+    _pong(mlp.get_width(), 1),
+    _input(mlp.get_layer(0).get_cols(), 1)
+{}
+
+/**
+ * Constructor - Inits MlpNetwork with the default topology
  * @param weights - array of 4 weights Matrix, one for each layer
  * @param biases - array of 4 biases Matrix, one for each layer
+ * @param layout - every layer's weight layout
+ */
+MlpNetwork::MlpNetwork(const Matrix weights[], const Matrix biases[],
+                       WeightLayout layout):
+    MlpNetwork(weights, biases, default_activations, MLP_SIZE, layout)
+{}
+
+/**
+ * Constructor - Inits MlpNetwork with the given topology.
+ * @param weights - weights[i] is the i'th layer weights matrix
+ * @param biases - biases[i] is the i'th layer bias vector
+ * @param activations - activations[i] is the i'th layer activation
+ * @param depth - number of layers
+ * @param layout - every layer's weight layout
  */
-MlpNetwork::MlpNetwork(Matrix weights[], Matrix biases[]):
-           _layers{Dense(weights[0], biases[0], RELU),
-                   Dense(weights[1], biases[1], RELU),
-                   Dense(weights[2], biases[2], RELU),
-                   Dense(weights[3], biases[3], SOFTMAX)}
-                   // create the layers in the initialize member list
-                   // cause Dense does not have default Ctor.
+MlpNetwork::MlpNetwork(const Matrix weights[], const Matrix biases[],
+                       const ActivationType activations[], int depth,
+                       WeightLayout layout):
+    _layers(make_layers(weights, biases, activations, depth, layout)),
+    _width(max_layer_rows(_layers)),
+    _workspace(*this)
 {}
 
+/**
+ * Constructor - Inits MlpNetwork with layers the caller built.
+ * @param layers - the layers, the input layer first
+ */
+MlpNetwork::MlpNetwork(std::vector<Dense> layers):
+    _layers(check_layers(std::move(layers))),
+    _width(max_layer_rows(_layers)),
+    _workspace(*this)
+{}
 
 /**
-  * Applies the entire network on the input
+ * @return true if the layers form a network: the first takes 784 inputs,
+ * each takes the previous one's outputs, the last has 10 outputs, and
+ * every bias matches its weights.
+ */
+bool MlpNetwork::is_valid(const Matrix weights[], const Matrix biases[],
+                          int depth)
+{
+  if (depth <= 0 || weights[0].get_cols() != img_dims.rows * img_dims.cols
+      || weights[depth - 1].get_rows() != TEN)
+    {
+      return false;
+    }
+  for (int i = 0; i < depth; i++)
+    {
+      if (biases[i].get_rows() != weights[i].get_rows()
+          || biases[i].get_cols() != 1
+          || (i > 0 && weights[i].get_cols() != weights[i - 1].get_rows()))
+        {
+          return false;
+        }
+    }
+  return true;
+}
+
+
+/**
+  * Applies the entire network on the input. The input may have any shape
+  * of 784 elements (a 28x28 image or a vector), its elements are read in
+  * row order straight from the caller's memory.
   * @param input - the input vector - represents the image
   * @return digit struct
   */
-digit MlpNetwork::operator()(const Matrix &input) const
+digit MlpNetwork::operator()(MatrixView input) const
 {
-  Matrix output_vec; // create output vector
-  Matrix input_vec = input; // copy the input vector in order to change it
-  for (const auto & layer : _layers)
+  MLP_TRACE_SCOPE("inference", flops(1));
+  MlpWorkspace workspace(*this);
+  return forward(input, workspace);
+}
+
+/**
+ * Runs the layers on one input.
+ * @return the last layer's outputs, inside the workspace
+ */
+const float *MlpNetwork::run(MatrixView input, MlpWorkspace &workspace) const
+{
+  if (input.get_rows() * input.get_cols() != workspace._input.get_rows()
+      || workspace._ping.get_rows() < _width
+      || workspace._input.get_rows() != _layers[0].get_cols())
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  MLP_TRACE_SCOPE("forward", flops(1));
+  const float *input_vec = input.data();
+  if (!input.is_contiguous())
+    {
+      // gather the rows into one vector, only for strided inputs.
+      float *gathered = workspace._input.data();
+      for (int i = 0; i < input.get_rows(); i++)
+        {
+          for (int j = 0; j < input.get_cols(); j++)
+            {
+              *gathered++ = input(i, j);
+            }
+        }
+      input_vec = workspace._input.data();
+    }
+  float *output_vec = workspace._ping.data();
+  for (int i = 0; i < get_depth(); i++)
     {
+      MLP_TRACE_LAYER(i, _layers[i].flops(1));
       // apply each layer on the current input vector
-      output_vec = layer(input_vec);
-      input_vec = output_vec; // update the input vector to the next layer
-      // to be the output from the current layer
+      _layers[i].forward(input_vec, output_vec);
+      // the output of this layer is the input of the next one, and the
+      // other buffer receives the next output.
+      input_vec = output_vec;
+      output_vec = output_vec == workspace._ping.data() ?
+                   workspace._pong.data() : workspace._ping.data();
     }
+  return input_vec;
+}
+
+/**
+ * Applies the entire network on the input using the given workspace's
+ * buffers, without any heap allocation.
+ * @param input - the input vector - represents the image
+ * @param workspace - buffers for the layer outputs
+ * @return digit struct
+ */
+digit MlpNetwork::forward(MatrixView input, MlpWorkspace &workspace) const
+{
+  const float *output_vec = run(input, workspace);
   // initialize the first probability in the output vector to be the max.
   float max_prob = output_vec[0];
   unsigned int ind = 0;
-  for (int i = 0; i < TEN; i++)
+  for (int i = 0; i < get_classes(); i++)
     {
       if (output_vec[i] > max_prob)
         {
@@ -43,5 +222,203 @@ digit MlpNetwork::operator()(const Matrix &input) const
           ind = i;
         }
     }
-  return digit{ind, max_prob};
+  return digit{ind, probability(_layers.back(), max_prob)};
+}
+
+/**
+ * Applies the entire network on the input and writes the whole output
+ * distribution into the caller's buffer, without any heap allocation.
+ * @param input - the input vector - represents the image
+ * @param workspace - buffers for the layer outputs
+ * @param probs - get_classes() floats, probs[c] is the probability of c
+ */
+void MlpNetwork::distribution(MatrixView input, MlpWorkspace &workspace,
+                              float *probs) const
+{
+  const float *output_vec = run(input, workspace);
+  for (int i = 0; i < get_classes(); i++)
+    {
+      probs[i] = probability(_layers.back(), output_vec[i]);
+    }
+}
+
+/**
+ * Applies the entire network on the input and writes the k most probable
+ * classes into the caller's buffer, without any heap allocation.
+ * @param input - the input vector - represents the image
+ * @param workspace - buffers for the layer outputs
+ * @param top - k digits, most probable first
+ * @param k - number of classes wanted
+ * @return number of digits written, min(k, get_classes())
+ */
+int MlpNetwork::top_k(MatrixView input, MlpWorkspace &workspace, digit *top,
+                      int k) const
+{
+  // the workspace's other buffer is free once the layers ran.
+  const float *output_vec = run(input, workspace);
+  float *probs = output_vec == workspace._ping.data() ?
+                 workspace._pong.data() : workspace._ping.data();
+  for (int i = 0; i < get_classes(); i++)
+    {
+      probs[i] = probability(_layers.back(), output_vec[i]);
+    }
+  return top_k(probs, get_classes(), top, k);
+}
+
+/**
+ * Selects the k most probable classes of a distribution.
+ * @param probs - n probabilities
+ * @param n - number of classes
+ * @param top - k digits, most probable first
+ * @param k - number of classes wanted, clamped to n
+ * @return number of digits written, min(k, n), 0 when k <= 0
+ */
+int MlpNetwork::top_k(const float *probs, int n, digit *top, int k)
+{
+  if (k <= 0)
+    {
+      return 0;
+    }
+  if (k > n)
+    {
+      k = n;
+    }
+  int count = 0;
+  for (int c = 0; c < n; c++)
+    {
+      if (count == k && probs[c] <= top[k - 1].probability)
+        {
+          continue;
+        }
+      // insertion into the sorted prefix, the last one falls off when full.
+      int pos = count < k ? count++ : k - 1;
+      while (pos > 0 && top[pos - 1].probability < probs[c])
+        {
+          top[pos] = top[pos - 1];
+          pos--;
+        }
+      top[pos] = digit{(unsigned int) c, probs[c]};
+    }
+  return count;
+}
+
+/**
+ * Applies the entire network on the input using the network's own
+ * workspace, without any heap allocation.
+ * @param input - the input vector - represents the image
+ * @return digit struct
+ */
+digit MlpNetwork::forward(MatrixView input)
+{
+  return forward(input, _workspace);
+}
+
+/**
+ * Runs the layers on a batch. Each layer runs as a single matrix-matrix
+ * product over the whole batch.
+ * @param batch - N x 784 matrix, each row is one image
+ * @return classes x N matrix, one image per column
+ */
+Matrix MlpNetwork::run_batch(MatrixView batch) const
+{
+  if (batch.get_cols() != _layers[0].get_cols())
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  MLP_TRACE_SCOPE("forward_batch", flops(batch.get_rows()));
+  // every image becomes a column, so each layer is W * [x1 x2 ... xN].
+  Matrix input_vec(batch.get_cols(), batch.get_rows(), NO_FILL);
+  simd().transpose(batch.data(), batch.get_stride(), input_vec.data(),
+                   batch.get_rows(), batch.get_rows(), batch.get_cols());
+  for (int i = 0; i < get_depth(); i++)
+    {
+      MLP_TRACE_LAYER(i, _layers[i].flops(batch.get_rows()));
+      input_vec = _layers[i](input_vec);
+    }
+  return input_vec;
+}
+
+/**
+ * Applies the entire network on a batch of images. Each layer runs as a
+ * single matrix-matrix product over the whole batch.
+ * @param batch - N x 784 matrix, each row is one image
+ * @return vector of N digits, in the order of the batch rows
+ */
+std::vector<digit> MlpNetwork::classify_batch(MatrixView batch) const
+{
+  Matrix input_vec = run_batch(batch);
+  std::vector<digit> results;
+  results.reserve(input_vec.get_cols());
+  MatrixView probs = input_vec;
+  for (int j = 0; j < probs.get_cols(); j++)
+    {
+      float max_prob = probs(0, j);
+      unsigned int ind = 0;
+      for (int i = 0; i < get_classes(); i++)
+        {
+          if (probs(i, j) > max_prob)
+            {
+              max_prob = probs(i, j);
+              ind = i;
+            }
+        }
+      results.push_back(digit{ind, probability(_layers.back(), max_prob)});
+    }
+  return results;
+}
+
+/**
+ * Applies the entire network on a batch of images and writes every image's
+ * whole output distribution.
+ * @param batch - N x 784 matrix, each row is one image
+ * @param probs - N * get_classes() floats, row n is the n'th image's
+ */
+void MlpNetwork::distribution_batch(MatrixView batch, float *probs) const
+{
+  Matrix output = run_batch(batch);
+  int classes = get_classes();
+  for (int i = 0; i < classes; i++)
+    {
+      const float *row = output.row(i);
+      for (int j = 0; j < output.get_cols(); j++)
+        {
+          probs[j * classes + i] = probability(_layers.back(), row[j]);
+        }
+    }
+}
+
+double MlpNetwork::flops(int columns) const
+{
+  double total = 0;
+  for (const auto & layer : _layers)
+    {
+      total += layer.flops(columns);
+    }
+  return total;
+}
+
+int MlpNetwork::get_depth() const
+{
+  return (int) _layers.size();
+}
+
+int MlpNetwork::get_width() const
+{
+  return _width;
+}
+
+int MlpNetwork::get_classes() const
+{
+  return _layers.back().get_rows();
+}
+
+const Dense &MlpNetwork::get_layer(int i) const
+{
+  if (i < 0 || i >= get_depth())
+    {
+      std::cerr << OUT_OF_RANGE << std::endl;
+      exit(EXIT_FAILURE);
+    }
+  return _layers[i];
 }
\ No newline at end of file
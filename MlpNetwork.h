@@ -7,12 +7,14 @@
 #include "Dense.h"
 #include "Activation.h"
 #include "Digit.h"
+#include <vector>
 
 
 #define MLP_SIZE 4
 #define TEN 10
 
-//
+// the default topology, for parameters given as raw layer files, which do
+// not record their shapes. Model files carry their own topology.
 const matrix_dims img_dims = {28, 28};
 const matrix_dims weights_dims[] = {{128, 784},
                                     {64, 128},
@@ -22,30 +24,184 @@ const matrix_dims bias_dims[]    = {{128, 1},
                                     {64, 1},
                                     {20, 1},
                                     {10, 1}};
+const ActivationType default_activations[] = {RELU, RELU, RELU, SOFTMAX};
 
+class MlpNetwork;
+
+/**
+ * Two preallocated activation buffers, wide enough for every layer. The
+ * forward pass alternates between them (ping-pong), so it does no
+ * allocations. A third buffer gathers inputs whose rows are not
+ * contiguous. Each thread running inference needs its own workspace.
+ */
+class MlpWorkspace
+{
+ public:
+  /**
+   * Allocates both buffers for the network's widest layer.
+   * @param mlp - the network the workspace is used with
+   */
+  explicit MlpWorkspace(const MlpNetwork &mlp);
+
+ private:
+  friend class MlpNetwork;
+  Matrix _ping;
+  Matrix _pong;
+  Matrix _input;
+};
+
+/**
+ * A stack of Dense layers of any depth and widths, mapping a 784 pixel image
+ * to 10 class probabilities. The layers are stored contiguously, in order.
+ */
 class MlpNetwork
 {
  public:
   /**
-   * Constructor - Inits MlpNetwork with the given parameters
+   * Constructor - Inits MlpNetwork with the default topology
    * @param weights - array of 4 weights Matrix, one for each layer
    * @param biases - array of 4 biases Matrix, one for each layer
+   * @param layout - every layer's weight layout, see Dense. ROW_MAJOR
+   *        keeps views of a mapped model's weights without a copy
+   */
+  MlpNetwork(const Matrix weights[], const Matrix biases[],
+             WeightLayout layout = ROW_MAJOR);
+  /**
+   * Constructor - Inits MlpNetwork with the given topology.
+   * Exits (code == 1) if the layers do not chain (see is_valid).
+   * @param weights - weights[i] is the i'th layer weights matrix
+   * @param biases - biases[i] is the i'th layer bias vector
+   * @param activations - activations[i] is the i'th layer activation
+   * @param depth - number of layers
+   * @param layout - every layer's weight layout, see Dense. ROW_MAJOR
+   *        keeps views of a mapped model's weights without a copy
    */
-  MlpNetwork(Matrix weights[], Matrix biases[]);
+  MlpNetwork(const Matrix weights[], const Matrix biases[],
+             const ActivationType activations[], int depth,
+             WeightLayout layout = ROW_MAJOR);
   /**
-   * Applies the entire network on the input
+   * Constructor - Inits MlpNetwork with layers the caller built, e.g. from
+   * half weights files. Exits (code == 1) if the layers do not chain.
+   * @param layers - the layers, the input layer first
+   */
+  explicit MlpNetwork(std::vector<Dense> layers);
+  /**
+   * @return true if the layers form a network: the first takes 784 inputs,
+   * each takes the previous one's outputs, the last has 10 outputs, and
+   * every bias matches its weights.
+   */
+  static bool is_valid(const Matrix weights[], const Matrix biases[],
+                       int depth);
+  /**
+   * Applies the entire network on the input. The input may have any shape
+   * of 784 elements (a 28x28 image or a vector), its elements are read in
+   * row order straight from the caller's memory.
    * @param input - the input vector - represents the image
    * @return digit struct
    */
-  digit operator()(const Matrix &input) const;
+  digit operator()(MatrixView input) const;
+  /**
+   * Applies the entire network on the input using the given workspace's
+   * buffers, without any heap allocation.
+   * @param input - the input vector - represents the image
+   * @param workspace - buffers for the layer outputs
+   * @return digit struct
+   */
+  digit forward(MatrixView input, MlpWorkspace &workspace) const;
+  /**
+   * Applies the entire network on the input using the network's own
+   * workspace, without any heap allocation. Not safe to call from several
+   * threads at once, use the overload above with a workspace per thread.
+   * @param input - the input vector - represents the image
+   * @return digit struct
+   */
+  digit forward(MatrixView input);
+  /**
+   * Applies the entire network on the input and writes the whole output
+   * distribution into the caller's buffer, without any heap allocation.
+   * @param input - the input vector - represents the image
+   * @param workspace - buffers for the layer outputs
+   * @param probs - get_classes() floats, probs[c] is the probability of c
+   */
+  void distribution(MatrixView input, MlpWorkspace &workspace,
+                    float *probs) const;
+  /**
+   * Applies the entire network on the input and writes the k most
+   * probable classes into the caller's buffer, without any heap
+   * allocation.
+   * @param input - the input vector - represents the image
+   * @param workspace - buffers for the layer outputs
+   * @param top - k digits, most probable first
+   * @param k - number of classes wanted, clamped to get_classes()
+   * @return number of digits written, min(k, get_classes()), 0 when
+   *         k <= 0
+   */
+  int top_k(MatrixView input, MlpWorkspace &workspace, digit *top,
+            int k) const;
+  /**
+   * Selects the k most probable classes of a distribution, so one
+   * inference can serve both the full distribution and a top-k consumer.
+   * Ties keep the smaller class first, as the argmax of forward does.
+   * @param probs - n probabilities
+   * @param n - number of classes
+   * @param top - k digits, most probable first
+   * @param k - number of classes wanted, clamped to n
+   * @return number of digits written, min(k, n), 0 when k <= 0
+   */
+  static int top_k(const float *probs, int n, digit *top, int k);
+  /**
+   * Applies the entire network on a batch of images. Each layer runs as a
+   * single matrix-matrix product over the whole batch.
+   * @param batch - N x 784 matrix, each row is one image
+   * @return vector of N digits, in the order of the batch rows
+   */
+  std::vector<digit> classify_batch(MatrixView batch) const;
+  /**
+   * Applies the entire network on a batch of images, as classify_batch
+   * does, and writes every image's whole output distribution.
+   * @param batch - N x 784 matrix, each row is one image
+   * @param probs - N * get_classes() floats, row n holds the distribution
+   *        of the n'th image
+   */
+  void distribution_batch(MatrixView batch, float *probs) const;
+  /**
+   * @param columns - number of images
+   * @return floating point operations of classifying them, see Dense::flops
+   */
+  double flops(int columns) const;
+  /**
+   * @return number of layers.
+   */
+  int get_depth() const;
+  /**
+   * @return the number of outputs of the widest layer.
+   */
+  int get_width() const;
+  /**
+   * @return the number of classes, the outputs of the last layer.
+   */
+  int get_classes() const;
+  /**
+   * @param i - layer index, 0 is the input layer
+   * @return the i'th layer
+   */
+  const Dense &get_layer(int i) const;
 
  private:
-  Dense _layers[MLP_SIZE];
-
-
-
-
+  /**
+   * Runs the layers on one input.
+   * @return the last layer's outputs, inside the workspace
+   */
+  const float *run(MatrixView input, MlpWorkspace &workspace) const;
+  /**
+   * Runs the layers on a batch.
+   * @return the last layer's outputs, one image per column
+   */
+  Matrix run_batch(MatrixView batch) const;
 
+  std::vector<Dense> _layers;
+  int _width;
+  MlpWorkspace _workspace;
 };
 
 #endif // MLPNETWORK_H
@@ -0,0 +1,239 @@
+// ModelFile.cpp
+
+#include "ModelFile.h"
+#include "Sparse.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+/**
+ * Prints the model file error and exits.
+ */
+static void model_error (const std::string &path)
+{
+  std::cerr << MODEL_FILE_ERROR << path << std::endl;
+  exit (EXIT_FAILURE);
+}
+
+/**
+ * @return true if a rows x cols float array at offset lies inside the file
+ * and is aligned.
+ */
+static bool array_fits (uint64_t offset, int64_t rows, int64_t cols,
+                        size_t size)
+{
+  uint64_t bytes = (uint64_t) (rows * cols) * sizeof (float);
+  return offset % MODEL_ALIGN == 0 && offset <= size && bytes <= size - offset;
+}
+
+/**
+ * @return true if the row_ptr and index arrays of a sparse rows x cols
+ * matrix at offset, and its values after them, lie inside the file.
+ */
+static bool sparse_fits (const char *data, uint64_t offset, int format,
+                         int64_t rows, size_t size)
+{
+  uint64_t row_ptr_bytes = (uint64_t) (rows + 1) * sizeof (int32_t);
+  if (offset % MODEL_ALIGN != 0 || offset > size
+      || row_ptr_bytes > size - offset)
+    {
+      return false;
+    }
+  int32_t entries = ((const int32_t *) (data + offset))[rows];
+  int64_t per_entry = format == MODEL_BLOCKS ? SPARSE_BLOCK : 1;
+  uint64_t bytes = row_ptr_bytes + (uint64_t) entries * sizeof (int32_t)
+                   + (uint64_t) (entries * per_entry) * sizeof (float);
+  return entries >= 0 && bytes <= size - offset;
+}
+
+/**
+ * Maps the model file and validates its header and layer table.
+ * Exits (code == 1) if the file cannot be mapped or is malformed.
+ * @param path - the model file
+ */
+MappedModel::MappedModel (const std::string &path) : _data (nullptr),
+                                                      _size (0)
+{
+  int fd = open (path.c_str (), O_RDONLY);
+  struct stat st{};
+  if (fd < 0 || fstat (fd, &st) != 0
+      || (size_t) st.st_size < sizeof (ModelHeader))
+    {
+      model_error (path);
+    }
+  _size = (size_t) st.st_size;
+  void *mapping = mmap (nullptr, _size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                        fd, 0);
+  close (fd); // the mapping keeps the file referenced
+  if (mapping == MAP_FAILED)
+    {
+      model_error (path);
+    }
+  _data = (char *) mapping;
+
+  const auto *header = (const ModelHeader *) _data;
+  if (header->magic != MODEL_MAGIC || header->version < 1
+      || header->version > MODEL_VERSION || header->layers == 0
+      || _size < sizeof (ModelHeader) + header->layers * sizeof (ModelLayer))
+    {
+      model_error (path);
+    }
+  for (int i = 0; i < layers (); i++)
+    {
+      const ModelLayer &l = layer (i);
+      // version 1 files wrote 0 there for their dense weights.
+      bool fits = l.format == MODEL_DENSE
+                  ? array_fits (l.weights_offset, l.rows, l.cols, _size)
+                  : sparse_fits (_data, l.weights_offset, l.format, l.rows,
+                                 _size);
+      if (l.rows <= 0 || l.cols <= 0
+          || l.activation < RELU || l.activation > LOG_SOFTMAX
+          || l.format < MODEL_DENSE || l.format > MODEL_BLOCKS || !fits
+          || !array_fits (l.bias_offset, l.rows, 1, _size))
+        {
+          model_error (path);
+        }
+    }
+}
+
+/**
+ * Unmaps the file, the views must not be used afterwards.
+ */
+MappedModel::~MappedModel ()
+{
+  munmap (_data, _size);
+}
+
+int MappedModel::layers () const
+{
+  return (int) ((const ModelHeader *) _data)->layers;
+}
+
+const ModelLayer &MappedModel::layer (int i) const
+{
+  if (i < 0 || i >= layers ())
+    {
+      std::cerr << OUT_OF_RANGE << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  return ((const ModelLayer *) (_data + sizeof (ModelHeader)))[i];
+}
+
+Matrix MappedModel::weights (int i) const
+{
+  const ModelLayer &l = layer (i);
+  if (l.format == MODEL_DENSE)
+    {
+      return Matrix::view ((float *) (_data + l.weights_offset), l.rows,
+                           l.cols);
+    }
+  const auto *row_ptr = (const int32_t *) (_data + l.weights_offset);
+  const int32_t *index = row_ptr + l.rows + 1;
+  const auto *values = (const float *) (index + row_ptr[l.rows]);
+  return SparseMatrix (l.format == MODEL_CSR ? CSR : BLOCKS, l.rows, l.cols,
+                       row_ptr, index, values).dense ();
+}
+
+Matrix MappedModel::bias (int i) const
+{
+  const ModelLayer &l = layer (i);
+  return Matrix::view ((float *) (_data + l.bias_offset), l.rows, 1);
+}
+
+ActivationType MappedModel::activation (int i) const
+{
+  return (ActivationType) layer (i).activation;
+}
+
+/**
+ * Writes a packed model file.
+ * @param path - output file
+ * @param weights - weights[i] is the i'th layer weights matrix
+ * @param biases - biases[i] is the i'th layer bias vector
+ * @param activations - activations[i] is the i'th layer activation
+ * @param layers - number of layers
+ * @param formats - formats[i] is how to store the i'th layer weights, all
+ *        dense if null
+ * @return false if the file could not be written
+ */
+bool MappedModel::write (const std::string &path, const Matrix weights[],
+                         const Matrix biases[],
+                         const ActivationType activations[], int layers,
+                         const int formats[])
+{
+  auto align = [] (uint64_t offset)
+  { return (offset + MODEL_ALIGN - 1) / MODEL_ALIGN * MODEL_ALIGN; };
+
+  ModelHeader header = {MODEL_MAGIC, MODEL_VERSION, (uint32_t) layers, 0};
+  std::vector<ModelLayer> table (layers);
+  std::vector<SparseMatrix> sparse (layers);
+  uint64_t offset = align (sizeof (ModelHeader) + layers * sizeof (ModelLayer));
+  for (int i = 0; i < layers; i++)
+    {
+      if (biases[i].get_rows () != weights[i].get_rows ()
+          || biases[i].get_cols () != 1)
+        {
+          return false;
+        }
+      table[i].rows = weights[i].get_rows ();
+      table[i].cols = weights[i].get_cols ();
+      table[i].activation = activations[i];
+      table[i].format = formats == nullptr ? MODEL_DENSE : formats[i];
+      table[i].weights_offset = offset;
+      if (table[i].format == MODEL_DENSE)
+        {
+          offset = align (offset + (uint64_t) table[i].rows * table[i].cols
+                                   * sizeof (float));
+        }
+      else if (table[i].format == MODEL_CSR || table[i].format == MODEL_BLOCKS)
+        {
+          sparse[i] = SparseMatrix (weights[i], table[i].format == MODEL_CSR
+                                                ? CSR : BLOCKS);
+          offset = align (offset + (uint64_t) sparse[i].bytes ());
+        }
+      else
+        {
+          return false;
+        }
+      table[i].bias_offset = offset;
+      offset = align (offset + (uint64_t) table[i].rows * sizeof (float));
+    }
+
+  std::ofstream os (path, std::ios::out | std::ios::binary | std::ios::trunc);
+  os.write ((const char *) &header, sizeof (header));
+  os.write ((const char *) table.data (), layers * sizeof (ModelLayer));
+  const char zeros[MODEL_ALIGN] = {};
+  auto pad_to = [&os, &zeros] (uint64_t target)
+  {
+    uint64_t at = (uint64_t) os.tellp ();
+    os.write (zeros, (std::streamsize) (target - at));
+  };
+  for (int i = 0; i < layers; i++)
+    {
+      pad_to (table[i].weights_offset);
+      if (table[i].format == MODEL_DENSE)
+        {
+          os.write ((const char *) weights[i].data (),
+                    (std::streamsize) (table[i].rows * table[i].cols
+                                       * sizeof (float)));
+        }
+      else
+        {
+          const SparseMatrix &w = sparse[i];
+          int values = w.get_format () == BLOCKS ? w.entries () * SPARSE_BLOCK
+                                                 : w.entries ();
+          os.write ((const char *) w.row_ptr (),
+                    (std::streamsize) ((w.get_rows () + 1) * sizeof (int32_t)));
+          os.write ((const char *) w.index (),
+                    (std::streamsize) (w.entries () * sizeof (int32_t)));
+          os.write ((const char *) w.values (),
+                    (std::streamsize) (values * sizeof (float)));
+        }
+      pad_to (table[i].bias_offset);
+      os.write ((const char *) biases[i].data (),
+                (std::streamsize) (table[i].rows * sizeof (float)));
+    }
+  return (bool) os;
+}
@@ -0,0 +1,109 @@
+// ModelFile.h
+
+#ifndef MODELFILE_H
+#define MODELFILE_H
+
+#include <cstdint>
+#include <string>
+#include "Activation.h"
+
+#define MODEL_MAGIC 0x4d504c4du // "MLPM" in a little endian file
+#define MODEL_VERSION 2 // 2 added sparse weights, 1 files still load
+#define MODEL_ALIGN 64
+#define MODEL_FILE_ERROR "Error: invalid model file: "
+// ModelLayer.format values: how the layer's weights are stored.
+#define MODEL_DENSE 0
+#define MODEL_CSR 1
+#define MODEL_BLOCKS 2
+
+/**
+ * Packed model file layout (native byte order):
+ *   ModelHeader
+ *   ModelLayer[layers]
+ *   every weights and bias array, each starting at a MODEL_ALIGN aligned
+ *   file offset, row after row.
+ * Sparse weights (MODEL_CSR, MODEL_BLOCKS) are instead the int32 row_ptr,
+ * the int32 index and the float values arrays of a SparseMatrix, back to
+ * back from the weights offset.
+ */
+typedef struct ModelHeader
+{
+    uint32_t magic, version, layers, reserved;
+} ModelHeader;
+
+typedef struct ModelLayer
+{
+    int32_t rows, cols; // weights dims, the bias is rows x 1
+    int32_t activation; // ActivationType
+    int32_t format; // MODEL_DENSE, MODEL_CSR or MODEL_BLOCKS
+    uint64_t weights_offset, bias_offset; // from the start of the file
+} ModelLayer;
+
+/**
+ * A packed model file mapped into memory. The weights and biases are
+ * Matrix views straight into the mapping, so loading copies nothing: the
+ * pages are read lazily and shared by every process mapping the file.
+ * The mapping is private and copy on write, so writing through a view
+ * never changes the file.
+ */
+class MappedModel
+{
+ public:
+  /**
+   * Maps the model file and validates its header and layer table.
+   * Exits (code == 1) if the file cannot be mapped or is malformed.
+   * @param path - the model file
+   */
+  explicit MappedModel(const std::string &path);
+  /**
+   * Unmaps the file, the views must not be used afterwards.
+   */
+  ~MappedModel();
+  MappedModel(const MappedModel&) = delete;
+  MappedModel& operator=(const MappedModel&) = delete;
+
+  /**
+   * @return number of layers in the model.
+   */
+  int layers() const;
+  /**
+   * @param i - layer index
+   * @return view of the i'th layer's weights, or for sparse weights a copy
+   *         expanded with their zeros. Exits (code == 1) if the sparse
+   *         arrays are malformed.
+   */
+  Matrix weights(int i) const;
+  /**
+   * @param i - layer index
+   * @return view of the i'th layer's bias
+   */
+  Matrix bias(int i) const;
+  /**
+   * @param i - layer index
+   * @return the i'th layer's activation
+   */
+  ActivationType activation(int i) const;
+
+  /**
+   * Writes a packed model file.
+   * @param path - output file
+   * @param weights - weights[i] is the i'th layer weights matrix
+   * @param biases - biases[i] is the i'th layer bias vector
+   * @param activations - activations[i] is the i'th layer activation
+   * @param layers - number of layers
+   * @param formats - formats[i] is how to store the i'th layer weights
+   *        (MODEL_DENSE, MODEL_CSR or MODEL_BLOCKS), all dense if null
+   * @return false if the file could not be written
+   */
+  static bool write(const std::string &path, const Matrix weights[],
+                    const Matrix biases[], const ActivationType activations[],
+                    int layers, const int formats[] = nullptr);
+
+ private:
+  const ModelLayer &layer(int i) const;
+
+  char *_data;
+  size_t _size;
+};
+
+#endif //MODELFILE_H
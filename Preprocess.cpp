@@ -0,0 +1,465 @@
+// Preprocess.cpp
+
+#include "Preprocess.h"
+#include "MlpNetwork.h"
+#include "Simd.h"
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+
+#define PGM_MAX_PIXELS (1L << 28) // larger files are rejected unread
+#define PIPELINE_ERROR "Error: preprocessing chunks must hold an image."
+
+/**
+ * Reads one number of a PGM header, skipping whitespace and comments.
+ * @return false if there is none
+ */
+static bool pgm_number (std::istream &is, long &value)
+{
+  int c = is.get ();
+  while (c == '#' || std::isspace (c))
+    {
+      if (c == '#')
+        {
+          while (c != '\n' && c != EOF)
+            {
+              c = is.get ();
+            }
+        }
+      c = is.get ();
+    }
+  if (!std::isdigit (c))
+    {
+      return false;
+    }
+  value = 0;
+  while (std::isdigit (c) && value < PGM_MAX_PIXELS)
+    {
+      value = value * 10 + (c - '0');
+      c = is.get ();
+    }
+  // the single whitespace after the header's last number is consumed too.
+  return c == EOF || std::isspace (c);
+}
+
+/**
+ * Reads a binary (P5) or plain (P2) PGM file, 16 bit files are scaled to
+ * 8 bits.
+ */
+bool read_pgm (const std::string &path, GrayImage &image)
+{
+  std::ifstream is (path, std::ios::in | std::ios::binary);
+  char magic[2];
+  long width, height, maxval;
+  if (!is.read (magic, 2) || magic[0] != 'P'
+      || (magic[1] != '5' && magic[1] != '2') || !pgm_number (is, width)
+      || !pgm_number (is, height) || !pgm_number (is, maxval) || width <= 0
+      || height <= 0 || width * height > PGM_MAX_PIXELS || maxval <= 0
+      || maxval > 65535)
+    {
+      return false;
+    }
+  long size = width * height;
+  image.width = (int) width;
+  image.height = (int) height;
+  image.pixels.resize (size);
+  if (magic[1] == '5' && maxval < 256)
+    {
+      if (!is.read ((char *) image.pixels.data (), size))
+        {
+          return false;
+        }
+      if (maxval != 255)
+        {
+          for (unsigned char &p : image.pixels)
+            {
+              p = (unsigned char) std::min (255L, p * 255 / maxval);
+            }
+        }
+      return true;
+    }
+  std::vector<unsigned char> bytes (magic[1] == '5' ? size * 2 : 0);
+  if (magic[1] == '5' && !is.read ((char *) bytes.data (), size * 2))
+    {
+      return false;
+    }
+  for (long i = 0; i < size; i++)
+    {
+      long value;
+      if (magic[1] == '5')
+        {
+          value = bytes[2 * i] << 8 | bytes[2 * i + 1]; // big endian
+        }
+      else if (!pgm_number (is, value))
+        {
+          return false;
+        }
+      image.pixels[i] = (unsigned char) (std::min (value, maxval) * 255
+                                         / maxval);
+    }
+  return true;
+}
+
+/**
+ * @struct Taps
+ * @brief The source pixels of every output pixel along one axis: output o
+ * is the sum of source first[o] + t times weights[o * width + t], for t
+ * below count[o].
+ */
+typedef struct Taps
+{
+    int width;
+    std::vector<int> first;
+    std::vector<int> count;
+    std::vector<float> weights;
+} Taps;
+
+/**
+ * Maps from source pixels to to output pixels. Shrinking averages the
+ * source pixels an output pixel covers, each by its covered fraction;
+ * enlarging interpolates linearly between the two nearest.
+ */
+static void axis_taps (int from, int to, Taps &taps)
+{
+  double ratio = (double) from / to;
+  taps.width = from >= to ? (int) std::ceil (ratio) + 1 : 2;
+  taps.first.assign (to, 0);
+  taps.count.assign (to, 0);
+  taps.weights.assign ((size_t) to * taps.width, 0);
+  for (int o = 0; o < to; o++)
+    {
+      float *weights = taps.weights.data () + (long) o * taps.width;
+      if (from >= to)
+        {
+          double start = o * ratio;
+          double end = std::min ((o + 1) * ratio, (double) from);
+          int first = (int) start;
+          int last = std::min ((int) std::ceil (end), from) - 1;
+          taps.first[o] = first;
+          taps.count[o] = last - first + 1;
+          for (int i = first; i <= last; i++)
+            {
+              weights[i - first] = (float) ((std::min (end, i + 1.0)
+                                             - std::max (start, (double) i))
+                                            / ratio);
+            }
+          continue;
+        }
+      double at = std::min (std::max ((o + 0.5) * ratio - 0.5, 0.0),
+                            from - 1.0);
+      int first = std::min ((int) at, from - 1);
+      double fraction = at - first;
+      taps.first[o] = first;
+      taps.count[o] = first + 1 < from ? 2 : 1;
+      weights[0] = (float) (1 - fraction);
+      weights[1] = (float) fraction;
+    }
+}
+
+/**
+ * Resizes a width x height block of pixels to to_width x to_height floats,
+ * normalizing them to pixel * scale + offset. Rows first: every output row
+ * adds up its source rows, converted a row at a time, with vector multiply
+ * adds across the whole width; then every output pixel is a dot product
+ * along its row.
+ */
+static void resample (const unsigned char *pixels, int width, int height,
+                      int stride, float scale, float offset, int to_width,
+                      int to_height, float *out)
+{
+  static thread_local Taps vertical, horizontal;
+  static thread_local std::vector<float> rows, line;
+  const SimdKernels &kernels = simd ();
+  if (width == to_width && height == to_height)
+    {
+      // already the size: every output pixel is its one source pixel.
+      for (int y = 0; y < height; y++)
+        {
+          kernels.u8_to_fp32 (pixels + (long) y * stride, scale, offset,
+                              out + (long) y * width, width);
+        }
+      return;
+    }
+  axis_taps (height, to_height, vertical);
+  axis_taps (width, to_width, horizontal);
+  rows.assign ((size_t) to_height * width, 0);
+  line.resize (width);
+  for (int y = 0; y < to_height; y++)
+    {
+      float *row = rows.data () + (long) y * width;
+      for (int t = 0; t < vertical.count[y]; t++)
+        {
+          kernels.u8_to_fp32 (pixels + (long) (vertical.first[y] + t) * stride,
+                              scale, offset, line.data (), width);
+          kernels.axpy (vertical.weights[(long) y * vertical.width + t],
+                        line.data (), row, width);
+        }
+      for (int x = 0; x < to_width; x++)
+        {
+          out[y * to_width + x] = kernels.dot (
+              row + horizontal.first[x],
+              horizontal.weights.data () + (long) x * horizontal.width,
+              horizontal.count[x]);
+        }
+    }
+}
+
+/**
+ * Normalizes and resizes the whole image, or, to center it, crops it to
+ * the bounding box of its ink, fits that in a PREPROCESS_BOX square and
+ * places it so its center of mass is the image's center.
+ */
+void preprocess (const unsigned char *pixels, int width, int height,
+                 int stride, const PreprocessOptions &options, float *out)
+{
+  int size = img_dims.rows;
+  float scale = (options.invert ? -1 : 1) / PREPROCESS_MAX_PIXEL;
+  float offset = options.invert ? 1 : 0;
+  if (!options.center)
+    {
+      resample (pixels, width, height, stride, scale, offset, size, size,
+                out);
+      return;
+    }
+  std::fill (out, out + size * size, 0.0f);
+  auto is_ink = [&] (unsigned char p)
+    { return (options.invert ? 255 - p : p) > PREPROCESS_INK; };
+  // whether [from, to) of a row holds ink: a branch free min and max pass,
+  // which vectorizes, so only the rows and ends with ink are scanned.
+  auto has_ink = [&] (const unsigned char *row, int from, int to)
+    {
+      unsigned char lo = 255, hi = 0;
+      for (int x = from; x < to; x++)
+        {
+          lo = std::min (lo, row[x]);
+          hi = std::max (hi, row[x]);
+        }
+      return from < to && is_ink (options.invert ? lo : hi);
+    };
+  int left = width, right = -1, top = height, bottom = -1;
+  for (int y = 0; y < height; y++)
+    {
+      const unsigned char *row = pixels + (long) y * stride;
+      if (!has_ink (row, 0, width))
+        {
+          continue;
+        }
+      if (has_ink (row, 0, left))
+        {
+          for (int x = 0; x < left; x++)
+            {
+              if (is_ink (row[x]))
+                {
+                  left = x;
+                }
+            }
+        }
+      if (has_ink (row, right + 1, width))
+        {
+          for (int x = width - 1; x > right; x--)
+            {
+              if (is_ink (row[x]))
+                {
+                  right = x;
+                }
+            }
+        }
+      top = std::min (top, y);
+      bottom = y;
+    }
+  if (bottom < 0)
+    {
+      return; // no ink, a blank image
+    }
+  int box_width = right - left + 1;
+  int box_height = bottom - top + 1;
+  double fit = (double) PREPROCESS_BOX / std::max (box_width, box_height);
+  int to_width = std::max (1, (int) std::lround (box_width * fit));
+  int to_height = std::max (1, (int) std::lround (box_height * fit));
+  float box[PREPROCESS_BOX * PREPROCESS_BOX];
+  resample (pixels + (long) top * stride + left, box_width, box_height,
+            stride, scale, offset, to_width, to_height, box);
+
+  double mass = 0, mass_x = 0, mass_y = 0;
+  for (int y = 0; y < to_height; y++)
+    {
+      for (int x = 0; x < to_width; x++)
+        {
+          float v = box[y * to_width + x];
+          mass += v;
+          mass_x += v * (x + 0.5);
+          mass_y += v * (y + 0.5);
+        }
+    }
+  double center_x = mass > 0 ? mass_x / mass : to_width / 2.0;
+  double center_y = mass > 0 ? mass_y / mass : to_height / 2.0;
+  int shift_x = (int) std::lround (size / 2.0 - center_x);
+  int shift_y = (int) std::lround (size / 2.0 - center_y);
+  for (int y = 0; y < to_height; y++)
+    {
+      int to_y = y + shift_y;
+      if (to_y < 0 || to_y >= size)
+        {
+          continue;
+        }
+      for (int x = std::max (0, -shift_x);
+           x < to_width && x + shift_x < size; x++)
+        {
+          out[to_y * size + x + shift_x] = box[y * to_width + x];
+        }
+    }
+}
+
+/**
+ * Reads a raw 28x28 float file as is, or else a PGM file of any size,
+ * resized to 28x28 without centering or inverting.
+ */
+bool read_image (const std::string &path, float *out)
+{
+  const long pixels = (long) img_dims.rows * img_dims.cols;
+  std::ifstream is (path, std::ios::in | std::ios::binary | std::ios::ate);
+  if (!is.is_open ())
+    {
+      return false;
+    }
+  if (is.tellg () == (long) (pixels * sizeof (float)))
+    {
+      is.seekg (0, std::ios_base::beg);
+      return (bool) is.read ((char *) out, pixels * sizeof (float));
+    }
+  is.close ();
+  GrayImage image;
+  if (!read_pgm (path, image))
+    {
+      return false;
+    }
+  preprocess (image.pixels.data (), image.width, image.height, image.width,
+              PreprocessOptions{false, false}, out);
+  return true;
+}
+
+/**
+ * Starts the preprocessing thread.
+ * Exits (code == 1) if chunk is not positive.
+ */
+PreprocessPipeline::PreprocessPipeline (const std::vector<std::string> &paths,
+                                        const PreprocessOptions &options,
+                                        int chunk)
+    : _paths (paths), _options (options), _chunk (chunk),
+      _chunks (chunk > 0 ? ((int) paths.size () + chunk - 1) / chunk : 0),
+      _counts (PIPELINE_DEPTH, 0), _done (0), _taken (0), _current (-1),
+      _waited (0), _stop (false)
+{
+  if (chunk <= 0)
+    {
+      std::cerr << PIPELINE_ERROR << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  int pixels = img_dims.rows * img_dims.cols;
+  _slots = Matrix (PIPELINE_DEPTH * chunk, pixels, NO_FILL);
+  _valid.assign (PIPELINE_DEPTH * chunk, 0);
+  _thread = std::thread (&PreprocessPipeline::run, this);
+}
+
+PreprocessPipeline::~PreprocessPipeline ()
+{
+  {
+    std::lock_guard<std::mutex> guard (_lock);
+    _stop = true;
+  }
+  _free.notify_all ();
+  _thread.join ();
+}
+
+/**
+ * Preprocesses the chunks in order, each into its slot once the chunk that
+ * last used the slot has been handed back.
+ */
+void PreprocessPipeline::run ()
+{
+  GrayImage image;
+  int pixels = _slots.get_cols ();
+  for (int c = 0; c < _chunks; c++)
+    {
+      {
+        std::unique_lock<std::mutex> guard (_lock);
+        _free.wait (guard, [this, c] ()
+                    { return _stop || c - _taken < PIPELINE_DEPTH; });
+        if (_stop)
+          {
+            return;
+          }
+      }
+      int slot = c % PIPELINE_DEPTH;
+      int first = c * _chunk;
+      int count = std::min (_chunk, (int) _paths.size () - first);
+      for (int i = 0; i < count; i++)
+        {
+          int row = slot * _chunk + i;
+          bool ok = read_pgm (_paths[first + i], image);
+          if (ok)
+            {
+              preprocess (image.pixels.data (), image.width, image.height,
+                          image.width, _options, _slots.row (row));
+            }
+          else
+            {
+              std::fill (_slots.row (row), _slots.row (row) + pixels, 0.0f);
+            }
+          _valid[row] = ok;
+        }
+      {
+        std::lock_guard<std::mutex> guard (_lock);
+        _counts[slot] = count;
+        _done = c + 1;
+      }
+      _ready.notify_one ();
+    }
+}
+
+/**
+ * Hands the last chunk back and waits for the next one.
+ */
+int PreprocessPipeline::next ()
+{
+  std::unique_lock<std::mutex> guard (_lock);
+  if (_current >= 0)
+    {
+      _taken++;
+      _current = -1;
+      _free.notify_one ();
+    }
+  if (_taken >= _chunks)
+    {
+      return 0;
+    }
+  auto start = std::chrono::steady_clock::now ();
+  _ready.wait (guard, [this] () { return _done > _taken; });
+  _waited += std::chrono::duration<double> (
+      std::chrono::steady_clock::now () - start).count ();
+  _current = _taken % PIPELINE_DEPTH;
+  return _counts[_current];
+}
+
+MatrixView PreprocessPipeline::images () const
+{
+  if (_current < 0)
+    {
+      return MatrixView (_slots.data (), 0, _slots.get_cols ());
+    }
+  return MatrixView (_slots.row (_current * _chunk), _counts[_current],
+                     _slots.get_cols ());
+}
+
+bool PreprocessPipeline::valid (int i) const
+{
+  return _valid[_current * _chunk + i];
+}
+
+double PreprocessPipeline::waited () const
+{
+  return _waited;
+}
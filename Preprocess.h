@@ -0,0 +1,143 @@
+// Preprocess.h
+
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "Matrix.h"
+
+// MNIST digits are scaled to fit a PREPROCESS_BOX square, keeping their
+// aspect ratio, then centered by mass in the 28x28 image.
+#define PREPROCESS_BOX 20
+// foreground (ink, after any inversion) above this value bounds the digit.
+#define PREPROCESS_INK 64
+#define PREPROCESS_MAX_PIXEL 255.0f
+// images per chunk of the pipeline, and chunks it preprocesses ahead.
+#define PIPELINE_CHUNK 32
+#define PIPELINE_DEPTH 4
+
+/**
+ * @struct PreprocessOptions
+ * @brief How a grayscale image becomes a network input.
+ * @var center - crop to the digit, fit it in a PREPROCESS_BOX square and
+ *      center it by its center of mass, as MNIST was made; otherwise the
+ *      whole image is resized to 28x28
+ * @var invert - the digit is dark on a light background (paper scans),
+ *      MNIST's is light on dark
+ */
+typedef struct PreprocessOptions
+{
+    bool center;
+    bool invert;
+} PreprocessOptions;
+
+/**
+ * @struct GrayImage
+ * @brief 8 bit grayscale image, row major, width bytes per row.
+ */
+typedef struct GrayImage
+{
+    int width;
+    int height;
+    std::vector<unsigned char> pixels;
+} GrayImage;
+
+/**
+ * Reads a binary (P5) or plain (P2) PGM file. 16 bit files are scaled to
+ * 8 bits.
+ * @param image - set to the file's image
+ * @return false if the file is missing or is no valid PGM
+ */
+bool read_pgm(const std::string &path, GrayImage &image);
+
+/**
+ * Turns a grayscale image of any size into a 28x28 network input in
+ * [0, 1]: normalized, resized (averaging the pixels each output pixel
+ * covers, or interpolating when enlarging) and optionally centered.
+ * @param pixels - height rows of width pixels
+ * @param stride - bytes between the beginnings of two rows
+ * @param out - 28 * 28 floats, row major, overwritten
+ */
+void preprocess(const unsigned char *pixels, int width, int height,
+                int stride, const PreprocessOptions &options, float *out);
+
+/**
+ * Reads a network input: a raw 28x28 float file as is, or a PGM file of
+ * any size, preprocessed without centering or inverting. The interactive
+ * mode and the server's path requests both read images this way.
+ * @param out - 28 * 28 floats, row major, overwritten
+ * @return false if the file is missing or is neither
+ */
+bool read_image(const std::string &path, float *out);
+
+/**
+ * Reads and preprocesses a list of PGM files on a thread of its own,
+ * up to PIPELINE_DEPTH chunks ahead of the caller, so decoding and
+ * resizing the next images overlaps the inference of the current ones.
+ * Chunks come out in order, like IdxReader's.
+ */
+class PreprocessPipeline
+{
+ public:
+  /**
+   * Starts the preprocessing thread.
+   * @param paths - PGM files, must outlive the pipeline
+   * @param chunk - images per chunk
+   */
+  PreprocessPipeline(const std::vector<std::string> &paths,
+                     const PreprocessOptions &options,
+                     int chunk = PIPELINE_CHUNK);
+  /**
+   * Stops the preprocessing thread, dropping the chunks not taken.
+   */
+  ~PreprocessPipeline();
+  PreprocessPipeline(const PreprocessPipeline&) = delete;
+  PreprocessPipeline& operator=(const PreprocessPipeline&) = delete;
+
+  /**
+   * Hands the last chunk back and waits for the next one.
+   * @return number of images in it, 0 after the last image
+   */
+  int next();
+  /**
+   * @return the images of the last chunk, one 784 pixel image per row.
+   */
+  MatrixView images() const;
+  /**
+   * @return false if the i'th image of the last chunk could not be read,
+   *         its row is then zeros.
+   */
+  bool valid(int i) const;
+  /**
+   * @return seconds next() spent waiting for the preprocessing thread.
+   */
+  double waited() const;
+
+ private:
+  void run();
+
+  const std::vector<std::string> &_paths;
+  PreprocessOptions _options;
+  int _chunk;
+  int _chunks; // chunks of the whole list
+  Matrix _slots; // PIPELINE_DEPTH chunks of images, reused in turn
+  std::vector<unsigned char> _valid; // a flag per row of _slots
+  std::vector<int> _counts; // images per slot
+  // chunks preprocessed and taken so far; the slot of chunk c is
+  // c % PIPELINE_DEPTH, free while c - _taken < PIPELINE_DEPTH.
+  int _done;
+  int _taken;
+  int _current; // slot of the last chunk next() returned, -1 before
+  double _waited;
+  bool _stop;
+  std::mutex _lock;
+  std::condition_variable _ready; // a chunk was preprocessed
+  std::condition_variable _free; // a slot was handed back, or stop
+  std::thread _thread;
+};
+
+#endif //PREPROCESS_H
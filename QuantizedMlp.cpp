@@ -0,0 +1,196 @@
+// QuantizedMlp.cpp
+
+#include "QuantizedMlp.h"
+#include "Simd.h"
+#include <algorithm>
+
+// smallest quantization range, keeps all-zero vectors from dividing by 0.
+#define MIN_RANGE 1e-8f
+
+/**
+ * Quantizes the network's weights, activations start out dynamic.
+ * @param mlp - the fp32 network
+ */
+QuantizedMlp::QuantizedMlp (const MlpNetwork &mlp) : _calibrated (false)
+{
+  for (int l = 0; l < mlp.get_depth (); l++)
+    {
+      const Dense &dense = mlp.get_layer (l);
+      Matrix widened; // for half layers
+      const MatrixView w = dense.get_weights (widened);
+      Layer layer{w.get_rows (), w.get_cols (), {}, {}, {}, {},
+                  dense.get_activation (), 0, 0};
+      layer.weights.resize ((size_t) layer.rows * layer.cols);
+      layer.scales.resize (layer.rows);
+      layer.row_sums.resize (layer.rows);
+      layer.bias.assign (dense.get_bias ().data (),
+                         dense.get_bias ().data () + layer.rows);
+      for (int i = 0; i < layer.rows; i++)
+        {
+          const float *row = w.data () + (size_t) i * layer.cols;
+          float max_abs = 0;
+          for (int j = 0; j < layer.cols; j++)
+            {
+              max_abs = std::max (max_abs, std::abs (row[j]));
+            }
+          float scale = std::max (max_abs, MIN_RANGE) / QUANT_MAX;
+          int sum = 0;
+          for (int j = 0; j < layer.cols; j++)
+            {
+              auto q = (signed char) std::lround (row[j] / scale);
+              layer.weights[(size_t) i * layer.cols + j] = q;
+              sum += q;
+            }
+          layer.scales[i] = scale;
+          layer.row_sums[i] = sum;
+        }
+      _layers.push_back (std::move (layer));
+    }
+}
+
+/**
+ * Records the range of every layer's input over the calibration images.
+ * @param mlp - the fp32 network this was built from
+ * @param batch - N x 784 calibration images, one per row
+ */
+void QuantizedMlp::calibrate (const MlpNetwork &mlp, MatrixView batch)
+{
+  if (batch.get_cols () != _layers[0].cols
+      || mlp.get_depth () != (int) _layers.size ())
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  for (auto &layer : _layers)
+    {
+      layer.in_min = 0;
+      layer.in_max = 0;
+    }
+  std::vector<float> ping, pong;
+  for (int n = 0; n < batch.get_rows (); n++)
+    {
+      ping.assign (batch.row (n), batch.row (n) + batch.get_cols ());
+      for (size_t l = 0; l < _layers.size (); l++)
+        {
+          auto range = std::minmax_element (ping.begin (), ping.end ());
+          _layers[l].in_min = std::min (_layers[l].in_min, *range.first);
+          _layers[l].in_max = std::max (_layers[l].in_max, *range.second);
+          pong.resize (_layers[l].rows);
+          mlp.get_layer ((int) l).forward (ping.data (), pong.data ());
+          std::swap (ping, pong);
+        }
+    }
+  _calibrated = true;
+}
+
+bool QuantizedMlp::is_calibrated () const
+{
+  return _calibrated;
+}
+
+/**
+ * Applies the quantized network on the input.
+ * @param input - 784 elements, read in row order
+ * @return digit struct
+ */
+digit QuantizedMlp::operator() (MatrixView input) const
+{
+  if (input.get_rows () * input.get_cols () != _layers[0].cols)
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  // per thread scratch buffers, reused by every call.
+  static thread_local std::vector<float> ping, pong;
+  static thread_local std::vector<unsigned char> quantized;
+  ping.resize (input.get_rows () * input.get_cols ());
+  for (int i = 0; i < input.get_rows (); i++)
+    {
+      std::copy (input.row (i), input.row (i) + input.get_cols (),
+                 ping.begin () + i * input.get_cols ());
+    }
+
+  const SimdKernels &kernels = simd ();
+  for (const auto &layer : _layers)
+    {
+      float lo = layer.in_min;
+      float hi = layer.in_max;
+      if (!_calibrated)
+        {
+          auto range = std::minmax_element (ping.begin (), ping.end ());
+          lo = *range.first;
+          hi = *range.second;
+        }
+      // the range always holds 0, so the zero point is exact.
+      lo = std::min (lo, 0.0f);
+      hi = std::max (hi, lo + MIN_RANGE);
+      float scale = (hi - lo) / QUANT_MAX;
+      int zero_point = (int) std::lround (-lo / scale);
+      quantized.resize (layer.cols);
+      for (int j = 0; j < layer.cols; j++)
+        {
+          long q = std::lround (ping[j] / scale) + zero_point;
+          quantized[j] = (unsigned char) std::min (std::max (q, 0L),
+                                                   (long) QUANT_MAX);
+        }
+
+      pong.resize (layer.rows);
+      for (int i = 0; i < layer.rows; i++)
+        {
+          int acc = kernels.dot_u8s8 (quantized.data (),
+                                      layer.weights.data ()
+                                      + (size_t) i * layer.cols, layer.cols);
+          acc -= zero_point * layer.row_sums[i];
+          pong[i] = (float) acc * scale * layer.scales[i] + layer.bias[i];
+        }
+      Matrix out = Matrix::view (pong.data (), layer.rows, 1);
+      layer.activation (out, out);
+      std::swap (ping, pong);
+    }
+
+  float max_prob = ping[0];
+  unsigned int ind = 0;
+  for (int i = 0; i < TEN; i++)
+    {
+      if (ping[i] > max_prob)
+        {
+          max_prob = ping[i];
+          ind = i;
+        }
+    }
+  if (_layers.back ().activation.get_activation_type () == LOG_SOFTMAX)
+    {
+      max_prob = std::exp (max_prob);
+    }
+  return digit{ind, max_prob};
+}
+
+/**
+ * Applies the quantized network on every row of batch.
+ * @param batch - N x 784 matrix, each row is one image
+ * @return vector of N digits, in the order of the batch rows
+ */
+std::vector<digit> QuantizedMlp::classify_batch (MatrixView batch) const
+{
+  std::vector<digit> results;
+  results.reserve (batch.get_rows ());
+  for (int i = 0; i < batch.get_rows (); i++)
+    {
+      results.push_back ((*this) (MatrixView (batch.row (i), 1,
+                                              batch.get_cols ())));
+    }
+  return results;
+}
+
+/**
+ * @return bytes of quantized weights and their scales.
+ */
+size_t QuantizedMlp::weights_bytes () const
+{
+  size_t bytes = 0;
+  for (const auto &layer : _layers)
+    {
+      bytes += layer.weights.size () + layer.scales.size () * sizeof (float);
+    }
+  return bytes;
+}
@@ -0,0 +1,75 @@
+// QuantizedMlp.h
+
+#ifndef QUANTIZEDMLP_H
+#define QUANTIZEDMLP_H
+
+#include <vector>
+#include "MlpNetwork.h"
+
+// quantized weights are in [-127, 127], activations in [0, 127]: the
+// activations' 7 bits keep pmaddubsw's 16 bit pair sums from saturating.
+#define QUANT_MAX 127
+
+/**
+ * Int8 post training quantization of an MlpNetwork.
+ * Weights are quantized once, symmetrically with one scale per row.
+ * Layer inputs are quantized to 7 bit unsigned values with a zero point,
+ * using either the range of each vector (dynamic) or a range recorded by
+ * calibrate. The products are accumulated in int32 by the byte dot kernel
+ * (VNNI or pmaddubsw), then rescaled to float for the bias and activation.
+ * Weights take a quarter of the fp32 bandwidth.
+ */
+class QuantizedMlp
+{
+ public:
+  /**
+   * Quantizes the network's weights, activations start out dynamic.
+   * @param mlp - the fp32 network
+   */
+  explicit QuantizedMlp(const MlpNetwork &mlp);
+  /**
+   * Runs the fp32 network on every image of batch, records the range of
+   * every layer's input, and from then on quantizes activations with
+   * these fixed ranges instead of per vector ranges.
+   * @param mlp - the fp32 network this was built from
+   * @param batch - N x 784 calibration images, one per row
+   */
+  void calibrate(const MlpNetwork &mlp, MatrixView batch);
+  /**
+   * @return true once calibrate was called.
+   */
+  bool is_calibrated() const;
+  /**
+   * Applies the quantized network on the input.
+   * @param input - 784 elements, read in row order
+   * @return digit struct
+   */
+  digit operator()(MatrixView input) const;
+  /**
+   * Applies the quantized network on every row of batch.
+   * @param batch - N x 784 matrix, each row is one image
+   * @return vector of N digits, in the order of the batch rows
+   */
+  std::vector<digit> classify_batch(MatrixView batch) const;
+  /**
+   * @return bytes of quantized weights and their scales.
+   */
+  size_t weights_bytes() const;
+
+ private:
+  struct Layer
+  {
+      int rows, cols;
+      std::vector<signed char> weights; // rows x cols
+      std::vector<float> scales; // one per row
+      std::vector<int> row_sums; // of the quantized weights, for zero points
+      std::vector<float> bias;
+      Activation activation;
+      float in_min, in_max; // calibrated input range
+  };
+
+  std::vector<Layer> _layers;
+  bool _calibrated;
+};
+
+#endif //QUANTIZEDMLP_H
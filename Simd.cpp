@@ -0,0 +1,1434 @@
+// Simd.cpp
+
+#include "Simd.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+// ---------------------------------------------------------------- scalar --
+
+static float dot_scalar (const float *a, const float *b, int n)
+{
+  float sum = 0;
+  for (int i = 0; i < n; i++)
+    {
+      sum += a[i] * b[i];
+    }
+  return sum;
+}
+
+static void mul_scalar (const float *a, const float *b, float *out, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      out[i] = a[i] * b[i];
+    }
+}
+
+static void add_scalar (float *a, const float *b, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      a[i] += b[i];
+    }
+}
+
+static void scale_scalar (const float *a, float c, float *out, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      out[i] = a[i] * c;
+    }
+}
+
+static void relu_scalar (const float *a, float *out, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      out[i] = a[i] < 0 ? 0 : a[i];
+    }
+}
+
+static void axpy_scalar (float c, const float *a, float *out, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      out[i] += c * a[i];
+    }
+}
+
+static float dot_blocks_scalar (const float *a, const int32_t *index,
+                               int count, const float *x)
+{
+  float sum = 0;
+  for (int e = 0; e < count; e++)
+    {
+      sum += dot_scalar (a + 8 * e, x + index[e], 8);
+    }
+  return sum;
+}
+
+static float dot_gather_scalar (const float *a, const int32_t *index, int n,
+                               const float *x)
+{
+  float sum = 0;
+  for (int i = 0; i < n; i++)
+    {
+      sum += a[i] * x[index[i]];
+    }
+  return sum;
+}
+
+static int dot_u8s8_scalar (const unsigned char *a, const signed char *b,
+                            int n)
+{
+  int sum = 0;
+  for (int i = 0; i < n; i++)
+    {
+      sum += a[i] * b[i];
+    }
+  return sum;
+}
+
+static void exp_scalar (const float *a, float *out, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      out[i] = std::exp (a[i]);
+    }
+}
+
+// ------------------------------------------------------------- transpose --
+// The transpose walks TRANSPOSE_BLOCK square blocks, so the block's source
+// rows and destination rows all stay in L1 while it is done, and every
+// block in Tile x Tile tiles that the kernel transposes in registers.
+#define TRANSPOSE_BLOCK 32
+
+template<int Tile, void (*Kernel) (const float *, int, float *, int)>
+static void transpose_blocked (const float *a, int lda, float *out, int ldo,
+                               int rows, int cols)
+{
+  int full_rows = rows - rows % Tile;
+  int full_cols = cols - cols % Tile;
+  for (int ib = 0; ib < full_rows; ib += TRANSPOSE_BLOCK)
+    {
+      int ie = std::min (ib + TRANSPOSE_BLOCK, full_rows);
+      for (int jb = 0; jb < full_cols; jb += TRANSPOSE_BLOCK)
+        {
+          int je = std::min (jb + TRANSPOSE_BLOCK, full_cols);
+          for (int i = ib; i < ie; i += Tile)
+            {
+              for (int j = jb; j < je; j += Tile)
+                {
+                  Kernel (a + (long) i * lda + j, lda,
+                          out + (long) j * ldo + i, ldo);
+                }
+            }
+        }
+    }
+  // the ragged edges: the last cols % Tile columns, then the last rows.
+  for (int i = 0; i < full_rows; i++)
+    {
+      for (int j = full_cols; j < cols; j++)
+        {
+          out[(long) j * ldo + i] = a[(long) i * lda + j];
+        }
+    }
+  for (int i = full_rows; i < rows; i++)
+    {
+      for (int j = 0; j < cols; j++)
+        {
+          out[(long) j * ldo + i] = a[(long) i * lda + j];
+        }
+    }
+}
+
+static void tile4x4_scalar (const float *a, int lda, float *out, int ldo)
+{
+  for (int i = 0; i < 4; i++)
+    {
+      for (int j = 0; j < 4; j++)
+        {
+          out[j * ldo + i] = a[i * lda + j];
+        }
+    }
+}
+
+static void transpose_scalar (const float *a, int lda, float *out, int ldo,
+                              int rows, int cols)
+{
+  transpose_blocked<4, tile4x4_scalar> (a, lda, out, ldo, rows, cols);
+}
+
+// ---------------------------------------------------------- half floats --
+// fp16: 1 sign, 5 exponent (bias 15) and 10 mantissa bits. bf16: the high
+// half of an fp32, 1 sign, 8 exponent and 7 mantissa bits.
+
+static float fp16_to_float (uint16_t h)
+{
+  uint32_t sign = (uint32_t) (h & 0x8000) << 16;
+  uint32_t exponent = (h >> 10) & 0x1f;
+  uint32_t mantissa = h & 0x3ff;
+  uint32_t bits;
+  if (exponent == 0x1f)
+    {
+      bits = sign | 0x7f800000 | (mantissa << 13); // inf or nan
+    }
+  else if (exponent != 0)
+    {
+      bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+    }
+  else
+    {
+      // zero or subnormal: mantissa * 2^-24, exact in fp32.
+      float value = std::ldexp ((float) mantissa, -24);
+      return sign ? -value : value;
+    }
+  float f;
+  std::memcpy (&f, &bits, sizeof (f));
+  return f;
+}
+
+static uint16_t float_to_fp16 (float f)
+{
+  uint32_t bits;
+  std::memcpy (&bits, &f, sizeof (bits));
+  uint16_t sign = (uint16_t) ((bits >> 16) & 0x8000);
+  uint32_t magnitude = bits & 0x7fffffff;
+  if (magnitude > 0x7f800000)
+    {
+      return sign | 0x7e00; // quiet nan
+    }
+  if (magnitude >= 0x477ff000)
+    {
+      return sign | 0x7c00; // 65520 and up round to inf
+    }
+  if (magnitude < 0x38800000)
+    {
+      // below 2^-14, a subnormal half: count units of 2^-24, the scaling is
+      // exact and nearbyint rounds to nearest even.
+      float m;
+      std::memcpy (&m, &magnitude, sizeof (m));
+      return sign | (uint16_t) std::nearbyint (m * 16777216.0f);
+    }
+  // rebias the exponent, round the 23 mantissa bits to 10, ties to even.
+  uint32_t rounded = magnitude + 0xfff + ((magnitude >> 13) & 1);
+  return sign | (uint16_t) ((rounded - 0x38000000) >> 13);
+}
+
+static float bf16_to_float (uint16_t h)
+{
+  uint32_t bits = (uint32_t) h << 16;
+  float f;
+  std::memcpy (&f, &bits, sizeof (f));
+  return f;
+}
+
+static uint16_t float_to_bf16 (float f)
+{
+  uint32_t bits;
+  std::memcpy (&bits, &f, sizeof (bits));
+  if ((bits & 0x7fffffff) > 0x7f800000)
+    {
+      return (uint16_t) ((bits >> 16) | 0x40); // keep nans quiet nans
+    }
+  return (uint16_t) ((bits + 0x7fff + ((bits >> 16) & 1)) >> 16);
+}
+
+static float dot_fp16_scalar (const uint16_t *a, const float *b, int n)
+{
+  float sum = 0;
+  for (int i = 0; i < n; i++)
+    {
+      sum += fp16_to_float (a[i]) * b[i];
+    }
+  return sum;
+}
+
+static float dot_bf16_scalar (const uint16_t *a, const float *b, int n)
+{
+  float sum = 0;
+  for (int i = 0; i < n; i++)
+    {
+      sum += bf16_to_float (a[i]) * b[i];
+    }
+  return sum;
+}
+
+static void fp16_to_fp32_scalar (const uint16_t *a, float *out, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      out[i] = fp16_to_float (a[i]);
+    }
+}
+
+static void bf16_to_fp32_scalar (const uint16_t *a, float *out, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      out[i] = bf16_to_float (a[i]);
+    }
+}
+
+static void fp32_to_fp16_scalar (const float *a, uint16_t *out, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      out[i] = float_to_fp16 (a[i]);
+    }
+}
+
+static void fp32_to_bf16_scalar (const float *a, uint16_t *out, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      out[i] = float_to_bf16 (a[i]);
+    }
+}
+
+static void u8_to_fp32_scalar (const unsigned char *a, float scale,
+                               float offset, float *out, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      out[i] = a[i] * scale + offset;
+    }
+}
+
+static const SimdKernels scalar_kernels = {"scalar", dot_scalar, mul_scalar,
+                                           add_scalar, scale_scalar,
+                                           relu_scalar, dot_u8s8_scalar,
+                                           exp_scalar, axpy_scalar,
+                                           transpose_scalar,
+                                           dot_blocks_scalar,
+                                           dot_gather_scalar,
+                                           dot_fp16_scalar, dot_bf16_scalar,
+                                           fp16_to_fp32_scalar,
+                                           bf16_to_fp32_scalar,
+                                           fp32_to_fp16_scalar,
+                                           fp32_to_bf16_scalar,
+                                           u8_to_fp32_scalar};
+
+#ifdef SIMD_X86
+
+// ------------------------------------------------------------------- exp --
+// e^x = 2^n * e^r, n = round(x / ln 2), r = x - n ln 2 in [-ln2/2, ln2/2],
+// with ln 2 split in two so r is exact. e^r = 1 + r + r^2 p(r), p of
+// degree 5 (Cephes expf), and 2^n is built in the exponent bits. EXP_MAX
+// keeps n <= 127, a finite exponent.
+#define EXP_MIN -87.3f
+#define EXP_MAX 88.3f
+#define EXP_LOG2E 1.44269504088896341f
+#define EXP_LN2_HI 0.693359375f
+#define EXP_LN2_LO -2.12194440e-4f
+#define EXP_P0 1.9875691500e-4f
+#define EXP_P1 1.3981999507e-3f
+#define EXP_P2 8.3334519073e-3f
+#define EXP_P3 4.1665795894e-2f
+#define EXP_P4 1.6666665459e-1f
+#define EXP_P5 5.0000001201e-1f
+
+/**
+ * The vector kernels' polynomial on one element, for their tails, so every
+ * lane of a vector gets the same result.
+ */
+static float exp_poly (float x)
+{
+  x = std::min (std::max (x, EXP_MIN), EXP_MAX);
+  float n = std::nearbyint (x * EXP_LOG2E);
+  float r = x - n * EXP_LN2_HI - n * EXP_LN2_LO;
+  float p = EXP_P0;
+  p = p * r + EXP_P1;
+  p = p * r + EXP_P2;
+  p = p * r + EXP_P3;
+  p = p * r + EXP_P4;
+  p = p * r + EXP_P5;
+  float y = p * r * r + r + 1;
+  int bits = ((int) n + 127) << 23;
+  float scale;
+  std::memcpy (&scale, &bits, sizeof (scale));
+  return y * scale;
+}
+
+static void exp_poly_scalar (const float *a, float *out, int n)
+{
+  for (int i = 0; i < n; i++)
+    {
+      out[i] = exp_poly (a[i]);
+    }
+}
+
+// ------------------------------------------------------------------ sse4 --
+
+#define SSE_TARGET __attribute__((target("sse4.1")))
+
+SSE_TARGET static float dot_sse4 (const float *a, const float *b, int n)
+{
+  __m128 acc0 = _mm_setzero_ps ();
+  __m128 acc1 = _mm_setzero_ps ();
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      acc0 = _mm_add_ps (acc0, _mm_mul_ps (_mm_loadu_ps (a + i),
+                                           _mm_loadu_ps (b + i)));
+      acc1 = _mm_add_ps (acc1, _mm_mul_ps (_mm_loadu_ps (a + i + 4),
+                                           _mm_loadu_ps (b + i + 4)));
+    }
+  __m128 acc = _mm_add_ps (acc0, acc1);
+  acc = _mm_hadd_ps (acc, acc);
+  acc = _mm_hadd_ps (acc, acc);
+  float sum = _mm_cvtss_f32 (acc);
+  for (; i < n; i++)
+    {
+      sum += a[i] * b[i];
+    }
+  return sum;
+}
+
+SSE_TARGET static void mul_sse4 (const float *a, const float *b, float *out,
+                                 int n)
+{
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      _mm_storeu_ps (out + i, _mm_mul_ps (_mm_loadu_ps (a + i),
+                                          _mm_loadu_ps (b + i)));
+    }
+  mul_scalar (a + i, b + i, out + i, n - i);
+}
+
+SSE_TARGET static void add_sse4 (float *a, const float *b, int n)
+{
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      _mm_storeu_ps (a + i, _mm_add_ps (_mm_loadu_ps (a + i),
+                                        _mm_loadu_ps (b + i)));
+    }
+  add_scalar (a + i, b + i, n - i);
+}
+
+SSE_TARGET static void scale_sse4 (const float *a, float c, float *out, int n)
+{
+  __m128 vc = _mm_set1_ps (c);
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      _mm_storeu_ps (out + i, _mm_mul_ps (_mm_loadu_ps (a + i), vc));
+    }
+  scale_scalar (a + i, c, out + i, n - i);
+}
+
+SSE_TARGET static void relu_sse4 (const float *a, float *out, int n)
+{
+  __m128 zero = _mm_setzero_ps ();
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      _mm_storeu_ps (out + i, _mm_max_ps (_mm_loadu_ps (a + i), zero));
+    }
+  relu_scalar (a + i, out + i, n - i);
+}
+
+SSE_TARGET static void axpy_sse4 (float c, const float *a, float *out, int n)
+{
+  __m128 vc = _mm_set1_ps (c);
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      _mm_storeu_ps (out + i, _mm_add_ps (_mm_loadu_ps (out + i),
+                                          _mm_mul_ps (_mm_loadu_ps (a + i),
+                                                      vc)));
+    }
+  axpy_scalar (c, a + i, out + i, n - i);
+}
+
+SSE_TARGET static float dot_blocks_sse4 (const float *a,
+                                         const int32_t *index, int count,
+                                         const float *x)
+{
+  __m128 lo = _mm_setzero_ps ();
+  __m128 hi = _mm_setzero_ps ();
+  for (int e = 0; e < count; e++)
+    {
+      const float *xe = x + index[e];
+      lo = _mm_add_ps (lo, _mm_mul_ps (_mm_loadu_ps (a + 8 * e),
+                                       _mm_loadu_ps (xe)));
+      hi = _mm_add_ps (hi, _mm_mul_ps (_mm_loadu_ps (a + 8 * e + 4),
+                                       _mm_loadu_ps (xe + 4)));
+    }
+  float lanes[4];
+  _mm_storeu_ps (lanes, _mm_add_ps (lo, hi));
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
+
+SSE_TARGET static float dot_gather_sse4 (const float *a,
+                                         const int32_t *index, int n,
+                                         const float *x)
+{
+  __m128 acc = _mm_setzero_ps ();
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      __m128 xi = _mm_setr_ps (x[index[i]], x[index[i + 1]],
+                               x[index[i + 2]], x[index[i + 3]]);
+      acc = _mm_add_ps (acc, _mm_mul_ps (_mm_loadu_ps (a + i), xi));
+    }
+  float lanes[4];
+  _mm_storeu_ps (lanes, acc);
+  return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3])
+         + dot_gather_scalar (a + i, index + i, n - i, x);
+}
+
+SSE_TARGET static void tile4x4_sse4 (const float *a, int lda, float *out,
+                                     int ldo)
+{
+  __m128 r0 = _mm_loadu_ps (a);
+  __m128 r1 = _mm_loadu_ps (a + lda);
+  __m128 r2 = _mm_loadu_ps (a + 2 * lda);
+  __m128 r3 = _mm_loadu_ps (a + 3 * lda);
+  _MM_TRANSPOSE4_PS (r0, r1, r2, r3);
+  _mm_storeu_ps (out, r0);
+  _mm_storeu_ps (out + ldo, r1);
+  _mm_storeu_ps (out + 2 * ldo, r2);
+  _mm_storeu_ps (out + 3 * ldo, r3);
+}
+
+static void transpose_sse4 (const float *a, int lda, float *out, int ldo,
+                            int rows, int cols)
+{
+  transpose_blocked<4, tile4x4_sse4> (a, lda, out, ldo, rows, cols);
+}
+
+SSE_TARGET static int dot_u8s8_sse4 (const unsigned char *a,
+                                     const signed char *b, int n)
+{
+  __m128i ones = _mm_set1_epi16 (1);
+  __m128i acc = _mm_setzero_si128 ();
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    {
+      // u8 * s8 pairs summed to s16, then pairs of s16 summed to s32.
+      __m128i pairs = _mm_maddubs_epi16 (
+          _mm_loadu_si128 ((const __m128i *) (a + i)),
+          _mm_loadu_si128 ((const __m128i *) (b + i)));
+      acc = _mm_add_epi32 (acc, _mm_madd_epi16 (pairs, ones));
+    }
+  acc = _mm_hadd_epi32 (acc, acc);
+  acc = _mm_hadd_epi32 (acc, acc);
+  return _mm_cvtsi128_si32 (acc) + dot_u8s8_scalar (a + i, b + i, n - i);
+}
+
+SSE_TARGET static void exp_sse4 (const float *a, float *out, int n)
+{
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      __m128 x = _mm_min_ps (_mm_max_ps (_mm_loadu_ps (a + i),
+                                         _mm_set1_ps (EXP_MIN)),
+                             _mm_set1_ps (EXP_MAX));
+      __m128 k = _mm_round_ps (_mm_mul_ps (x, _mm_set1_ps (EXP_LOG2E)),
+                               _MM_FROUND_TO_NEAREST_INT
+                               | _MM_FROUND_NO_EXC);
+      __m128 r = _mm_sub_ps (x, _mm_mul_ps (k, _mm_set1_ps (EXP_LN2_HI)));
+      r = _mm_sub_ps (r, _mm_mul_ps (k, _mm_set1_ps (EXP_LN2_LO)));
+      __m128 p = _mm_set1_ps (EXP_P0);
+      p = _mm_add_ps (_mm_mul_ps (p, r), _mm_set1_ps (EXP_P1));
+      p = _mm_add_ps (_mm_mul_ps (p, r), _mm_set1_ps (EXP_P2));
+      p = _mm_add_ps (_mm_mul_ps (p, r), _mm_set1_ps (EXP_P3));
+      p = _mm_add_ps (_mm_mul_ps (p, r), _mm_set1_ps (EXP_P4));
+      p = _mm_add_ps (_mm_mul_ps (p, r), _mm_set1_ps (EXP_P5));
+      __m128 y = _mm_add_ps (_mm_mul_ps (_mm_mul_ps (p, r), r),
+                             _mm_add_ps (r, _mm_set1_ps (1)));
+      __m128i bits = _mm_slli_epi32 (_mm_add_epi32 (_mm_cvtps_epi32 (k),
+                                                    _mm_set1_epi32 (127)),
+                                     23);
+      _mm_storeu_ps (out + i, _mm_mul_ps (y, _mm_castsi128_ps (bits)));
+    }
+  exp_poly_scalar (a + i, out + i, n - i);
+}
+
+/**
+ * Widens 4 bf16 values to fp32: zero extend, then shift into the high half.
+ */
+SSE_TARGET static __m128 load_bf16_sse4 (const uint16_t *a)
+{
+  __m128i h = _mm_cvtepu16_epi32 (_mm_loadl_epi64 ((const __m128i *) a));
+  return _mm_castsi128_ps (_mm_slli_epi32 (h, 16));
+}
+
+SSE_TARGET static float dot_bf16_sse4 (const uint16_t *a, const float *b,
+                                       int n)
+{
+  __m128 acc = _mm_setzero_ps ();
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      acc = _mm_add_ps (acc, _mm_mul_ps (load_bf16_sse4 (a + i),
+                                         _mm_loadu_ps (b + i)));
+    }
+  acc = _mm_hadd_ps (acc, acc);
+  acc = _mm_hadd_ps (acc, acc);
+  return _mm_cvtss_f32 (acc) + dot_bf16_scalar (a + i, b + i, n - i);
+}
+
+SSE_TARGET static void bf16_to_fp32_sse4 (const uint16_t *a, float *out,
+                                          int n)
+{
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      _mm_storeu_ps (out + i, load_bf16_sse4 (a + i));
+    }
+  bf16_to_fp32_scalar (a + i, out + i, n - i);
+}
+
+SSE_TARGET static void u8_to_fp32_sse4 (const unsigned char *a, float scale,
+                                        float offset, float *out, int n)
+{
+  __m128 s = _mm_set1_ps (scale);
+  __m128 o = _mm_set1_ps (offset);
+  int i = 0;
+  for (; i + 4 <= n; i += 4)
+    {
+      int32_t bytes;
+      std::memcpy (&bytes, a + i, sizeof (bytes));
+      __m128 v = _mm_cvtepi32_ps (_mm_cvtepu8_epi32 (
+          _mm_cvtsi32_si128 (bytes)));
+      _mm_storeu_ps (out + i, _mm_add_ps (_mm_mul_ps (v, s), o));
+    }
+  u8_to_fp32_scalar (a + i, scale, offset, out + i, n - i);
+}
+
+static const SimdKernels sse4_kernels = {"sse4", dot_sse4, mul_sse4,
+                                         add_sse4, scale_sse4, relu_sse4,
+                                         dot_u8s8_sse4, exp_sse4, axpy_sse4,
+                                         transpose_sse4, dot_blocks_sse4,
+                                         dot_gather_sse4, dot_fp16_scalar,
+                                         dot_bf16_sse4, fp16_to_fp32_scalar,
+                                         bf16_to_fp32_sse4,
+                                         fp32_to_fp16_scalar,
+                                         fp32_to_bf16_scalar,
+                                         u8_to_fp32_sse4};
+
+// ------------------------------------------------------------------ avx2 --
+
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+
+AVX2_TARGET static float dot_avx2 (const float *a, const float *b, int n)
+{
+  __m256 acc0 = _mm256_setzero_ps ();
+  __m256 acc1 = _mm256_setzero_ps ();
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    {
+      acc0 = _mm256_fmadd_ps (_mm256_loadu_ps (a + i),
+                              _mm256_loadu_ps (b + i), acc0);
+      acc1 = _mm256_fmadd_ps (_mm256_loadu_ps (a + i + 8),
+                              _mm256_loadu_ps (b + i + 8), acc1);
+    }
+  for (; i + 8 <= n; i += 8)
+    {
+      acc0 = _mm256_fmadd_ps (_mm256_loadu_ps (a + i),
+                              _mm256_loadu_ps (b + i), acc0);
+    }
+  __m256 acc = _mm256_add_ps (acc0, acc1);
+  __m128 half = _mm_add_ps (_mm256_castps256_ps128 (acc),
+                            _mm256_extractf128_ps (acc, 1));
+  half = _mm_hadd_ps (half, half);
+  half = _mm_hadd_ps (half, half);
+  float sum = _mm_cvtss_f32 (half);
+  for (; i < n; i++)
+    {
+      sum += a[i] * b[i];
+    }
+  return sum;
+}
+
+AVX2_TARGET static void mul_avx2 (const float *a, const float *b, float *out,
+                                  int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      _mm256_storeu_ps (out + i, _mm256_mul_ps (_mm256_loadu_ps (a + i),
+                                                _mm256_loadu_ps (b + i)));
+    }
+  mul_scalar (a + i, b + i, out + i, n - i);
+}
+
+AVX2_TARGET static void add_avx2 (float *a, const float *b, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      _mm256_storeu_ps (a + i, _mm256_add_ps (_mm256_loadu_ps (a + i),
+                                              _mm256_loadu_ps (b + i)));
+    }
+  add_scalar (a + i, b + i, n - i);
+}
+
+AVX2_TARGET static void scale_avx2 (const float *a, float c, float *out, int n)
+{
+  __m256 vc = _mm256_set1_ps (c);
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      _mm256_storeu_ps (out + i, _mm256_mul_ps (_mm256_loadu_ps (a + i), vc));
+    }
+  scale_scalar (a + i, c, out + i, n - i);
+}
+
+AVX2_TARGET static void relu_avx2 (const float *a, float *out, int n)
+{
+  __m256 zero = _mm256_setzero_ps ();
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      _mm256_storeu_ps (out + i, _mm256_max_ps (_mm256_loadu_ps (a + i),
+                                                zero));
+    }
+  relu_scalar (a + i, out + i, n - i);
+}
+
+AVX2_TARGET static void axpy_avx2 (float c, const float *a, float *out, int n)
+{
+  __m256 vc = _mm256_set1_ps (c);
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      _mm256_storeu_ps (out + i, _mm256_fmadd_ps (_mm256_loadu_ps (a + i), vc,
+                                                  _mm256_loadu_ps (out + i)));
+    }
+  axpy_scalar (c, a + i, out + i, n - i);
+}
+
+/**
+ * One block per fma, alternating two accumulators so consecutive blocks
+ * do not wait on each other.
+ */
+AVX2_TARGET static float dot_blocks_avx2 (const float *a,
+                                          const int32_t *index, int count,
+                                          const float *x)
+{
+  __m256 acc0 = _mm256_setzero_ps ();
+  __m256 acc1 = _mm256_setzero_ps ();
+  int e = 0;
+  for (; e + 2 <= count; e += 2)
+    {
+      acc0 = _mm256_fmadd_ps (_mm256_loadu_ps (a + 8 * e),
+                              _mm256_loadu_ps (x + index[e]), acc0);
+      acc1 = _mm256_fmadd_ps (_mm256_loadu_ps (a + 8 * e + 8),
+                              _mm256_loadu_ps (x + index[e + 1]), acc1);
+    }
+  if (e < count)
+    {
+      acc0 = _mm256_fmadd_ps (_mm256_loadu_ps (a + 8 * e),
+                              _mm256_loadu_ps (x + index[e]), acc0);
+    }
+  __m256 acc = _mm256_add_ps (acc0, acc1);
+  __m128 half = _mm_add_ps (_mm256_castps256_ps128 (acc),
+                            _mm256_extractf128_ps (acc, 1));
+  half = _mm_hadd_ps (half, half);
+  half = _mm_hadd_ps (half, half);
+  return _mm_cvtss_f32 (half);
+}
+
+AVX2_TARGET static float dot_gather_avx2 (const float *a,
+                                          const int32_t *index, int n,
+                                          const float *x)
+{
+  __m256 acc = _mm256_setzero_ps ();
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      __m256i columns = _mm256_loadu_si256 ((const __m256i *) (index + i));
+      acc = _mm256_fmadd_ps (_mm256_loadu_ps (a + i),
+                             _mm256_i32gather_ps (x, columns, 4), acc);
+    }
+  __m128 half = _mm_add_ps (_mm256_castps256_ps128 (acc),
+                            _mm256_extractf128_ps (acc, 1));
+  half = _mm_hadd_ps (half, half);
+  half = _mm_hadd_ps (half, half);
+  return _mm_cvtss_f32 (half) + dot_gather_scalar (a + i, index + i, n - i,
+                                                   x);
+}
+
+/**
+ * 8x8 transpose in registers: unpacks interleave row pairs, shuffles
+ * gather 4 element columns within each 128 bit lane, and the lane
+ * permutes join the halves.
+ */
+AVX2_TARGET static void tile8x8_avx2 (const float *a, int lda, float *out,
+                                      int ldo)
+{
+  __m256 r[8];
+  for (int i = 0; i < 8; i++)
+    {
+      r[i] = _mm256_loadu_ps (a + i * lda);
+    }
+  __m256 t[8];
+  for (int i = 0; i < 8; i += 2)
+    {
+      t[i] = _mm256_unpacklo_ps (r[i], r[i + 1]);
+      t[i + 1] = _mm256_unpackhi_ps (r[i], r[i + 1]);
+    }
+  __m256 q[8];
+  for (int i = 0; i < 8; i += 4)
+    {
+      q[i] = _mm256_shuffle_ps (t[i], t[i + 2], _MM_SHUFFLE (1, 0, 1, 0));
+      q[i + 1] = _mm256_shuffle_ps (t[i], t[i + 2], _MM_SHUFFLE (3, 2, 3, 2));
+      q[i + 2] = _mm256_shuffle_ps (t[i + 1], t[i + 3],
+                                    _MM_SHUFFLE (1, 0, 1, 0));
+      q[i + 3] = _mm256_shuffle_ps (t[i + 1], t[i + 3],
+                                    _MM_SHUFFLE (3, 2, 3, 2));
+    }
+  for (int i = 0; i < 4; i++)
+    {
+      _mm256_storeu_ps (out + i * ldo,
+                        _mm256_permute2f128_ps (q[i], q[i + 4], 0x20));
+      _mm256_storeu_ps (out + (i + 4) * ldo,
+                        _mm256_permute2f128_ps (q[i], q[i + 4], 0x31));
+    }
+}
+
+static void transpose_avx2 (const float *a, int lda, float *out, int ldo,
+                            int rows, int cols)
+{
+  transpose_blocked<8, tile8x8_avx2> (a, lda, out, ldo, rows, cols);
+}
+
+/**
+ * Sums the eight 32 bit lanes of v.
+ */
+AVX2_TARGET static int hsum_epi32_avx2 (__m256i v)
+{
+  __m128i half = _mm_add_epi32 (_mm256_castsi256_si128 (v),
+                                _mm256_extracti128_si256 (v, 1));
+  half = _mm_hadd_epi32 (half, half);
+  half = _mm_hadd_epi32 (half, half);
+  return _mm_cvtsi128_si32 (half);
+}
+
+AVX2_TARGET static int dot_u8s8_avx2 (const unsigned char *a,
+                                      const signed char *b, int n)
+{
+  __m256i ones = _mm256_set1_epi16 (1);
+  __m256i acc = _mm256_setzero_si256 ();
+  int i = 0;
+  for (; i + 32 <= n; i += 32)
+    {
+      // u8 * s8 pairs summed to s16, then pairs of s16 summed to s32.
+      __m256i pairs = _mm256_maddubs_epi16 (
+          _mm256_loadu_si256 ((const __m256i *) (a + i)),
+          _mm256_loadu_si256 ((const __m256i *) (b + i)));
+      acc = _mm256_add_epi32 (acc, _mm256_madd_epi16 (pairs, ones));
+    }
+  return hsum_epi32_avx2 (acc) + dot_u8s8_scalar (a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,avxvnni")))
+static int dot_u8s8_avxvnni (const unsigned char *a, const signed char *b,
+                             int n)
+{
+  __m256i acc = _mm256_setzero_si256 ();
+  int i = 0;
+  for (; i + 32 <= n; i += 32)
+    {
+      acc = _mm256_dpbusd_avx_epi32 (
+          acc, _mm256_loadu_si256 ((const __m256i *) (a + i)),
+          _mm256_loadu_si256 ((const __m256i *) (b + i)));
+    }
+  return hsum_epi32_avx2 (acc) + dot_u8s8_scalar (a + i, b + i, n - i);
+}
+
+AVX2_TARGET static void exp_avx2 (const float *a, float *out, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      __m256 x = _mm256_min_ps (_mm256_max_ps (_mm256_loadu_ps (a + i),
+                                               _mm256_set1_ps (EXP_MIN)),
+                                _mm256_set1_ps (EXP_MAX));
+      __m256 k = _mm256_round_ps (_mm256_mul_ps (x,
+                                                 _mm256_set1_ps (EXP_LOG2E)),
+                                  _MM_FROUND_TO_NEAREST_INT
+                                  | _MM_FROUND_NO_EXC);
+      __m256 r = _mm256_fnmadd_ps (k, _mm256_set1_ps (EXP_LN2_HI), x);
+      r = _mm256_fnmadd_ps (k, _mm256_set1_ps (EXP_LN2_LO), r);
+      __m256 p = _mm256_set1_ps (EXP_P0);
+      p = _mm256_fmadd_ps (p, r, _mm256_set1_ps (EXP_P1));
+      p = _mm256_fmadd_ps (p, r, _mm256_set1_ps (EXP_P2));
+      p = _mm256_fmadd_ps (p, r, _mm256_set1_ps (EXP_P3));
+      p = _mm256_fmadd_ps (p, r, _mm256_set1_ps (EXP_P4));
+      p = _mm256_fmadd_ps (p, r, _mm256_set1_ps (EXP_P5));
+      __m256 y = _mm256_fmadd_ps (_mm256_mul_ps (p, r), r,
+                                  _mm256_add_ps (r, _mm256_set1_ps (1)));
+      __m256i bits = _mm256_slli_epi32 (
+          _mm256_add_epi32 (_mm256_cvtps_epi32 (k), _mm256_set1_epi32 (127)),
+          23);
+      _mm256_storeu_ps (out + i, _mm256_mul_ps (y,
+                                                _mm256_castsi256_ps (bits)));
+    }
+  exp_poly_scalar (a + i, out + i, n - i);
+}
+
+/**
+ * Widens 8 bf16 values to fp32.
+ */
+AVX2_TARGET static __m256 load_bf16_avx2 (const uint16_t *a)
+{
+  __m256i h = _mm256_cvtepu16_epi32 (_mm_loadu_si128 ((const __m128i *) a));
+  return _mm256_castsi256_ps (_mm256_slli_epi32 (h, 16));
+}
+
+AVX2_TARGET static float hsum_avx2 (__m256 v)
+{
+  __m128 half = _mm_add_ps (_mm256_castps256_ps128 (v),
+                            _mm256_extractf128_ps (v, 1));
+  half = _mm_hadd_ps (half, half);
+  half = _mm_hadd_ps (half, half);
+  return _mm_cvtss_f32 (half);
+}
+
+AVX2_TARGET static float dot_bf16_avx2 (const uint16_t *a, const float *b,
+                                        int n)
+{
+  __m256 acc0 = _mm256_setzero_ps ();
+  __m256 acc1 = _mm256_setzero_ps ();
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    {
+      acc0 = _mm256_fmadd_ps (load_bf16_avx2 (a + i), _mm256_loadu_ps (b + i),
+                              acc0);
+      acc1 = _mm256_fmadd_ps (load_bf16_avx2 (a + i + 8),
+                              _mm256_loadu_ps (b + i + 8), acc1);
+    }
+  for (; i + 8 <= n; i += 8)
+    {
+      acc0 = _mm256_fmadd_ps (load_bf16_avx2 (a + i), _mm256_loadu_ps (b + i),
+                              acc0);
+    }
+  return hsum_avx2 (_mm256_add_ps (acc0, acc1))
+         + dot_bf16_scalar (a + i, b + i, n - i);
+}
+
+AVX2_TARGET static void bf16_to_fp32_avx2 (const uint16_t *a, float *out,
+                                           int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      _mm256_storeu_ps (out + i, load_bf16_avx2 (a + i));
+    }
+  bf16_to_fp32_scalar (a + i, out + i, n - i);
+}
+
+/**
+ * Rounds 8 floats to bf16, to nearest even, nans kept quiet.
+ */
+AVX2_TARGET static void fp32_to_bf16_avx2 (const float *a, uint16_t *out,
+                                           int n)
+{
+  const __m256i bias = _mm256_set1_epi32 (0x7fff);
+  const __m256i one = _mm256_set1_epi32 (1);
+  const __m256i quiet = _mm256_set1_epi32 (0x400000);
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      __m256 v = _mm256_loadu_ps (a + i);
+      __m256i bits = _mm256_castps_si256 (v);
+      __m256i lsb = _mm256_and_si256 (_mm256_srli_epi32 (bits, 16), one);
+      __m256i rounded = _mm256_add_epi32 (bits, _mm256_add_epi32 (bias, lsb));
+      __m256i nan = _mm256_castps_si256 (_mm256_cmp_ps (v, v, _CMP_UNORD_Q));
+      rounded = _mm256_blendv_epi8 (rounded, _mm256_or_si256 (bits, quiet),
+                                    nan);
+      rounded = _mm256_srli_epi32 (rounded, 16);
+      // pack the 32 bit lanes to 16 bits, then undo the lane interleave.
+      __m256i packed = _mm256_packus_epi32 (rounded, rounded);
+      packed = _mm256_permute4x64_epi64 (packed, _MM_SHUFFLE (3, 1, 2, 0));
+      _mm_storeu_si128 ((__m128i *) (out + i),
+                        _mm256_castsi256_si128 (packed));
+    }
+  fp32_to_bf16_scalar (a + i, out + i, n - i);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static float dot_fp16_f16c (const uint16_t *a, const float *b, int n)
+{
+  __m256 acc0 = _mm256_setzero_ps ();
+  __m256 acc1 = _mm256_setzero_ps ();
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    {
+      acc0 = _mm256_fmadd_ps (
+          _mm256_cvtph_ps (_mm_loadu_si128 ((const __m128i *) (a + i))),
+          _mm256_loadu_ps (b + i), acc0);
+      acc1 = _mm256_fmadd_ps (
+          _mm256_cvtph_ps (_mm_loadu_si128 ((const __m128i *) (a + i + 8))),
+          _mm256_loadu_ps (b + i + 8), acc1);
+    }
+  for (; i + 8 <= n; i += 8)
+    {
+      acc0 = _mm256_fmadd_ps (
+          _mm256_cvtph_ps (_mm_loadu_si128 ((const __m128i *) (a + i))),
+          _mm256_loadu_ps (b + i), acc0);
+    }
+  return hsum_avx2 (_mm256_add_ps (acc0, acc1))
+         + dot_fp16_scalar (a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void fp16_to_fp32_f16c (const uint16_t *a, float *out, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      _mm256_storeu_ps (out + i, _mm256_cvtph_ps (
+          _mm_loadu_si128 ((const __m128i *) (a + i))));
+    }
+  fp16_to_fp32_scalar (a + i, out + i, n - i);
+}
+
+__attribute__((target("avx2,fma,f16c")))
+static void fp32_to_fp16_f16c (const float *a, uint16_t *out, int n)
+{
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      _mm_storeu_si128 ((__m128i *) (out + i),
+                        _mm256_cvtps_ph (_mm256_loadu_ps (a + i),
+                                         _MM_FROUND_TO_NEAREST_INT));
+    }
+  fp32_to_fp16_scalar (a + i, out + i, n - i);
+}
+
+AVX2_TARGET static void u8_to_fp32_avx2 (const unsigned char *a, float scale,
+                                         float offset, float *out, int n)
+{
+  __m256 s = _mm256_set1_ps (scale);
+  __m256 o = _mm256_set1_ps (offset);
+  int i = 0;
+  for (; i + 8 <= n; i += 8)
+    {
+      __m256 v = _mm256_cvtepi32_ps (_mm256_cvtepu8_epi32 (
+          _mm_loadl_epi64 ((const __m128i *) (a + i))));
+      _mm256_storeu_ps (out + i, _mm256_fmadd_ps (v, s, o));
+    }
+  u8_to_fp32_scalar (a + i, scale, offset, out + i, n - i);
+}
+
+static const SimdKernels avx2_kernels = {"avx2", dot_avx2, mul_avx2,
+                                         add_avx2, scale_avx2, relu_avx2,
+                                         dot_u8s8_avx2, exp_avx2, axpy_avx2,
+                                         transpose_avx2, dot_blocks_avx2,
+                                         dot_gather_avx2, dot_fp16_scalar,
+                                         dot_bf16_avx2, fp16_to_fp32_scalar,
+                                         bf16_to_fp32_avx2,
+                                         fp32_to_fp16_scalar,
+                                         fp32_to_bf16_avx2, u8_to_fp32_avx2};
+
+// ---------------------------------------------------------------- avx512 --
+
+#define AVX512_TARGET __attribute__((target("avx512f")))
+
+// GCC 12's _mm512_reduce_add_* start from _mm512_undefined_*, which
+// optimized builds flag as uninitialized: a false positive in the header.
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wuninitialized"
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+// mask of the first n (< 16) lanes, used for the tails.
+#define TAIL_MASK(n) ((__mmask16) ((1u << (n)) - 1))
+
+AVX512_TARGET static float dot_avx512 (const float *a, const float *b, int n)
+{
+  __m512 acc0 = _mm512_setzero_ps ();
+  __m512 acc1 = _mm512_setzero_ps ();
+  int i = 0;
+  for (; i + 32 <= n; i += 32)
+    {
+      acc0 = _mm512_fmadd_ps (_mm512_loadu_ps (a + i),
+                              _mm512_loadu_ps (b + i), acc0);
+      acc1 = _mm512_fmadd_ps (_mm512_loadu_ps (a + i + 16),
+                              _mm512_loadu_ps (b + i + 16), acc1);
+    }
+  for (; i + 16 <= n; i += 16)
+    {
+      acc0 = _mm512_fmadd_ps (_mm512_loadu_ps (a + i),
+                              _mm512_loadu_ps (b + i), acc0);
+    }
+  if (i < n)
+    {
+      __mmask16 mask = TAIL_MASK (n - i);
+      acc1 = _mm512_fmadd_ps (_mm512_maskz_loadu_ps (mask, a + i),
+                              _mm512_maskz_loadu_ps (mask, b + i), acc1);
+    }
+  return _mm512_reduce_add_ps (_mm512_add_ps (acc0, acc1));
+}
+
+AVX512_TARGET static void mul_avx512 (const float *a, const float *b,
+                                      float *out, int n)
+{
+  for (int i = 0; i < n; i += 16)
+    {
+      __mmask16 mask = n - i >= 16 ? (__mmask16) 0xffff : TAIL_MASK (n - i);
+      _mm512_mask_storeu_ps (out + i, mask, _mm512_mul_ps (
+          _mm512_maskz_loadu_ps (mask, a + i),
+          _mm512_maskz_loadu_ps (mask, b + i)));
+    }
+}
+
+AVX512_TARGET static void add_avx512 (float *a, const float *b, int n)
+{
+  for (int i = 0; i < n; i += 16)
+    {
+      __mmask16 mask = n - i >= 16 ? (__mmask16) 0xffff : TAIL_MASK (n - i);
+      _mm512_mask_storeu_ps (a + i, mask, _mm512_add_ps (
+          _mm512_maskz_loadu_ps (mask, a + i),
+          _mm512_maskz_loadu_ps (mask, b + i)));
+    }
+}
+
+AVX512_TARGET static void scale_avx512 (const float *a, float c, float *out,
+                                        int n)
+{
+  __m512 vc = _mm512_set1_ps (c);
+  for (int i = 0; i < n; i += 16)
+    {
+      __mmask16 mask = n - i >= 16 ? (__mmask16) 0xffff : TAIL_MASK (n - i);
+      _mm512_mask_storeu_ps (out + i, mask, _mm512_mul_ps (
+          _mm512_maskz_loadu_ps (mask, a + i), vc));
+    }
+}
+
+AVX512_TARGET static void relu_avx512 (const float *a, float *out, int n)
+{
+  __m512 zero = _mm512_setzero_ps ();
+  for (int i = 0; i < n; i += 16)
+    {
+      __mmask16 mask = n - i >= 16 ? (__mmask16) 0xffff : TAIL_MASK (n - i);
+      _mm512_mask_storeu_ps (out + i, mask, _mm512_max_ps (
+          _mm512_maskz_loadu_ps (mask, a + i), zero));
+    }
+}
+
+AVX512_TARGET static void axpy_avx512 (float c, const float *a, float *out,
+                                       int n)
+{
+  __m512 vc = _mm512_set1_ps (c);
+  for (int i = 0; i < n; i += 16)
+    {
+      __mmask16 mask = n - i >= 16 ? (__mmask16) 0xffff : TAIL_MASK (n - i);
+      _mm512_mask_storeu_ps (out + i, mask, _mm512_fmadd_ps (
+          _mm512_maskz_loadu_ps (mask, a + i), vc,
+          _mm512_maskz_loadu_ps (mask, out + i)));
+    }
+}
+
+AVX512_TARGET static float dot_gather_avx512 (const float *a,
+                                              const int32_t *index, int n,
+                                              const float *x)
+{
+  __m512 acc = _mm512_setzero_ps ();
+  for (int i = 0; i < n; i += 16)
+    {
+      __mmask16 mask = n - i >= 16 ? (__mmask16) 0xffff : TAIL_MASK (n - i);
+      __m512i columns = _mm512_maskz_loadu_epi32 (mask, index + i);
+      acc = _mm512_fmadd_ps (_mm512_maskz_loadu_ps (mask, a + i),
+                             _mm512_mask_i32gather_ps (_mm512_setzero_ps (),
+                                                       mask, columns, x, 4),
+                             acc);
+    }
+  return _mm512_reduce_add_ps (acc);
+}
+
+AVX512_TARGET __attribute__((target("avx512bw")))
+static int dot_u8s8_avx512 (const unsigned char *a, const signed char *b,
+                            int n)
+{
+  __m512i ones = _mm512_set1_epi16 (1);
+  __m512i acc = _mm512_setzero_si512 ();
+  int i = 0;
+  for (; i + 64 <= n; i += 64)
+    {
+      __m512i pairs = _mm512_maddubs_epi16 (_mm512_loadu_si512 (a + i),
+                                            _mm512_loadu_si512 (b + i));
+      acc = _mm512_add_epi32 (acc, _mm512_madd_epi16 (pairs, ones));
+    }
+  return _mm512_reduce_add_epi32 (acc)
+         + dot_u8s8_scalar (a + i, b + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512vnni")))
+static int dot_u8s8_avx512vnni (const unsigned char *a, const signed char *b,
+                                int n)
+{
+  __m512i acc = _mm512_setzero_si512 ();
+  int i = 0;
+  for (; i + 64 <= n; i += 64)
+    {
+      acc = _mm512_dpbusd_epi32 (acc, _mm512_loadu_si512 (a + i),
+                                 _mm512_loadu_si512 (b + i));
+    }
+  return _mm512_reduce_add_epi32 (acc)
+         + dot_u8s8_scalar (a + i, b + i, n - i);
+}
+
+AVX512_TARGET static void exp_avx512 (const float *a, float *out, int n)
+{
+  for (int i = 0; i < n; i += 16)
+    {
+      __mmask16 mask = n - i >= 16 ? (__mmask16) 0xffff : TAIL_MASK (n - i);
+      __m512 x = _mm512_min_ps (_mm512_max_ps (_mm512_maskz_loadu_ps (mask,
+                                                                      a + i),
+                                               _mm512_set1_ps (EXP_MIN)),
+                                _mm512_set1_ps (EXP_MAX));
+      __m512 k = _mm512_roundscale_ps (_mm512_mul_ps (
+          x, _mm512_set1_ps (EXP_LOG2E)), _MM_FROUND_TO_NEAREST_INT);
+      __m512 r = _mm512_fnmadd_ps (k, _mm512_set1_ps (EXP_LN2_HI), x);
+      r = _mm512_fnmadd_ps (k, _mm512_set1_ps (EXP_LN2_LO), r);
+      __m512 p = _mm512_set1_ps (EXP_P0);
+      p = _mm512_fmadd_ps (p, r, _mm512_set1_ps (EXP_P1));
+      p = _mm512_fmadd_ps (p, r, _mm512_set1_ps (EXP_P2));
+      p = _mm512_fmadd_ps (p, r, _mm512_set1_ps (EXP_P3));
+      p = _mm512_fmadd_ps (p, r, _mm512_set1_ps (EXP_P4));
+      p = _mm512_fmadd_ps (p, r, _mm512_set1_ps (EXP_P5));
+      __m512 y = _mm512_fmadd_ps (_mm512_mul_ps (p, r), r,
+                                  _mm512_add_ps (r, _mm512_set1_ps (1)));
+      // y * 2^k, without building the exponent bits.
+      _mm512_mask_storeu_ps (out + i, mask, _mm512_scalef_ps (y, k));
+    }
+}
+
+/**
+ * Widens 16 bf16 values to fp32. Plain avx512f has no 16 bit masked loads,
+ * so the half kernels below leave their tails to the scalar ones.
+ */
+AVX512_TARGET static __m512 load_bf16_avx512 (const uint16_t *a)
+{
+  __m512i h = _mm512_cvtepu16_epi32 (_mm256_loadu_si256 ((const __m256i *) a));
+  return _mm512_castsi512_ps (_mm512_slli_epi32 (h, 16));
+}
+
+AVX512_TARGET static __m512 load_fp16_avx512 (const uint16_t *a)
+{
+  return _mm512_cvtph_ps (_mm256_loadu_si256 ((const __m256i *) a));
+}
+
+AVX512_TARGET static float dot_bf16_avx512 (const uint16_t *a,
+                                            const float *b, int n)
+{
+  __m512 acc0 = _mm512_setzero_ps ();
+  __m512 acc1 = _mm512_setzero_ps ();
+  int i = 0;
+  for (; i + 32 <= n; i += 32)
+    {
+      acc0 = _mm512_fmadd_ps (load_bf16_avx512 (a + i),
+                              _mm512_loadu_ps (b + i), acc0);
+      acc1 = _mm512_fmadd_ps (load_bf16_avx512 (a + i + 16),
+                              _mm512_loadu_ps (b + i + 16), acc1);
+    }
+  for (; i + 16 <= n; i += 16)
+    {
+      acc0 = _mm512_fmadd_ps (load_bf16_avx512 (a + i),
+                              _mm512_loadu_ps (b + i), acc0);
+    }
+  return _mm512_reduce_add_ps (_mm512_add_ps (acc0, acc1))
+         + dot_bf16_scalar (a + i, b + i, n - i);
+}
+
+AVX512_TARGET static float dot_fp16_avx512 (const uint16_t *a,
+                                            const float *b, int n)
+{
+  __m512 acc0 = _mm512_setzero_ps ();
+  __m512 acc1 = _mm512_setzero_ps ();
+  int i = 0;
+  for (; i + 32 <= n; i += 32)
+    {
+      acc0 = _mm512_fmadd_ps (load_fp16_avx512 (a + i),
+                              _mm512_loadu_ps (b + i), acc0);
+      acc1 = _mm512_fmadd_ps (load_fp16_avx512 (a + i + 16),
+                              _mm512_loadu_ps (b + i + 16), acc1);
+    }
+  for (; i + 16 <= n; i += 16)
+    {
+      acc0 = _mm512_fmadd_ps (load_fp16_avx512 (a + i),
+                              _mm512_loadu_ps (b + i), acc0);
+    }
+  return _mm512_reduce_add_ps (_mm512_add_ps (acc0, acc1))
+         + dot_fp16_scalar (a + i, b + i, n - i);
+}
+
+AVX512_TARGET static void bf16_to_fp32_avx512 (const uint16_t *a, float *out,
+                                               int n)
+{
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    {
+      _mm512_storeu_ps (out + i, load_bf16_avx512 (a + i));
+    }
+  bf16_to_fp32_scalar (a + i, out + i, n - i);
+}
+
+AVX512_TARGET static void fp16_to_fp32_avx512 (const uint16_t *a, float *out,
+                                               int n)
+{
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    {
+      _mm512_storeu_ps (out + i, load_fp16_avx512 (a + i));
+    }
+  fp16_to_fp32_scalar (a + i, out + i, n - i);
+}
+
+AVX512_TARGET static void fp32_to_fp16_avx512 (const float *a, uint16_t *out,
+                                               int n)
+{
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    {
+      _mm256_storeu_si256 ((__m256i *) (out + i),
+                           _mm512_cvtps_ph (_mm512_loadu_ps (a + i),
+                                            _MM_FROUND_TO_NEAREST_INT));
+    }
+  fp32_to_fp16_scalar (a + i, out + i, n - i);
+}
+
+__attribute__((target("avx512f,avx512bf16")))
+static void fp32_to_bf16_avx512bf16 (const float *a, uint16_t *out, int n)
+{
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    {
+      __m256bh rounded = _mm512_cvtneps_pbh (_mm512_loadu_ps (a + i));
+      _mm256_storeu_si256 ((__m256i *) (out + i), (__m256i) rounded);
+    }
+  fp32_to_bf16_scalar (a + i, out + i, n - i);
+}
+
+AVX512_TARGET static void u8_to_fp32_avx512 (const unsigned char *a,
+                                             float scale, float offset,
+                                             float *out, int n)
+{
+  __m512 s = _mm512_set1_ps (scale);
+  __m512 o = _mm512_set1_ps (offset);
+  int i = 0;
+  for (; i + 16 <= n; i += 16)
+    {
+      __m512 v = _mm512_cvtepi32_ps (_mm512_cvtepu8_epi32 (
+          _mm_loadu_si128 ((const __m128i *) (a + i))));
+      _mm512_storeu_ps (out + i, _mm512_fmadd_ps (v, s, o));
+    }
+  u8_to_fp32_scalar (a + i, scale, offset, out + i, n - i);
+}
+
+static const SimdKernels avx512_kernels = {"avx512", dot_avx512, mul_avx512,
+                                           add_avx512, scale_avx512,
+                                           relu_avx512, dot_u8s8_avx512,
+                                           exp_avx512, axpy_avx512,
+                                           transpose_avx2, dot_blocks_avx2,
+                                           dot_gather_avx512, dot_fp16_avx512,
+                                           dot_bf16_avx512,
+                                           fp16_to_fp32_avx512,
+                                           bf16_to_fp32_avx512,
+                                           fp32_to_fp16_avx512,
+                                           fp32_to_bf16_avx2,
+                                           u8_to_fp32_avx512};
+
+#pragma GCC diagnostic pop
+
+#endif // SIMD_X86
+
+/**
+ * Picks the kernels table: the forced one from the environment, or the
+ * widest one the cpu supports.
+ */
+static const SimdKernels &select_kernels ()
+{
+  const SimdKernels *supported[4];
+  int count = 0;
+#ifdef SIMD_X86
+  __builtin_cpu_init ();
+  if (__builtin_cpu_supports ("avx512f")
+      && __builtin_cpu_supports ("avx512bw"))
+    {
+      supported[count++] = &avx512_kernels;
+    }
+  if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("fma"))
+    {
+      supported[count++] = &avx2_kernels;
+    }
+  if (__builtin_cpu_supports ("sse4.1"))
+    {
+      supported[count++] = &sse4_kernels;
+    }
+#endif
+  supported[count++] = &scalar_kernels;
+
+  const SimdKernels *chosen = supported[0];
+  const char *forced = std::getenv (SIMD_ISA_ENV);
+  if (forced != nullptr && forced[0] != '\0')
+    {
+      chosen = nullptr;
+      for (int i = 0; i < count; i++)
+        {
+          if (std::strcmp (forced, supported[i]->name) == 0)
+            {
+              chosen = supported[i];
+            }
+        }
+      if (chosen == nullptr)
+        {
+          std::cerr << SIMD_ISA_ERROR << std::endl;
+          exit (EXIT_FAILURE);
+        }
+    }
+
+  static SimdKernels selected = *chosen;
+#ifdef SIMD_X86
+  // VNNI is an extension of either width, patch it into the chosen table.
+  if (chosen == &avx512_kernels && __builtin_cpu_supports ("avx512vnni"))
+    {
+      selected.dot_u8s8 = dot_u8s8_avx512vnni;
+    }
+  else if (chosen == &avx2_kernels && __builtin_cpu_supports ("avxvnni"))
+    {
+      selected.dot_u8s8 = dot_u8s8_avxvnni;
+    }
+  // so are F16C for avx2 and AVX512-BF16.
+  if (chosen == &avx2_kernels && __builtin_cpu_supports ("f16c"))
+    {
+      selected.dot_fp16 = dot_fp16_f16c;
+      selected.fp16_to_fp32 = fp16_to_fp32_f16c;
+      selected.fp32_to_fp16 = fp32_to_fp16_f16c;
+    }
+  if (chosen == &avx512_kernels && __builtin_cpu_supports ("avx512bf16"))
+    {
+      selected.fp32_to_bf16 = fp32_to_bf16_avx512bf16;
+    }
+#endif
+  const char *fast_exp = std::getenv (FAST_EXP_ENV);
+  if (fast_exp != nullptr && std::strcmp (fast_exp, "0") == 0)
+    {
+      selected.exp = exp_scalar;
+    }
+  return selected;
+}
+
+/**
+ * Returns the kernels of the chosen instruction set, selected on first call.
+ */
+const SimdKernels &simd ()
+{
+  static const SimdKernels &kernels = select_kernels ();
+  return kernels;
+}
@@ -0,0 +1,84 @@
+// Simd.h
+
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <cstdint>
+
+#define SIMD_ISA_ENV "MLP_SIMD_ISA"
+#define SIMD_ISA_ERROR "Error: unknown or unsupported SIMD ISA in " SIMD_ISA_ENV
+#define FAST_EXP_ENV "MLP_FAST_EXP"
+
+/**
+ * @struct SimdKernels
+ * @brief Table of element-wise float kernels compiled for one instruction
+ *        set. n is the number of elements, the arrays may not be aligned.
+ */
+typedef struct SimdKernels
+{
+    const char *name;
+    // returns sum(a[i] * b[i])
+    float (*dot)(const float *a, const float *b, int n);
+    // out[i] = a[i] * b[i]
+    void (*mul)(const float *a, const float *b, float *out, int n);
+    // a[i] += b[i]
+    void (*add)(float *a, const float *b, int n);
+    // out[i] = a[i] * c
+    void (*scale)(const float *a, float c, float *out, int n);
+    // out[i] = max(a[i], 0)
+    void (*relu)(const float *a, float *out, int n);
+    // returns sum(a[i] * b[i]) of unsigned and signed bytes. a[i] must be
+    // at most 127 so pairs of products cannot saturate 16 bit pmaddubsw.
+    int (*dot_u8s8)(const unsigned char *a, const signed char *b, int n);
+    // out[i] = e^a[i], out may be a. The vector tables use a degree 7
+    // polynomial after range reduction: relative error below 2e-7 (about
+    // 2 ulp, 1.2e-7 measured) over [-87, 88]. Inputs are clamped to
+    // [-87.3, 88.3], so results saturate near 1e-38 and 2e38 instead of
+    // reaching 0 or inf.
+    void (*exp)(const float *a, float *out, int n);
+    // out[i] += c * a[i]
+    void (*axpy)(float c, const float *a, float *out, int n);
+    // out = a^T: a is rows x cols with row stride lda, out is cols x rows
+    // with row stride ldo. Cache blocked, with 4x4 (sse4) or 8x8 (avx2,
+    // also used by avx512) tiles transposed in registers.
+    void (*transpose)(const float *a, int lda, float *out, int ldo,
+                      int rows, int cols);
+    // returns sum(a[8 * e + j] * x[index[e] + j]) over e < count, j < 8:
+    // the dot product of count 8 float blocks with the slices of x they
+    // start at, as a block sparse row stores them.
+    float (*dot_blocks)(const float *a, const int32_t *index, int count,
+                        const float *x);
+    // returns sum(a[i] * x[index[i]]), the row of a compressed sparse
+    // matrix times x. The avx2 and avx512 tables use gather loads.
+    float (*dot_gather)(const float *a, const int32_t *index, int n,
+                        const float *x);
+    // returns sum(a[i] * b[i]) for a in IEEE half (fp16) or bfloat16
+    // (bf16) bits: each a[i] is widened to fp32 exactly, products and sums
+    // are fp32.
+    float (*dot_fp16)(const uint16_t *a, const float *b, int n);
+    float (*dot_bf16)(const uint16_t *a, const float *b, int n);
+    // out[i] = a[i] widened to fp32, exact.
+    void (*fp16_to_fp32)(const uint16_t *a, float *out, int n);
+    void (*bf16_to_fp32)(const uint16_t *a, float *out, int n);
+    // out[i] = a[i] rounded to nearest even, overflowing to inf (fp16).
+    // The AVX512-BF16 conversion flushes fp32 subnormals to zero.
+    void (*fp32_to_fp16)(const float *a, uint16_t *out, int n);
+    void (*fp32_to_bf16)(const float *a, uint16_t *out, int n);
+    // out[i] = a[i] * scale + offset, e.g. pixels to [0, 1].
+    void (*u8_to_fp32)(const unsigned char *a, float scale, float offset,
+                       float *out, int n);
+} SimdKernels;
+
+/**
+ * Returns the kernels of the widest instruction set the cpu supports
+ * (avx512, avx2, sse4 or scalar). The choice is made once, on the first
+ * call. Setting the MLP_SIMD_ISA environment variable to one of these
+ * names forces that instruction set instead, exits if the cpu lacks it.
+ * The byte dot product uses VNNI (vpdpbusd) when the cpu has it, the fp16
+ * kernels of the avx2 table F16C, and the fp32 to bf16 conversion of the
+ * avx512 table AVX512-BF16.
+ * Setting MLP_FAST_EXP=0 replaces the polynomial exp with std::exp.
+ */
+const SimdKernels &simd();
+
+#endif //SIMD_H
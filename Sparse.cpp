@@ -0,0 +1,347 @@
+// Sparse.cpp
+
+#include "Sparse.h"
+#include "Simd.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <utility>
+
+/**
+ * Prints the sparse matrix error and exits.
+ */
+static void sparse_error ()
+{
+  std::cerr << SPARSE_ERROR << std::endl;
+  exit (EXIT_FAILURE);
+}
+
+/**
+ * @return the columns of the block starting at column c, SPARSE_BLOCK but
+ * for the last block of a row whose width is not a multiple of it.
+ */
+static int block_width (int c, int cols)
+{
+  return std::min (SPARSE_BLOCK, cols - c);
+}
+
+/**
+ * Empty 0 x 0 matrix.
+ */
+SparseMatrix::SparseMatrix () : _format (CSR), _rows (0), _cols (0),
+                                _row_ptr (1, 0)
+{}
+
+/**
+ * Compresses the non zero elements or blocks of a dense matrix.
+ */
+SparseMatrix::SparseMatrix (MatrixView dense, SparseFormat format)
+    : _format (format), _rows (dense.get_rows ()), _cols (dense.get_cols ())
+{
+  _row_ptr.push_back (0);
+  for (int i = 0; i < _rows; i++)
+    {
+      const float *row = dense.row (i);
+      if (_format == CSR)
+        {
+          for (int j = 0; j < _cols; j++)
+            {
+              if (row[j] != 0)
+                {
+                  _index.push_back (j);
+                  _values.push_back (row[j]);
+                }
+            }
+        }
+      else
+        {
+          for (int c = 0; c < _cols; c += SPARSE_BLOCK)
+            {
+              int width = block_width (c, _cols);
+              if (std::all_of (row + c, row + c + width,
+                               [] (float v) { return v == 0; }))
+                {
+                  continue;
+                }
+              _index.push_back (c);
+              _values.insert (_values.end (), row + c, row + c + width);
+              _values.resize (_values.size () + SPARSE_BLOCK - width, 0);
+            }
+        }
+      _row_ptr.push_back ((int32_t) _index.size ());
+    }
+  index_columns ();
+}
+
+/**
+ * Copies a matrix from its arrays, after checking that the offsets grow
+ * from 0 and every row's columns are inside the matrix and increasing (the
+ * block kernel counts on only a row's last block being cut short).
+ */
+SparseMatrix::SparseMatrix (SparseFormat format, int rows, int cols,
+                            const int32_t *row_ptr, const int32_t *index,
+                            const float *values)
+    : _format (format), _rows (rows), _cols (cols)
+{
+  if (rows <= 0 || cols <= 0 || row_ptr[0] != 0)
+    {
+      sparse_error ();
+    }
+  for (int i = 0; i < rows; i++)
+    {
+      if (row_ptr[i + 1] < row_ptr[i])
+        {
+          sparse_error ();
+        }
+    }
+  for (int i = 0; i < rows; i++)
+    {
+      for (int e = row_ptr[i]; e < row_ptr[i + 1]; e++)
+        {
+          if (index[e] < 0 || index[e] >= cols
+              || (e > row_ptr[i] && index[e] <= index[e - 1])
+              || (format == BLOCKS && index[e] % SPARSE_BLOCK != 0))
+            {
+              sparse_error ();
+            }
+        }
+    }
+  int count = row_ptr[rows];
+  long values_count = format == BLOCKS ? (long) count * SPARSE_BLOCK : count;
+  _row_ptr.assign (row_ptr, row_ptr + rows + 1);
+  _index.assign (index, index + count);
+  _values.assign (values, values + values_count);
+  index_columns ();
+}
+
+/**
+ * Builds the by column copy of a CSR matrix's entries.
+ */
+void SparseMatrix::index_columns ()
+{
+  if (_format != CSR)
+    {
+      return;
+    }
+  _col_ptr.assign (_cols + 1, 0);
+  for (int32_t c : _index)
+    {
+      _col_ptr[c + 1]++;
+    }
+  for (int c = 0; c < _cols; c++)
+    {
+      _col_ptr[c + 1] += _col_ptr[c];
+    }
+  std::vector<int32_t> next (_col_ptr.begin (), _col_ptr.end () - 1);
+  _col_rows.resize (_index.size ());
+  _col_values.resize (_index.size ());
+  for (int i = 0; i < _rows; i++)
+    {
+      for (int e = _row_ptr[i]; e < _row_ptr[i + 1]; e++)
+        {
+          int32_t at = next[_index[e]]++;
+          _col_rows[at] = i;
+          _col_values[at] = _values[e];
+        }
+    }
+}
+
+long SparseMatrix::bytes () const
+{
+  return (long) (_row_ptr.size () + _index.size ()) * sizeof (int32_t)
+         + (long) _values.size () * sizeof (float);
+}
+
+/**
+ * @return the matrix with its zeros, row major.
+ */
+Matrix SparseMatrix::dense () const
+{
+  Matrix m (_rows, _cols);
+  for (int i = 0; i < _rows; i++)
+    {
+      float *row = m.row (i);
+      for (int e = _row_ptr[i]; e < _row_ptr[i + 1]; e++)
+        {
+          if (_format == CSR)
+            {
+              row[_index[e]] = _values[e];
+              continue;
+            }
+          int c = _index[e];
+          std::copy (_values.begin () + (long) e * SPARSE_BLOCK,
+                     _values.begin () + (long) e * SPARSE_BLOCK
+                     + block_width (c, _cols), row + c);
+        }
+    }
+  return m;
+}
+
+/**
+ * y = W * x: a gathered dot product per row (CSR), or a vector multiply
+ * add per block (BLOCKS).
+ */
+void SparseMatrix::multiply (const float *x, float *y) const
+{
+  const int32_t *index = _index.data ();
+  const float *values = _values.data ();
+  const SimdKernels &kernels = simd ();
+  if (_format == CSR)
+    {
+      for (int i = 0; i < _rows; i++)
+        {
+          y[i] = kernels.dot_gather (values + _row_ptr[i],
+                                     index + _row_ptr[i],
+                                     _row_ptr[i + 1] - _row_ptr[i], x);
+        }
+      return;
+    }
+  for (int i = 0; i < _rows; i++)
+    {
+      // a row's blocks are in column order, only its last may be cut short
+      // by the end of the row.
+      int start = _row_ptr[i];
+      int end = _row_ptr[i + 1];
+      bool partial = end > start && index[end - 1] + SPARSE_BLOCK > _cols;
+      float sum = kernels.dot_blocks (values + (long) start * SPARSE_BLOCK,
+                                      index + start, end - start - partial,
+                                      x);
+      if (partial)
+        {
+          const float *v = values + (long) (end - 1) * SPARSE_BLOCK;
+          for (int c = index[end - 1]; c < _cols; c++)
+            {
+              sum += v[c - index[end - 1]] * x[c];
+            }
+        }
+      y[i] = sum;
+    }
+}
+
+/**
+ * y = W * x over the columns of x's non zeros only, scattering each
+ * column's weights into y.
+ */
+void SparseMatrix::multiply_sparse (const int *x_index, const float *x_values,
+                                    int count, float *y) const
+{
+  if (_format != CSR)
+    {
+      sparse_error ();
+    }
+  std::fill (y, y + _rows, 0.0f);
+  for (int t = 0; t < count; t++)
+    {
+      int c = x_index[t];
+      float xv = x_values[t];
+      for (int p = _col_ptr[c]; p < _col_ptr[c + 1]; p++)
+        {
+          y[_col_rows[p]] += _col_values[p] * xv;
+        }
+    }
+}
+
+/**
+ * Y = W * X: every entry of row i adds its weight times a row of X to row
+ * i of Y, unit stride across the batch.
+ */
+void SparseMatrix::multiply_batch (const float *x, int ldx, int n, float *y,
+                                   int ldy) const
+{
+  const SimdKernels &kernels = simd ();
+  for (int i = 0; i < _rows; i++)
+    {
+      float *y_i = y + (long) i * ldy;
+      std::fill (y_i, y_i + n, 0.0f);
+      for (int e = _row_ptr[i]; e < _row_ptr[i + 1]; e++)
+        {
+          if (_format == CSR)
+            {
+              kernels.axpy (_values[e], x + (long) _index[e] * ldx, y_i, n);
+              continue;
+            }
+          const float *v = _values.data () + (long) e * SPARSE_BLOCK;
+          for (int j = 0; j < block_width (_index[e], _cols); j++)
+            {
+              if (v[j] != 0)
+                {
+                  kernels.axpy (v[j], x + (long) (_index[e] + j) * ldx, y_i,
+                                n);
+                }
+            }
+        }
+    }
+}
+
+double SparseMatrix::density (MatrixView w)
+{
+  long nonzeros = 0;
+  for (int i = 0; i < w.get_rows (); i++)
+    {
+      const float *row = w.row (i);
+      nonzeros += w.get_cols () - std::count (row, row + w.get_cols (), 0.0f);
+    }
+  return (double) nonzeros / ((double) w.get_rows () * w.get_cols ());
+}
+
+double SparseMatrix::block_fill (MatrixView w)
+{
+  long nonzeros = 0;
+  long block_elements = 0;
+  for (int i = 0; i < w.get_rows (); i++)
+    {
+      const float *row = w.row (i);
+      for (int c = 0; c < w.get_cols (); c += SPARSE_BLOCK)
+        {
+          int width = block_width (c, w.get_cols ());
+          long in_block = width - std::count (row + c, row + c + width, 0.0f);
+          nonzeros += in_block;
+          block_elements += in_block > 0 ? width : 0;
+        }
+    }
+  return block_elements == 0 ? 1 : (double) nonzeros / block_elements;
+}
+
+/**
+ * Zeroes the smallest elements, or blocks by L2 norm, until the given
+ * fraction of them is zero. Ties are broken by position.
+ */
+void SparseMatrix::prune (Matrix &w, double sparsity, SparseFormat format)
+{
+  int rows = w.get_rows ();
+  int cols = w.get_cols ();
+  int blocks_per_row = format == CSR ? cols
+                                     : (cols + SPARSE_BLOCK - 1) / SPARSE_BLOCK;
+  int width = format == CSR ? 1 : SPARSE_BLOCK;
+  // (magnitude, element or block number), smallest first after selection.
+  std::vector<std::pair<float, long>> magnitudes;
+  magnitudes.reserve ((size_t) rows * blocks_per_row);
+  for (int i = 0; i < rows; i++)
+    {
+      for (int b = 0; b < blocks_per_row; b++)
+        {
+          int c = b * width;
+          float norm = 0;
+          for (int j = c; j < std::min (c + width, cols); j++)
+            {
+              norm += w (i, j) * w (i, j);
+            }
+          magnitudes.emplace_back (norm, (long) i * blocks_per_row + b);
+        }
+    }
+  long zeros = (long) std::ceil (std::min (std::max (sparsity, 0.0), 1.0)
+                                 * (double) magnitudes.size ());
+  if (zeros == 0)
+    {
+      return;
+    }
+  std::nth_element (magnitudes.begin (), magnitudes.begin () + zeros - 1,
+                    magnitudes.end ());
+  for (long z = 0; z < zeros; z++)
+    {
+      int i = (int) (magnitudes[z].second / blocks_per_row);
+      int c = (int) (magnitudes[z].second % blocks_per_row) * width;
+      std::fill (w.row (i) + c, w.row (i) + std::min (c + width, cols), 0.0f);
+    }
+}
@@ -0,0 +1,133 @@
+// Sparse.h
+
+#ifndef SPARSE_H
+#define SPARSE_H
+
+#include <cstdint>
+#include <vector>
+#include "Matrix.h"
+
+// columns of a block of the block sparse format: one row, SPARSE_BLOCK
+// columns starting at a multiple of SPARSE_BLOCK, so a block is one 8 float
+// vector multiply of the weights with the input (SimdKernels::dot_blocks,
+// which is why it must stay 8).
+#define SPARSE_BLOCK 8
+#define SPARSE_ERROR "Error: invalid sparse matrix."
+
+/**
+ * @enum SparseFormat
+ * @brief How a SparseMatrix stores its non zero weights.
+ */
+enum SparseFormat
+{
+    CSR, // compressed sparse rows: every non zero with its column
+    BLOCKS // non zero 1 x SPARSE_BLOCK blocks, each with its first column
+};
+
+/**
+ * Read only sparse rows x cols matrix, for layer weights. Row i's entries
+ * are [row_ptr[i], row_ptr[i + 1]) of index and values: an entry is one
+ * element at column index[e] (CSR), or SPARSE_BLOCK elements
+ * values[e * SPARSE_BLOCK ..] at columns index[e] .. (BLOCKS). CSR matrices
+ * also keep their entries by column, to skip the zeros of sparse inputs.
+ */
+class SparseMatrix
+{
+ public:
+  /**
+   * Empty 0 x 0 matrix.
+   */
+  SparseMatrix();
+  /**
+   * Compresses the non zero elements (CSR) or the blocks holding one or
+   * more non zero elements (BLOCKS) of a dense matrix.
+   */
+  SparseMatrix(MatrixView dense, SparseFormat format);
+  /**
+   * Copies a matrix from its arrays, e.g. read from a model file.
+   * Exits (code == 1) if they do not describe a rows x cols matrix.
+   * @param row_ptr - rows + 1 entry offsets, from 0 to the entry count
+   * @param index - a column per entry, increasing along each row,
+   *        multiples of SPARSE_BLOCK for BLOCKS
+   * @param values - an element per entry, SPARSE_BLOCK per entry for BLOCKS
+   */
+  SparseMatrix(SparseFormat format, int rows, int cols,
+               const int32_t *row_ptr, const int32_t *index,
+               const float *values);
+
+  SparseFormat get_format() const { return _format; }
+  int get_rows() const { return _rows; }
+  int get_cols() const { return _cols; }
+  /**
+   * @return number of entries: elements for CSR, blocks for BLOCKS.
+   */
+  int entries() const { return (int) _index.size(); }
+  const int32_t *row_ptr() const { return _row_ptr.data(); }
+  const int32_t *index() const { return _index.data(); }
+  const float *values() const { return _values.data(); }
+  /**
+   * @return bytes of the arrays above, as a model file stores them.
+   */
+  long bytes() const;
+  /**
+   * @return the matrix with its zeros, row major.
+   */
+  Matrix dense() const;
+
+  /**
+   * y = W * x.
+   * @param x - cols floats
+   * @param y - rows floats, overwritten
+   */
+  void multiply(const float *x, float *y) const;
+  /**
+   * y = W * x for an x given by its non zero elements, visiting only the
+   * weights of their columns. CSR only.
+   * @param x_index - the columns of x's non zeros
+   * @param x_values - x's non zeros
+   * @param count - number of non zeros
+   * @param y - rows floats, overwritten
+   */
+  void multiply_sparse(const int *x_index, const float *x_values, int count,
+                       float *y) const;
+  /**
+   * Y = W * X for a batch of n columns.
+   * @param x - cols x n, row stride ldx
+   * @param y - rows x n, row stride ldy, overwritten
+   */
+  void multiply_batch(const float *x, int ldx, int n, float *y,
+                      int ldy) const;
+
+  /**
+   * @return fraction of the elements of w that are not zero.
+   */
+  static double density(MatrixView w);
+  /**
+   * @return fraction of the elements of w's non zero blocks that are not
+   * zero, 1 when every block holding a non zero is full.
+   */
+  static double block_fill(MatrixView w);
+  /**
+   * Magnitude pruning: zeroes the elements of w with the smallest absolute
+   * values (CSR), or its blocks with the smallest L2 norms (BLOCKS), until
+   * at least the given fraction of its elements (CSR) or blocks (BLOCKS)
+   * is zero.
+   * @param sparsity - wanted fraction of zeros, in [0, 1]
+   */
+  static void prune(Matrix &w, double sparsity, SparseFormat format);
+
+ private:
+  void index_columns();
+
+  SparseFormat _format;
+  int _rows, _cols;
+  std::vector<int32_t> _row_ptr;
+  std::vector<int32_t> _index;
+  std::vector<float> _values;
+  // CSR only: the entries again, column after column, with their rows.
+  std::vector<int32_t> _col_ptr;
+  std::vector<int32_t> _col_rows;
+  std::vector<float> _col_values;
+};
+
+#endif //SPARSE_H
@@ -0,0 +1,239 @@
+// StaticMlp.h
+
+#ifndef STATICMLP_H
+#define STATICMLP_H
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include "MlpNetwork.h"
+
+// accumulators of the fixed size dot products: one 512 bit register, or
+// two 256 bit ones, of independent partial sums.
+#define STATIC_LANES 16
+
+/**
+ * A Dense layer whose shape is a compile time constant. The weights are
+ * rows of In floats in 64 byte aligned storage, so every loop bound is a
+ * constant the compiler unrolls and vectorizes, and nothing is checked at
+ * run time.
+ */
+template<int In, int Out>
+struct StaticDense
+{
+  alignas(64) std::array<float, (size_t) In * Out> weights;
+  alignas(64) std::array<float, Out> bias;
+
+  /**
+   * Copies a dynamic layer's parameters.
+   * Exits (code == 1) if its shape differs.
+   */
+  void load(const Dense &dense)
+  {
+    Matrix widened; // for half layers
+    const MatrixView w = dense.get_weights (widened);
+    if (w.get_rows () != Out || w.get_cols () != In)
+      {
+        std::cerr << UN_MUCH_MATRIX << std::endl;
+        exit (EXIT_FAILURE);
+      }
+    std::copy (w.data (), w.data () + weights.size (), weights.begin ());
+    std::copy (dense.get_bias ().data (), dense.get_bias ().data () + Out,
+               bias.begin ());
+  }
+
+  /**
+   * output = activation(W * input + b), ReLU or softmax.
+   * @param input - In floats
+   * @param output - Out floats, must not overlap input
+   */
+  template<bool Softmax>
+  void forward(const float *input, float *output) const
+  {
+    for (int i = 0; i < Out; i++)
+      {
+        output[i] = dot (weights.data () + (size_t) i * In, input) + bias[i];
+      }
+    if (!Softmax)
+      {
+        for (int i = 0; i < Out; i++)
+          {
+            output[i] = output[i] < 0 ? 0 : output[i];
+          }
+        return;
+      }
+    // max subtracted, so no exponent can overflow.
+    float max = output[0];
+    for (int i = 1; i < Out; i++)
+      {
+        max = output[i] > max ? output[i] : max;
+      }
+    float sum = 0;
+    for (int i = 0; i < Out; i++)
+      {
+        output[i] = std::exp (output[i] - max);
+        sum += output[i];
+      }
+    for (int i = 0; i < Out; i++)
+      {
+        output[i] /= sum;
+      }
+  }
+
+  /**
+   * @return the dot product of In floats. Each lane accumulates its own
+   * partial sum, so the loop vectorizes without reassociating a single sum.
+   */
+  static float dot(const float *w, const float *x)
+  {
+    constexpr int body = In / STATIC_LANES * STATIC_LANES;
+    float acc[STATIC_LANES] = {};
+    for (int j = 0; j < body; j += STATIC_LANES)
+      {
+        for (int l = 0; l < STATIC_LANES; l++)
+          {
+            acc[l] += w[j + l] * x[j + l];
+          }
+      }
+    float sum = 0;
+    for (int j = body; j < In; j++)
+      {
+        sum += w[j] * x[j];
+      }
+    for (int l = 0; l < STATIC_LANES; l++)
+      {
+        sum += acc[l];
+      }
+    return sum;
+  }
+};
+
+/**
+ * The layers In -> Out -> Rest..., the hidden ones with ReLU and the last
+ * with softmax. Each layer's output lives in a stack array of its exact size.
+ */
+template<int In, int Out, int... Rest>
+struct StaticLayers
+{
+  static constexpr int depth = 1 + StaticLayers<Out, Rest...>::depth;
+  static constexpr int outputs = StaticLayers<Out, Rest...>::outputs;
+
+  StaticDense<In, Out> head;
+  StaticLayers<Out, Rest...> tail;
+
+  void load(const MlpNetwork &mlp, int first)
+  {
+    if (mlp.get_layer (first).get_activation ().get_activation_type ()
+        != RELU)
+      {
+        std::cerr << UN_MUCH_MATRIX << std::endl;
+        exit (EXIT_FAILURE);
+      }
+    head.load (mlp.get_layer (first));
+    tail.load (mlp, first + 1);
+  }
+
+  void forward(const float *input, float *output) const
+  {
+    alignas(64) std::array<float, Out> hidden;
+    head.template forward<false> (input, hidden.data ());
+    tail.forward (hidden.data (), output);
+  }
+};
+
+template<int In, int Out>
+struct StaticLayers<In, Out>
+{
+  static constexpr int depth = 1;
+  static constexpr int outputs = Out;
+
+  StaticDense<In, Out> head;
+
+  void load(const MlpNetwork &mlp, int first)
+  {
+    if (mlp.get_layer (first).get_activation ().get_activation_type ()
+        != SOFTMAX)
+      {
+        std::cerr << UN_MUCH_MATRIX << std::endl;
+        exit (EXIT_FAILURE);
+      }
+    head.load (mlp.get_layer (first));
+  }
+
+  void forward(const float *input, float *output) const
+  {
+    head.template forward<true> (input, output);
+  }
+};
+
+/**
+ * An MLP whose topology is fixed at compile time, e.g.
+ * StaticMlp<784, 128, 64, 20, 10>: Dims are the input size followed by every
+ * layer's outputs. It holds a copy of a dynamic network's parameters in
+ * aligned std::array storage and runs the single image forward pass with
+ * constant sizes and no checks, heap allocations or dispatch through the
+ * SIMD kernel table. The parameters are stored inline, so allocate it on
+ * the heap. The vectorization comes from the compiler: it pays off in
+ * builds with -O3 and an -march that has wide vectors, while the dynamic
+ * network picks its SIMD kernels at run time in any build.
+ */
+template<int... Dims>
+class StaticMlp
+{
+  static_assert (sizeof... (Dims) >= 2, "StaticMlp needs at least a layer");
+
+ public:
+  static constexpr int depth = StaticLayers<Dims...>::depth;
+  static constexpr int outputs = StaticLayers<Dims...>::outputs;
+
+  /**
+   * Copies the parameters of a dynamic network.
+   * Exits (code == 1) if its topology is not Dims, with ReLU hidden layers
+   * and a softmax output layer.
+   * @param mlp - the dynamic network
+   */
+  explicit StaticMlp(const MlpNetwork &mlp)
+  {
+    if (mlp.get_depth () != depth)
+      {
+        std::cerr << UN_MUCH_MATRIX << std::endl;
+        exit (EXIT_FAILURE);
+      }
+    _layers.load (mlp, 0);
+  }
+
+  /**
+   * Applies the network on one image.
+   * @param input - the image's pixels, contiguous
+   * @param output - the class probabilities
+   */
+  void forward(const float *input, float *output) const
+  {
+    _layers.forward (input, output);
+  }
+
+  /**
+   * Applies the network on one image.
+   * @param input - the image's pixels, contiguous
+   * @return digit struct
+   */
+  digit operator()(const float *input) const
+  {
+    alignas(64) std::array<float, outputs> probs;
+    _layers.forward (input, probs.data ());
+    unsigned int ind = 0;
+    for (int i = 1; i < outputs; i++)
+      {
+        ind = probs[i] > probs[ind] ? i : ind;
+      }
+    return digit{ind, probs[ind]};
+  }
+
+ private:
+  StaticLayers<Dims...> _layers;
+};
+
+// the production topology, the default of MlpNetwork.h.
+typedef StaticMlp<784, 128, 64, 20, 10> DefaultStaticMlp;
+
+#endif //STATICMLP_H
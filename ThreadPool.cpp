@@ -0,0 +1,151 @@
+// ThreadPool.cpp
+
+#include "ThreadPool.h"
+
+static thread_local int current_worker = -1;
+
+/**
+ * Starts the workers.
+ * @param threads - number of workers, 0 means one per hardware thread
+ */
+ThreadPool::ThreadPool (int threads)
+    : _pending (0), _queued (0), _next (0), _stop (false)
+{
+  if (threads <= 0)
+    {
+      threads = (int) std::thread::hardware_concurrency ();
+      threads = threads > 0 ? threads : 1;
+    }
+  for (int i = 0; i < threads; i++)
+    {
+      _workers.emplace_back (new Worker);
+    }
+  for (int i = 0; i < threads; i++)
+    {
+      _threads.emplace_back (&ThreadPool::run, this, i);
+    }
+}
+
+/**
+ * Waits for all the submitted tasks, then stops the workers.
+ */
+ThreadPool::~ThreadPool ()
+{
+  wait ();
+  {
+    std::lock_guard<std::mutex> guard (_sleep_lock);
+    _stop = true;
+  }
+  _wake.notify_all ();
+  for (auto &thread : _threads)
+    {
+      thread.join ();
+    }
+}
+
+int ThreadPool::size () const
+{
+  return (int) _workers.size ();
+}
+
+int ThreadPool::worker_index ()
+{
+  return current_worker;
+}
+
+/**
+ * Queues a task. Tasks submitted from a worker go to that worker's own
+ * deque, others are spread round robin.
+ * @param task - the function to run
+ */
+void ThreadPool::submit (std::function<void ()> task)
+{
+  int index = current_worker;
+  if (index < 0 || index >= size ())
+    {
+      index = (int) (_next++ % _workers.size ());
+    }
+  _pending++;
+  {
+    std::lock_guard<std::mutex> guard (_workers[index]->lock);
+    _workers[index]->tasks.push_back (std::move (task));
+  }
+  {
+    // taking the lock orders this with a worker about to sleep.
+    std::lock_guard<std::mutex> guard (_sleep_lock);
+    _queued++;
+  }
+  _wake.notify_one ();
+}
+
+/**
+ * Blocks until every submitted task has finished.
+ */
+void ThreadPool::wait ()
+{
+  std::unique_lock<std::mutex> guard (_sleep_lock);
+  _idle.wait (guard, [this] ()
+  { return _pending == 0; });
+}
+
+/**
+ * Takes a task from the back of the worker's own deque, or else from the
+ * front of another worker's deque.
+ * @return false if every deque was empty
+ */
+bool ThreadPool::pop_or_steal (int index, std::function<void ()> &task)
+{
+  {
+    Worker &own = *_workers[index];
+    std::lock_guard<std::mutex> guard (own.lock);
+    if (!own.tasks.empty ())
+      {
+        task = std::move (own.tasks.back ());
+        own.tasks.pop_back ();
+        return true;
+      }
+  }
+  for (int i = 1; i < size (); i++)
+    {
+      Worker &victim = *_workers[(index + i) % size ()];
+      std::lock_guard<std::mutex> guard (victim.lock);
+      if (!victim.tasks.empty ())
+        {
+          task = std::move (victim.tasks.front ());
+          victim.tasks.pop_front ();
+          return true;
+        }
+    }
+  return false;
+}
+
+/**
+ * Worker loop: run tasks while there are any, sleep otherwise.
+ */
+void ThreadPool::run (int index)
+{
+  current_worker = index;
+  std::function<void ()> task;
+  while (true)
+    {
+      if (pop_or_steal (index, task))
+        {
+          _queued--;
+          task ();
+          task = nullptr;
+          if (--_pending == 0)
+            {
+              std::lock_guard<std::mutex> guard (_sleep_lock);
+              _idle.notify_all ();
+            }
+          continue;
+        }
+      std::unique_lock<std::mutex> guard (_sleep_lock);
+      _wake.wait (guard, [this] ()
+      { return _stop || _queued > 0; });
+      if (_stop && _queued == 0)
+        {
+          return;
+        }
+    }
+}
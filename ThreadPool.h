@@ -0,0 +1,77 @@
+// ThreadPool.h
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * Work stealing thread pool. Every worker owns a task deque: it pops its
+ * own tasks from the back (most recent, still hot in cache) and, when it
+ * runs dry, steals from the front of the other workers' deques.
+ */
+class ThreadPool
+{
+ public:
+  /**
+   * Starts the workers.
+   * @param threads - number of workers, 0 means one per hardware thread
+   */
+  explicit ThreadPool(int threads = 0);
+  /**
+   * Waits for all the submitted tasks, then stops the workers.
+   */
+  ~ThreadPool();
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /**
+   * @return number of workers.
+   */
+  int size() const;
+  /**
+   * Queues a task. Tasks submitted from a worker go to that worker's own
+   * deque, others are spread round robin.
+   * @param task - the function to run
+   */
+  void submit(std::function<void()> task);
+  /**
+   * Blocks until every submitted task has finished. Must not be called
+   * from inside a task.
+   */
+  void wait();
+  /**
+   * @return index (0 .. size()-1) of the calling worker, -1 when not
+   * called from a worker of any pool.
+   */
+  static int worker_index();
+
+ private:
+  struct Worker
+  {
+      std::mutex lock;
+      std::deque<std::function<void()>> tasks;
+  };
+
+  void run(int index);
+  bool pop_or_steal(int index, std::function<void()> &task);
+
+  std::vector<std::unique_ptr<Worker>> _workers;
+  std::vector<std::thread> _threads;
+  std::mutex _sleep_lock;
+  std::condition_variable _wake; // new work or stop
+  std::condition_variable _idle; // pending reached zero
+  std::atomic<long> _pending; // submitted and not finished tasks
+  std::atomic<long> _queued; // submitted and not started tasks
+  std::atomic<unsigned> _next;
+  bool _stop;
+};
+
+#endif //THREADPOOL_H
@@ -0,0 +1,332 @@
+// Trainer.cpp
+
+#include "Trainer.h"
+#include "ModelFile.h"
+#include "Simd.h"
+#include <algorithm>
+#include <numeric>
+
+// smallest probability fed to the log of the cross entropy.
+#define MIN_PROB 1e-12f
+
+/**
+ * Starts from random parameters (He initialization, zero biases).
+ * @param config - hyper parameters
+ * @param widths - widths[i] is the number of outputs of the i'th layer
+ */
+Trainer::Trainer (const TrainConfig &config, const std::vector<int> &widths)
+    : _config (config), _step (0), _rng (config.seed), _pool (config.threads)
+{
+  std::normal_distribution<float> normal (0, 1);
+  int inputs = img_dims.rows * img_dims.cols;
+  for (size_t l = 0; l < widths.size (); l++)
+    {
+      if (widths[l] <= 0)
+        {
+          std::cerr << UN_MUCH_MATRIX << std::endl;
+          exit (EXIT_FAILURE);
+        }
+      Matrix w (widths[l], inputs);
+      float std_dev = std::sqrt (2.0f / (float) inputs);
+      for (int i = 0; i < w.get_rows () * w.get_cols (); i++)
+        {
+          w[i] = normal (_rng) * std_dev;
+        }
+      _weights.push_back (std::move (w));
+      _biases.emplace_back (widths[l], 1);
+      _activations.push_back (l + 1 == widths.size () ? SOFTMAX : RELU);
+      inputs = widths[l];
+    }
+  init_layers ();
+}
+
+/**
+ * Starts from existing parameters, e.g. to fine tune a model.
+ * @param config - hyper parameters
+ * @param weights - weights[i] is the i'th layer weights matrix
+ * @param biases - biases[i] is the i'th layer bias vector
+ * @param activations - activations[i] is the i'th layer activation
+ * @param depth - number of layers
+ */
+Trainer::Trainer (const TrainConfig &config, const Matrix weights[],
+                  const Matrix biases[], const ActivationType activations[],
+                  int depth)
+    : _config (config), _step (0), _rng (config.seed), _pool (config.threads)
+{
+  if (!MlpNetwork::is_valid (weights, biases, depth)
+      || activations[depth - 1] != SOFTMAX)
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  for (int l = 0; l < depth; l++)
+    {
+      // copies own their elements: the trainer writes the parameters,
+      // never the views they came from.
+      _weights.push_back (weights[l]);
+      _biases.push_back (biases[l]);
+      _activations.push_back (activations[l]);
+    }
+  init_layers ();
+}
+
+/**
+ * Builds the layers as views of the parameters, and zeroed gradients and
+ * optimizer state.
+ */
+void Trainer::init_layers ()
+{
+  if (!MlpNetwork::is_valid (_weights.data (), _biases.data (), depth ()))
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  for (int l = 0; l < depth (); l++)
+    {
+      Matrix w = Matrix::view (_weights[l].data (), _weights[l].get_rows (),
+                               _weights[l].get_cols ());
+      Matrix b = Matrix::view (_biases[l].data (), _biases[l].get_rows (), 1);
+      _layers.emplace_back (w, b, _activations[l]);
+    }
+  _grad_weights.resize (_pool.size ());
+  _grad_biases.resize (_pool.size ());
+  for (int s = 0; s < _pool.size (); s++)
+    {
+      for (int l = 0; l < depth (); l++)
+        {
+          _grad_weights[s].emplace_back (_weights[l].get_rows (),
+                                         _weights[l].get_cols ());
+          _grad_biases[s].emplace_back (_biases[l].get_rows (), 1);
+        }
+    }
+  // moments of the weights, then of the biases.
+  for (const auto *params : {&_weights, &_biases})
+    {
+      for (const auto &p : *params)
+        {
+          _m.emplace_back (p.get_rows (), p.get_cols ());
+          _v.emplace_back (p.get_rows (), p.get_cols ());
+        }
+    }
+}
+
+/**
+ * Softmax cross entropy backward pass over a batch.
+ * @param probs - softmax outputs, one sample per column
+ * @param labels - labels[j] is the label of column j
+ * @param scale - multiplies the gradient, 1/batch size for a mean loss
+ * @param delta - overwritten with scale * (probs - one_hot(labels))
+ * @return the summed cross entropy of the batch
+ */
+float Trainer::softmax_cross_entropy (MatrixView probs,
+                                      const unsigned char *labels, float scale,
+                                      Matrix &delta)
+{
+  int rows = probs.get_rows ();
+  int cols = probs.get_cols ();
+  if (delta.get_rows () != rows || delta.get_cols () != cols)
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  float loss = 0;
+  float *d = delta.data ();
+  for (int j = 0; j < cols; j++)
+    {
+      int label = labels[j] % rows;
+      loss -= std::log (std::max (probs (label, j), MIN_PROB));
+      for (int i = 0; i < rows; i++)
+        {
+          d[i * cols + j] = scale * (probs (i, j) - (i == label ? 1.0f : 0.0f));
+        }
+    }
+  return loss;
+}
+
+/**
+ * Forward, loss and backward pass of one shard of a minibatch.
+ * @return the shard's summed loss
+ */
+float Trainer::run_shard (int shard, MatrixView images,
+                          const unsigned char *labels, const int *indices,
+                          int count, float scale)
+{
+  // the shard's images become the columns of the input.
+  Matrix input (images.get_cols (), count, NO_FILL);
+  std::vector<unsigned char> shard_labels (count);
+  for (int c = 0; c < count; c++)
+    {
+      const float *image = images.row (indices[c]);
+      for (int j = 0; j < images.get_cols (); j++)
+        {
+          input.row (j)[c] = image[j];
+        }
+      shard_labels[c] = labels[indices[c]];
+    }
+  std::vector<Matrix> activations;
+  activations.push_back (std::move (input));
+  for (const auto &layer : _layers)
+    {
+      Matrix output (layer.get_rows (), count, NO_FILL);
+      layer (activations.back (), output);
+      activations.push_back (std::move (output));
+    }
+
+  Matrix delta (activations.back ().get_rows (), count, NO_FILL);
+  float loss = softmax_cross_entropy (activations.back (),
+                                      shard_labels.data (), scale, delta);
+  for (int l = depth () - 1; l >= 0; l--)
+    {
+      if (l == 0)
+        {
+          _layers[l].backward (activations[l], delta, _grad_weights[shard][l],
+                               _grad_biases[shard][l], nullptr);
+          break;
+        }
+      Matrix grad_input (activations[l].get_rows (), count, NO_FILL);
+      _layers[l].backward (activations[l], delta, _grad_weights[shard][l],
+                           _grad_biases[shard][l], &grad_input);
+      // through the previous layer's activation, to its pre-activation.
+      _layers[l - 1].get_activation ().backward (activations[l], grad_input);
+      delta = std::move (grad_input);
+    }
+  return loss;
+}
+
+/**
+ * Applies the summed gradients of shard 0 to the parameters.
+ */
+void Trainer::update ()
+{
+  _step++;
+  float lr = _config.learning_rate;
+  float correction1 = 1 - std::pow (ADAM_BETA1, (float) _step);
+  float correction2 = 1 - std::pow (ADAM_BETA2, (float) _step);
+  for (int p = 0; p < 2 * depth (); p++)
+    {
+      int l = p % depth ();
+      Matrix &param = p < depth () ? _weights[l] : _biases[l];
+      const Matrix &grad = p < depth () ? _grad_weights[0][l]
+                                        : _grad_biases[0][l];
+      float *w = param.data ();
+      const float *g = grad.data ();
+      float *m = _m[p].data ();
+      float *v = _v[p].data ();
+      int size = param.get_rows () * param.get_cols ();
+      for (int i = 0; i < size; i++)
+        {
+          if (_config.optimizer == ADAM)
+            {
+              m[i] = ADAM_BETA1 * m[i] + (1 - ADAM_BETA1) * g[i];
+              v[i] = ADAM_BETA2 * v[i] + (1 - ADAM_BETA2) * g[i] * g[i];
+              w[i] -= lr * (m[i] / correction1)
+                      / (std::sqrt (v[i] / correction2) + ADAM_EPSILON);
+            }
+          else
+            {
+              m[i] = _config.momentum * m[i] + g[i];
+              w[i] -= lr * m[i];
+            }
+        }
+    }
+}
+
+/**
+ * Runs one epoch over the data set in a random order.
+ * @param images - N x 784, one image per row
+ * @param labels - N labels
+ * @return the mean cross entropy loss over the epoch
+ */
+float Trainer::train_epoch (MatrixView images, const unsigned char *labels)
+{
+  if (images.get_cols () != _weights[0].get_cols ()
+      || _config.batch_size <= 0)
+    {
+      std::cerr << UN_MUCH_MATRIX << std::endl;
+      exit (EXIT_FAILURE);
+    }
+  int size = images.get_rows ();
+  std::vector<int> order (size);
+  std::iota (order.begin (), order.end (), 0);
+  std::shuffle (order.begin (), order.end (), _rng);
+
+  double total_loss = 0;
+  std::vector<float> losses (_pool.size ());
+  for (int start = 0; start < size; start += _config.batch_size)
+    {
+      int count = std::min (_config.batch_size, size - start);
+      int shards = std::min (_pool.size (), count);
+      float scale = 1.0f / (float) count;
+      for (int s = 0; s < shards; s++)
+        {
+          int first = start + count * s / shards;
+          int last = start + count * (s + 1) / shards;
+          _pool.submit ([=, &order, &losses] ()
+                        {
+                          losses[s] = run_shard (s, images, labels,
+                                                 order.data () + first,
+                                                 last - first, scale);
+                        });
+        }
+      _pool.wait ();
+      // sum the shards' gradients into shard 0.
+      for (int s = 1; s < shards; s++)
+        {
+          for (int l = 0; l < depth (); l++)
+            {
+              _grad_weights[0][l] += _grad_weights[s][l];
+              _grad_biases[0][l] += _grad_biases[s][l];
+            }
+        }
+      update ();
+      for (int s = 0; s < shards; s++)
+        {
+          total_loss += losses[s];
+        }
+    }
+  return size > 0 ? (float) (total_loss / size) : 0;
+}
+
+/**
+ * @return an inference network with a copy of the current parameters.
+ */
+MlpNetwork Trainer::network () const
+{
+  return MlpNetwork (_weights.data (), _biases.data (), _activations.data (),
+                     depth ());
+}
+
+int Trainer::depth () const
+{
+  return (int) _weights.size ();
+}
+
+/**
+ * Writes the parameters as raw layer files and as a packed model.
+ * @param dir - existing output directory
+ * @return false if a file could not be written
+ */
+bool Trainer::save (const std::string &dir) const
+{
+  for (int l = 0; l < depth (); l++)
+    {
+      const Matrix *params[] = {&_weights[l], &_biases[l]};
+      const char *names[] = {"/w", "/b"};
+      for (int p = 0; p < 2; p++)
+        {
+          std::ofstream os (dir + names[p] + std::to_string (l + 1),
+                            std::ios::out | std::ios::binary
+                            | std::ios::trunc);
+          os.write ((const char *) params[p]->data (),
+                    (std::streamsize) (params[p]->get_rows ()
+                                       * params[p]->get_cols ()
+                                       * sizeof (float)));
+          if (!os)
+            {
+              return false;
+            }
+        }
+    }
+  return MappedModel::write (dir + "/model.mlpm", _weights.data (),
+                             _biases.data (), _activations.data (), depth ());
+}
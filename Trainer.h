@@ -0,0 +1,141 @@
+// Trainer.h
+
+#ifndef TRAINER_H
+#define TRAINER_H
+
+#include <random>
+#include <string>
+#include <vector>
+#include "MlpNetwork.h"
+#include "ThreadPool.h"
+
+#define ADAM_BETA1 0.9f
+#define ADAM_BETA2 0.999f
+#define ADAM_EPSILON 1e-8f
+
+/**
+ * @enum Optimizer
+ * @brief Parameter update rule.
+ */
+enum Optimizer
+{
+    SGD,
+    ADAM
+};
+
+/**
+ * @struct TrainConfig
+ * @brief Minibatch training hyper parameters.
+ */
+typedef struct TrainConfig
+{
+    Optimizer optimizer;
+    float learning_rate;
+    float momentum; // SGD only, 0 for plain SGD
+    int batch_size;
+    int threads; // 0 means one per hardware thread
+    unsigned int seed;
+} TrainConfig;
+
+/**
+ * Trains the network's layers with backpropagation and minibatch SGD or
+ * Adam, minimizing softmax cross entropy.
+ * Every minibatch is split into one shard of columns per thread; each shard
+ * runs its forward and backward passes as batched gemm calls, then the
+ * shards' gradients are summed and the optimizer updates the parameters.
+ */
+class Trainer
+{
+ public:
+  /**
+   * Starts from random parameters (He initialization, zero biases).
+   * The hidden layers use ReLU, the last one softmax.
+   * Exits (code == 1) if the last width is not 10.
+   * @param config - hyper parameters
+   * @param widths - widths[i] is the number of outputs of the i'th layer
+   */
+  Trainer(const TrainConfig &config, const std::vector<int> &widths);
+  /**
+   * Starts from existing parameters, e.g. to fine tune a model.
+   * Exits (code == 1) if the layers do not form a network or the last
+   * activation is not softmax.
+   * @param config - hyper parameters
+   * @param weights - weights[i] is the i'th layer weights matrix
+   * @param biases - biases[i] is the i'th layer bias vector
+   * @param activations - activations[i] is the i'th layer activation
+   * @param depth - number of layers
+   */
+  Trainer(const TrainConfig &config, const Matrix weights[],
+          const Matrix biases[], const ActivationType activations[],
+          int depth);
+  Trainer(const Trainer&) = delete;
+  Trainer& operator=(const Trainer&) = delete;
+
+  /**
+   * Runs one epoch over the data set in a random order.
+   * @param images - N x 784, one image per row
+   * @param labels - N labels
+   * @return the mean cross entropy loss over the epoch
+   */
+  float train_epoch(MatrixView images, const unsigned char *labels);
+  /**
+   * @return an inference network with a copy of the current parameters.
+   */
+  MlpNetwork network() const;
+  /**
+   * @return number of layers.
+   */
+  int depth() const;
+  /**
+   * Writes the parameters as raw layer files (dir/w1.., dir/b1..), which
+   * mlpnetwork loads for the default topology, and as a packed model
+   * (dir/model.mlpm), which records the topology.
+   * @param dir - existing output directory
+   * @return false if a file could not be written
+   */
+  bool save(const std::string &dir) const;
+
+  /**
+   * Softmax cross entropy backward pass over a batch.
+   * @param probs - softmax outputs, one sample per column
+   * @param labels - labels[j] is the label of column j
+   * @param scale - multiplies the gradient, 1/batch size for a mean loss
+   * @param delta - overwritten with scale * (probs - one_hot(labels)), the
+   *        gradient with respect to the softmax input
+   * @return the summed cross entropy of the batch
+   */
+  static float softmax_cross_entropy(MatrixView probs,
+                                     const unsigned char *labels, float scale,
+                                     Matrix &delta);
+
+ private:
+  /**
+   * Forward, loss and backward pass of one shard of a minibatch. The
+   * shard's gradients go to _grad_weights[shard] and _grad_biases[shard].
+   * @return the shard's summed loss
+   */
+  float run_shard(int shard, MatrixView images, const unsigned char *labels,
+                  const int *indices, int count, float scale);
+  /**
+   * Applies the summed gradients of shard 0 to the parameters.
+   */
+  void update();
+  void init_layers();
+
+  TrainConfig _config;
+  std::vector<Matrix> _weights;
+  std::vector<Matrix> _biases;
+  std::vector<ActivationType> _activations;
+  std::vector<Dense> _layers; // views of _weights and _biases
+  // per shard gradients, [shard][layer]
+  std::vector<std::vector<Matrix>> _grad_weights;
+  std::vector<std::vector<Matrix>> _grad_biases;
+  // Adam moments, or SGD velocities in _m
+  std::vector<Matrix> _m;
+  std::vector<Matrix> _v;
+  long _step;
+  std::mt19937 _rng;
+  ThreadPool _pool;
+};
+
+#endif //TRAINER_H
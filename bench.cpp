@@ -0,0 +1,520 @@
+// bench.cpp
+// Benchmark suite of the inference path: every Matrix operation, every
+// activation, every Dense layer of the default topology and the whole
+// forward pass, at batch sizes 1 to 1024. Reports time per operation with
+// its percentiles, GFLOP/s and GB/s, as a table or as JSON, and compares a
+// run with an earlier JSON report to catch regressions.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+#include "MlpNetwork.h"
+#include "Simd.h"
+
+#define USAGE_MSG "Usage:\n" \
+                  "\t./mlpbench [options]\n" \
+                  "\toptions:\n" \
+                  "\t  --json - print the report as JSON\n" \
+                  "\t  --filter TEXT - only cases whose name contains TEXT\n" \
+                  "\t  --batch N - only batch size N (default all of 1, 2, " \
+                  "4 .. 1024)\n" \
+                  "\t  --min-time X - seconds of samples per case " \
+                  "(default 0.05)\n" \
+                  "\t  --baseline report.json - compare the median times " \
+                  "with an earlier JSON report, exit 1 on a regression\n" \
+                  "\t  --tolerance X - percent slower that counts as a " \
+                  "regression (default 10)"
+#define ERROR_BASELINE "Error: failed to read baseline report: "
+#define MAX_BATCH 1024
+#define DEFAULT_MIN_TIME 0.05
+#define DEFAULT_TOLERANCE 10.0
+// a sample repeats the operation until it takes at least this long, so the
+// clock's resolution and overhead stay negligible.
+#define SAMPLE_NS 20000.0
+#define MIN_SAMPLES 10
+
+/**
+ * @struct BenchCase
+ * @brief One operation on inputs of one batch size.
+ * @var flops - floating point operations of one call, an exp counts as one
+ * @var bytes - bytes one call reads and writes, each operand once
+ */
+typedef struct BenchCase
+{
+    std::string name;
+    int batch;
+    double flops;
+    double bytes;
+    std::function<void ()> run;
+} BenchCase;
+
+/**
+ * @struct BenchResult
+ * @brief Nanoseconds per call of a case: the mean and percentiles over the
+ *        samples.
+ */
+typedef struct BenchResult
+{
+    std::string name;
+    int batch;
+    int samples;
+    double mean_ns;
+    double min_ns;
+    double p50_ns;
+    double p90_ns;
+    double p99_ns;
+    double gflops;
+    double gbps;
+} BenchResult;
+
+// results feed this, so the compiler cannot drop a benchmarked call.
+static volatile float sink;
+
+/**
+ * @return a rows x cols matrix of uniform random values in [-1, 1).
+ */
+static Matrix random_matrix (std::mt19937 &gen, int rows, int cols)
+{
+  std::uniform_real_distribution<float> dist (-1, 1);
+  Matrix m (rows, cols);
+  for (int i = 0; i < rows * cols; i++)
+    {
+      m[i] = dist (gen);
+    }
+  return m;
+}
+
+/**
+ * @return the p quantile of sorted values, by the nearest rank.
+ */
+static double percentile (const std::vector<double> &sorted, double p)
+{
+  size_t rank = (size_t) std::ceil (p * (double) sorted.size ());
+  return sorted[std::min (sorted.size (), std::max<size_t> (rank, 1)) - 1];
+}
+
+/**
+ * Times a case: calibrates the calls per sample to SAMPLE_NS, then takes
+ * samples for at least min_time seconds and MIN_SAMPLES samples.
+ */
+static BenchResult measure (const BenchCase &bench, double min_time)
+{
+  using clock = std::chrono::steady_clock;
+  bench.run (); // warm up caches, packing buffers and lazy allocations
+  long reps = 1;
+  while (true)
+    {
+      auto start = clock::now ();
+      for (long r = 0; r < reps; r++)
+        {
+          bench.run ();
+        }
+      double ns = std::chrono::duration<double, std::nano> (
+          clock::now () - start).count ();
+      if (ns >= SAMPLE_NS)
+        {
+          break;
+        }
+      reps *= ns > 0 ? std::max (2L, (long) (SAMPLE_NS / ns) + 1) : 2;
+    }
+
+  std::vector<double> samples;
+  auto begin = clock::now ();
+  while (samples.size () < MIN_SAMPLES
+         || std::chrono::duration<double> (clock::now () - begin).count ()
+            < min_time)
+    {
+      auto start = clock::now ();
+      for (long r = 0; r < reps; r++)
+        {
+          bench.run ();
+        }
+      samples.push_back (std::chrono::duration<double, std::nano> (
+          clock::now () - start).count () / reps);
+    }
+  std::sort (samples.begin (), samples.end ());
+  double sum = 0;
+  for (double s : samples)
+    {
+      sum += s;
+    }
+  BenchResult result{bench.name, bench.batch, (int) samples.size (),
+                     sum / samples.size (), samples.front (),
+                     percentile (samples, 0.5), percentile (samples, 0.9),
+                     percentile (samples, 0.99), 0, 0};
+  // throughput of the median, which one slow sample does not move.
+  result.gflops = bench.flops / result.p50_ns;
+  result.gbps = bench.bytes / result.p50_ns;
+  return result;
+}
+
+/**
+ * The Matrix operations on a 784 x batch operand, the shape of a batch of
+ * images as the network's input, and operator* as the first layer's
+ * product with it.
+ */
+static void matrix_cases (std::mt19937 &gen, int batch,
+                          std::vector<BenchCase> &cases)
+{
+  int rows = img_dims.rows * img_dims.cols;
+  int out = weights_dims[0].rows;
+  double elems = (double) rows * batch;
+  auto w = std::make_shared<Matrix> (random_matrix (gen, out, rows));
+  auto a = std::make_shared<Matrix> (random_matrix (gen, rows, batch));
+  auto b = std::make_shared<Matrix> (random_matrix (gen, rows, batch));
+  cases.push_back (BenchCase{
+      "matrix.multiply", batch, 2.0 * out * elems,
+      4.0 * ((double) out * rows + elems + (double) out * batch),
+      [w, a] ()
+      {
+        Matrix c = *w * *a;
+        sink = c[0];
+      }});
+  cases.push_back (BenchCase{
+      "matrix.dot", batch, elems, 3 * 4.0 * elems,
+      [a, b] ()
+      {
+        Matrix c = a->dot (*b);
+        sink = c[0];
+      }});
+  cases.push_back (BenchCase{
+      "matrix.add_assign", batch, elems, 3 * 4.0 * elems,
+      [a, b] ()
+      {
+        *a += *b;
+        sink = (*a)[0];
+      }});
+  cases.push_back (BenchCase{
+      "matrix.transpose", batch, 0, 2 * 4.0 * elems,
+      [a] ()
+      {
+        a->transpose ();
+        sink = (*a)[0];
+      }});
+  cases.push_back (BenchCase{
+      "matrix.norm", batch, 2 * elems, 4.0 * elems,
+      [a] ()
+      {
+        sink = a->norm ();
+      }});
+}
+
+/**
+ * Every activation on a batch of its layer's width: ReLU on the first
+ * hidden layer, the softmaxes on the classes.
+ */
+static void activation_cases (std::mt19937 &gen, int batch,
+                              std::vector<BenchCase> &cases)
+{
+  struct
+  {
+      const char *name;
+      ActivationType type;
+      int rows;
+      double flops; // per element
+  } activations[] = {{"activation.relu", RELU, weights_dims[0].rows, 1},
+                     // max, subtract, exp, sum and normalize
+                     {"activation.softmax", SOFTMAX, TEN, 5},
+                     {"activation.log_softmax", LOG_SOFTMAX, TEN, 5}};
+  for (const auto &act : activations)
+    {
+      double elems = (double) act.rows * batch;
+      auto input = std::make_shared<Matrix> (random_matrix (gen, act.rows,
+                                                            batch));
+      auto output = std::make_shared<Matrix> (act.rows, batch);
+      Activation activation (act.type);
+      cases.push_back (BenchCase{
+          act.name, batch, act.flops * elems, 2 * 4.0 * elems,
+          [activation, input, output] ()
+          {
+            activation (*input, *output);
+            sink = (*output)[0];
+          }});
+    }
+}
+
+/**
+ * Every layer of the network on a batch of its inputs, and the whole
+ * forward pass: the workspace path for one image, classify_batch for more.
+ */
+static void network_cases (std::mt19937 &gen, const MlpNetwork &mlp,
+                           int batch, std::vector<BenchCase> &cases)
+{
+  double network_flops = 0;
+  double network_bytes = 0;
+  for (int l = 0; l < mlp.get_depth (); l++)
+    {
+      const Dense &layer = mlp.get_layer (l);
+      int out = layer.get_rows ();
+      int in = layer.get_cols ();
+      // the product, the bias and the activation.
+      double flops = (2.0 * in + 2) * out * batch;
+      double bytes = 4.0 * ((double) out * in + out
+                            + (double) (in + out) * batch);
+      network_flops += flops;
+      network_bytes += bytes;
+      auto input = std::make_shared<Matrix> (random_matrix (gen, in, batch));
+      auto output = std::make_shared<Matrix> (out, batch);
+      cases.push_back (BenchCase{
+          "dense." + std::to_string (l + 1) + "." + std::to_string (out) + "x"
+          + std::to_string (in), batch, flops, bytes,
+          [&layer, input, output] ()
+          {
+            layer (*input, *output);
+            sink = (*output)[0];
+          }});
+    }
+  int pixels = img_dims.rows * img_dims.cols;
+  auto images = std::make_shared<Matrix> (random_matrix (gen, batch, pixels));
+  if (batch == 1)
+    {
+      auto workspace = std::make_shared<MlpWorkspace> (mlp);
+      cases.push_back (BenchCase{
+          "network.forward", batch, network_flops, network_bytes,
+          [&mlp, images, workspace] ()
+          {
+            sink = mlp.forward (*images, *workspace).probability;
+          }});
+      return;
+    }
+  cases.push_back (BenchCase{
+      "network.forward", batch, network_flops, network_bytes,
+      [&mlp, images] ()
+      {
+        sink = mlp.classify_batch (*images)[0].probability;
+      }});
+}
+
+/**
+ * Prints the results as one JSON object, one result per line.
+ */
+static void print_json (const std::vector<BenchResult> &results)
+{
+  std::cout << "{\"simd\": \"" << simd ().name << "\", \"results\": ["
+            << std::endl;
+  for (size_t i = 0; i < results.size (); i++)
+    {
+      const BenchResult &r = results[i];
+      std::cout << std::fixed << std::setprecision (1) << "  {\"name\": \""
+                << r.name << "\", \"batch\": " << r.batch
+                << ", \"samples\": " << r.samples << ", \"mean_ns\": "
+                << r.mean_ns << ", \"min_ns\": " << r.min_ns
+                << ", \"p50_ns\": " << r.p50_ns << ", \"p90_ns\": "
+                << r.p90_ns << ", \"p99_ns\": " << r.p99_ns
+                << std::setprecision (3) << ", \"gflops\": " << r.gflops
+                << ", \"gbps\": " << r.gbps << "}"
+                << (i + 1 < results.size () ? "," : "") << std::endl;
+    }
+  std::cout << "]}" << std::defaultfloat << std::endl;
+}
+
+/**
+ * Prints the results as a table.
+ */
+static void print_table (const std::vector<BenchResult> &results)
+{
+  std::cout << "simd: " << simd ().name << std::endl;
+  std::cout << std::left << std::setw (24) << "case" << std::right
+            << std::setw (6) << "batch" << std::setw (13) << "ns/op"
+            << std::setw (13) << "p50" << std::setw (13) << "p90"
+            << std::setw (13) << "p99" << std::setw (10) << "GFLOP/s"
+            << std::setw (10) << "GB/s" << std::endl;
+  for (const auto &r : results)
+    {
+      std::cout << std::left << std::setw (24) << r.name << std::right
+                << std::setw (6) << r.batch << std::fixed
+                << std::setprecision (0) << std::setw (13) << r.mean_ns
+                << std::setw (13) << r.p50_ns << std::setw (13) << r.p90_ns
+                << std::setw (13) << r.p99_ns << std::setprecision (2)
+                << std::setw (10) << r.gflops << std::setw (10) << r.gbps
+                << std::defaultfloat << std::endl;
+    }
+}
+
+/**
+ * Reads the name, batch and median of every result of a JSON report
+ * written by print_json.
+ * @return false if the file cannot be read
+ */
+static bool read_baseline (const std::string &path,
+                           std::vector<BenchResult> &baseline)
+{
+  std::ifstream is (path);
+  if (!is)
+    {
+      return false;
+    }
+  std::string line;
+  while (std::getline (is, line))
+    {
+      size_t name = line.find ("\"name\": \"");
+      size_t batch = line.find ("\"batch\": ");
+      size_t p50 = line.find ("\"p50_ns\": ");
+      if (name == std::string::npos || batch == std::string::npos
+          || p50 == std::string::npos)
+        {
+          continue;
+        }
+      name += std::strlen ("\"name\": \"");
+      BenchResult r{};
+      r.name = line.substr (name, line.find ('"', name) - name);
+      r.batch = std::atoi (line.c_str () + batch + std::strlen ("\"batch\": "));
+      r.p50_ns = std::atof (line.c_str () + p50 + std::strlen ("\"p50_ns\": "));
+      baseline.push_back (r);
+    }
+  return !baseline.empty ();
+}
+
+/**
+ * Prints every case whose median is more than tolerance percent slower
+ * than in the baseline, to stderr so it stays out of a JSON report.
+ * @return number of regressions
+ */
+static int compare (const std::vector<BenchResult> &results,
+                    const std::vector<BenchResult> &baseline,
+                    double tolerance)
+{
+  int regressions = 0;
+  for (const auto &r : results)
+    {
+      for (const auto &b : baseline)
+        {
+          if (r.name != b.name || r.batch != b.batch || b.p50_ns <= 0)
+            {
+              continue;
+            }
+          double change = 100.0 * (r.p50_ns / b.p50_ns - 1);
+          if (change > tolerance)
+            {
+              std::cerr << "regression: " << r.name << " batch " << r.batch
+                        << ": " << std::fixed << std::setprecision (0)
+                        << b.p50_ns << " -> " << r.p50_ns << " ns ("
+                        << std::setprecision (1) << "+" << change << "%)"
+                        << std::defaultfloat << std::endl;
+              regressions++;
+            }
+        }
+    }
+  std::cerr << regressions << " regressions against the baseline"
+            << std::endl;
+  return regressions;
+}
+
+int main (int argc, char **argv)
+{
+  bool json = false;
+  std::string filter, baseline_path;
+  int only_batch = 0;
+  double min_time = DEFAULT_MIN_TIME;
+  double tolerance = DEFAULT_TOLERANCE;
+  bool valid = true;
+  for (int i = 1; i < argc && valid; i++)
+    {
+      std::string option = argv[i];
+      bool has_value = i + 1 < argc;
+      if (option == "--json")
+        {
+          json = true;
+        }
+      else if (!has_value)
+        {
+          valid = false;
+        }
+      else if (option == "--filter")
+        {
+          filter = argv[++i];
+        }
+      else if (option == "--batch")
+        {
+          only_batch = std::atoi (argv[++i]);
+          valid = only_batch > 0;
+        }
+      else if (option == "--min-time")
+        {
+          min_time = std::atof (argv[++i]);
+        }
+      else if (option == "--baseline")
+        {
+          baseline_path = argv[++i];
+        }
+      else if (option == "--tolerance")
+        {
+          tolerance = std::atof (argv[++i]);
+        }
+      else
+        {
+          valid = false;
+        }
+    }
+  if (!valid || min_time < 0 || tolerance < 0)
+    {
+      std::cout << USAGE_MSG << std::endl;
+      return EXIT_FAILURE;
+    }
+  std::vector<BenchResult> baseline;
+  if (!baseline_path.empty () && !read_baseline (baseline_path, baseline))
+    {
+      std::cerr << ERROR_BASELINE << baseline_path << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  // the default topology, on random parameters.
+  std::mt19937 gen (0);
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  for (int l = 0; l < MLP_SIZE; l++)
+    {
+      weights[l] = random_matrix (gen, weights_dims[l].rows,
+                                  weights_dims[l].cols);
+      biases[l] = random_matrix (gen, bias_dims[l].rows, bias_dims[l].cols);
+    }
+  MlpNetwork mlp (weights, biases,
+                  Dense::layout_from_environment (AUTO));
+
+  std::vector<int> batches;
+  for (int batch = 1; batch <= MAX_BATCH; batch *= 2)
+    {
+      batches.push_back (batch);
+    }
+  if (only_batch > 0)
+    {
+      batches.assign (1, only_batch);
+    }
+  std::vector<BenchResult> results;
+  for (int batch : batches)
+    {
+      std::vector<BenchCase> cases;
+      matrix_cases (gen, batch, cases);
+      activation_cases (gen, batch, cases);
+      network_cases (gen, mlp, batch, cases);
+      for (const auto &bench : cases)
+        {
+          if (bench.name.find (filter) != std::string::npos)
+            {
+              results.push_back (measure (bench, min_time));
+            }
+        }
+    }
+  if (json)
+    {
+      print_json (results);
+    }
+  else
+    {
+      print_table (results);
+    }
+  if (!baseline.empty () && compare (results, baseline, tolerance) > 0)
+    {
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,273 @@
+// benchmark.cpp
+// Compares the blocked gemm kernel with the naive triple loop it replaced,
+// on the layer shapes of the network, and the compile time specialized
+// network with the dynamic one on single image inference, and measures
+// the batching scheduler under concurrent single image requests.
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include <random>
+#include <vector>
+#include "Gemm.h"
+#include "Simd.h"
+#include "MlpNetwork.h"
+#include "StaticMlp.h"
+#include "BatchScheduler.h"
+#include <future>
+#include <memory>
+#include <thread>
+
+#define MIN_SECONDS 0.2
+#define BATCH_SIZES {1, 64}
+// scheduler load: producer threads, requests each, and requests each keeps
+// in flight.
+#define PRODUCERS 4
+#define REQUESTS 4000
+#define IN_FLIGHT 32
+
+/**
+ * The loop Matrix::operator* used before the blocked kernel: i-j-l order,
+ * walking B down a column in the inner loop.
+ */
+static void naive_gemm (int m, int n, int k, const float *a, const float *b,
+                        float *c)
+{
+  for (int i = 0; i < m; i++)
+    {
+      for (int j = 0; j < n; j++)
+        {
+          float sum = 0;
+          for (int l = 0; l < k; l++)
+            {
+              sum += a[i * k + l] * b[l * n + j];
+            }
+          c[i * n + j] = sum;
+        }
+    }
+}
+
+/**
+ * Runs f repeatedly for at least MIN_SECONDS.
+ * @return average nanoseconds per call
+ */
+template<typename F>
+static double time_ns (F f)
+{
+  using clock = std::chrono::steady_clock;
+  f (); // warm up caches and packing buffers
+  long iters = 0;
+  auto start = clock::now ();
+  double elapsed = 0;
+  do
+    {
+      f ();
+      iters++;
+      elapsed = std::chrono::duration<double> (clock::now () - start).count ();
+    }
+  while (elapsed < MIN_SECONDS);
+  return elapsed * 1e9 / iters;
+}
+
+/**
+ * Fills the parameters of the default topology with random values.
+ */
+static void random_parameters (std::mt19937 &gen, Matrix weights[],
+                               Matrix biases[])
+{
+  std::normal_distribution<float> normal (0, 0.1f);
+  for (int l = 0; l < MLP_SIZE; l++)
+    {
+      weights[l] = Matrix (weights_dims[l].rows, weights_dims[l].cols);
+      biases[l] = Matrix (bias_dims[l].rows, bias_dims[l].cols);
+      for (int i = 0; i < weights_dims[l].rows * weights_dims[l].cols; i++)
+        {
+          weights[l][i] = normal (gen);
+        }
+    }
+}
+
+/**
+ * Times single image inference of the default topology, dynamic MlpNetwork
+ * against DefaultStaticMlp, on random parameters.
+ */
+static void static_vs_dynamic (std::mt19937 &gen)
+{
+  std::normal_distribution<float> normal (0, 0.1f);
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  random_parameters (gen, weights, biases);
+  MlpNetwork mlp (weights, biases);
+  std::unique_ptr<DefaultStaticMlp> fixed (new DefaultStaticMlp (mlp));
+  MlpWorkspace workspace (mlp);
+  Matrix image (img_dims.rows, img_dims.cols);
+  for (int i = 0; i < img_dims.rows * img_dims.cols; i++)
+    {
+      image[i] = std::abs (normal (gen));
+    }
+
+  digit dynamic_result{}, static_result{};
+  double dynamic_ns = time_ns ([&] ()
+                               {
+                                 dynamic_result = mlp.forward (image,
+                                                               workspace);
+                               });
+  double static_ns = time_ns ([&] ()
+                              {
+                                static_result = (*fixed) (image.data ());
+                              });
+  std::cout << std::endl << std::setw (12) << "network" << std::setw (14)
+            << "dynamic ns" << std::setw (14) << "static ns" << std::setw (10)
+            << "speedup" << std::setw (12) << "same digit" << std::setw (12)
+            << "prob diff" << std::endl;
+  std::cout << std::setw (12) << "784-...-10" << std::fixed
+            << std::setprecision (0) << std::setw (14) << dynamic_ns
+            << std::setw (14) << static_ns << std::setprecision (2)
+            << std::setw (10) << dynamic_ns / static_ns << std::setw (12)
+            << (dynamic_result.value == static_result.value ? "yes" : "no")
+            << std::scientific << std::setw (12)
+            << std::abs (dynamic_result.probability
+                         - static_result.probability)
+            << std::defaultfloat << std::endl;
+}
+
+/**
+ * Prints the non empty buckets of a histogram.
+ */
+static void print_histogram (const char *name, const Histogram &histogram)
+{
+  std::cout << std::setw (14) << name;
+  for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+    {
+      if (histogram.bucket (i) > 0)
+        {
+          std::cout << "  " << Histogram::lower_bound (i) << "+:"
+                    << histogram.bucket (i);
+        }
+    }
+  std::cout << std::endl;
+}
+
+/**
+ * Runs the default topology behind a BatchScheduler: every producer
+ * submits its requests keeping IN_FLIGHT of them outstanding. Prints the
+ * throughput, the latencies and the batching histograms.
+ */
+static void scheduler_load (std::mt19937 &gen)
+{
+  Matrix weights[MLP_SIZE];
+  Matrix biases[MLP_SIZE];
+  random_parameters (gen, weights, biases);
+  MlpNetwork mlp (weights, biases);
+  Matrix image (img_dims.rows, img_dims.cols);
+  for (int i = 0; i < img_dims.rows * img_dims.cols; i++)
+    {
+      image[i] = (float) (i % img_dims.cols) / img_dims.cols;
+    }
+  digit expected = mlp (image);
+
+  BatchScheduler scheduler (mlp, SchedulerConfig{SCHED_MAX_BATCH,
+                                                 SCHED_MAX_WAIT_US,
+                                                 SCHED_P99_US});
+  std::atomic<long> wrong (0);
+  auto start = std::chrono::steady_clock::now ();
+  std::vector<std::thread> producers;
+  for (int p = 0; p < PRODUCERS; p++)
+    {
+      producers.emplace_back ([&] ()
+                              {
+                                std::vector<std::future<digit>> futures;
+                                for (int r = 0; r < REQUESTS; r++)
+                                  {
+                                    if (futures.size () == IN_FLIGHT)
+                                      {
+                                        wrong += futures[r % IN_FLIGHT].get ()
+                                                     .value != expected.value;
+                                        futures[r % IN_FLIGHT] =
+                                            scheduler.submit (image.data ());
+                                        continue;
+                                      }
+                                    futures.push_back (
+                                        scheduler.submit (image.data ()));
+                                  }
+                                for (auto &future : futures)
+                                  {
+                                    wrong += future.get ().value
+                                             != expected.value;
+                                  }
+                              });
+    }
+  for (auto &producer : producers)
+    {
+      producer.join ();
+    }
+  double seconds = std::chrono::duration<double> (
+      std::chrono::steady_clock::now () - start).count ();
+  const Histogram &latencies = scheduler.latencies ();
+  std::cout << std::endl << "scheduler: " << PRODUCERS << " producers, "
+            << latencies.count () << " requests, " << std::fixed
+            << std::setprecision (0) << latencies.count () / seconds
+            << " requests/sec, " << wrong << " wrong" << std::endl;
+  std::cout << "latency us: p50 <= " << latencies.percentile (0.5)
+            << ", p99 <= " << latencies.percentile (0.99)
+            << ", last window p99 " << scheduler.p99_us () << " (target "
+            << SCHED_P99_US << "), batch size " << scheduler.batch_size ()
+            << std::defaultfloat << std::endl;
+  print_histogram ("queue depth", scheduler.queue_depths ());
+  print_histogram ("batch size", scheduler.batch_sizes ());
+}
+
+int main ()
+{
+  std::mt19937 gen (0);
+  std::uniform_real_distribution<float> dist (-1, 1);
+  std::cout << "simd: " << simd ().name << std::endl;
+  std::cout << std::setw (12) << "shape" << std::setw (7) << "batch"
+            << std::setw (14) << "naive ns" << std::setw (14) << "gemm ns"
+            << std::setw (10) << "speedup" << std::setw (12) << "GFLOP/s"
+            << std::setw (12) << "max diff" << std::endl;
+  for (const auto &dims : weights_dims)
+    {
+      for (int n : BATCH_SIZES)
+        {
+          int m = dims.rows;
+          int k = dims.cols;
+          std::vector<float> a (m * k), b (k * n), c1 (m * n), c2 (m * n);
+          for (auto &v : a)
+            {
+              v = dist (gen);
+            }
+          for (auto &v : b)
+            {
+              v = dist (gen);
+            }
+          double naive = time_ns ([&] ()
+                                  {
+                                    naive_gemm (m, n, k, a.data (), b.data (),
+                                                c1.data ());
+                                  });
+          double fast = time_ns ([&] ()
+                                 {
+                                   gemm (m, n, k, a.data (), k, b.data (), n,
+                                         c2.data (), n);
+                                 });
+          float diff = 0;
+          for (int i = 0; i < m * n; i++)
+            {
+              diff = std::max (diff, std::abs (c1[i] - c2[i]));
+            }
+          std::cout << std::setw (12)
+                    << (std::to_string (m) + "x" + std::to_string (k))
+                    << std::setw (7) << n << std::fixed
+                    << std::setprecision (0) << std::setw (14) << naive
+                    << std::setw (14) << fast << std::setprecision (2)
+                    << std::setw (10) << naive / fast << std::setw (12)
+                    << 2.0 * m * n * k / fast << std::scientific
+                    << std::setw (12) << diff << std::defaultfloat
+                    << std::endl;
+        }
+    }
+  static_vs_dynamic (gen);
+  scheduler_load (gen);
+  return EXIT_SUCCESS;
+}
@@ -4,22 +4,79 @@
 #include "Activation.h"
 #include "Dense.h"
 #include "MlpNetwork.h"
+#include "BatchClassifier.h"
+#include "ModelFile.h"
+#include "IdxReader.h"
+#include "QuantizedMlp.h"
+#include "InferenceServer.h"
+#include "Preprocess.h"
+#include "Simd.h"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iomanip>
+#include <memory>
 
 #define QUIT "q"
 #define INSERT_IMAGE_PATH "Please insert image path:"
 #define ERROR_INAVLID_PARAMETER "Error: invalid Parameters file for layer: "
 #define ERROR_INVALID_INPUT "Error: Failed to retrieve input. Exiting.."
 #define ERROR_INVALID_IMG "Error: invalid image path or size: "
+#define ERROR_INVALID_MODEL "Error: model does not match the network: "
+#define ERROR_PACK "Error: failed to write model file: "
+#define ERROR_HALF "Error: failed to write half parameters file: "
 #define USAGE_MSG "Usage:\n" \
-                  "\t./mlpnetwork w1 w2 w3 w4 b1 b2 b3 b4\n" \
+                  "\t./mlpnetwork w1 w2 w3 w4 b1 b2 b3 b4 [mode]\n" \
+                  "\t./mlpnetwork --model model.mlpm [mode]\n" \
                   "\twi - the i'th layer's weights\n" \
-                  "\tbi - the i'th layer's biases"
+                  "\tbi - the i'th layer's biases\n" \
+                  "\tmodel.mlpm - packed model file, mapped without copies, " \
+                  "of any topology\n" \
+                  "\tmode - interactive when omitted, or one of:\n" \
+                  "\t  --batch path... - classify image files and " \
+                  "directories on all cores\n" \
+                  "\t  --pgm [--center] [--invert] path... - classify PGM " \
+                  "files and directories of any size, preprocessed on a " \
+                  "thread of their own; --center fits the digit in 20x20 " \
+                  "centered by mass, --invert takes dark digits on light " \
+                  "backgrounds\n" \
+                  "\t  --pack model.mlpm - write the parameters as one " \
+                  "packed model file\n" \
+                  "\t  --half fp16|bf16 dir - write the parameters to dir " \
+                  "with fp16 or bf16 weights, which load in the matching " \
+                  "half layout\n" \
+                  "\t  --eval images labels - accuracy, confusion matrix " \
+                  "and throughput over IDX (MNIST ubyte) files\n" \
+                  "\t  --quant-eval images labels - accuracy and speed of " \
+                  "int8 inference against fp32\n" \
+                  "\t  --serve socket [budget_us [max_batch]] - answer " \
+                  "requests on a Unix socket until SIGINT or SIGTERM, " \
+                  "batching them for at most budget_us (default 1000) " \
+                  "up to max_batch images (default 64)"
+#define BATCH_MODE "--batch"
+#define PGM_MODE "--pgm"
+#define CENTER_OPTION "--center"
+#define INVERT_OPTION "--invert"
+#define PACK_MODE "--pack"
+#define HALF_MODE "--half"
+#define EVAL_MODE "--eval"
+#define QUANT_EVAL_MODE "--quant-eval"
+#define SERVE_MODE "--serve"
+#define QUANT_VARIANTS 3
+#define MODEL_OPTION "--model"
+#define MODEL_ARGS_COUNT 3
+// a half weights file is its tag, then the weights' 16 bit patterns.
+#define HALF_TAG_SIZE 4
+#define FP16_TAG "FP16"
+#define BF16_TAG "BF16"
 
 
 #define ARGS_START_IDX 1
 #define ARGS_COUNT (ARGS_START_IDX + (MLP_SIZE * 2))
 #define WEIGHTS_START_IDX ARGS_START_IDX
 #define BIAS_START_IDX (ARGS_START_IDX + MLP_SIZE)
+#define MODEL_PATH_IDX 2
 
 
 
@@ -66,32 +123,179 @@ bool readFileToMatrix(const std::string &filePath, Matrix &mat)
 }
 
 /**
- * Loads MLP parameters from weights & biases paths
- * to Weights[] and Biases[].
+ * Reads a half weights file, HALF_TAG_SIZE tag bytes then 2 bytes per
+ * element, keeping the elements' bits as they are.
+ * @param filePath - path of the file to read
+ * @param bits - set to the elements, its size must match the file
+ * @param layout - set to HALF_FP16 or HALF_BF16 by the file's tag
+ * @return boolean status
+ *          true - success
+ *          false - failure, also when the file is no half weights file
+ */
+bool readHalfFile(const std::string &filePath, std::vector<uint16_t> &bits,
+                  WeightLayout &layout)
+{
+    std::ifstream is;
+    is.open(filePath, std::ios::in | std::ios::binary | std::ios::ate);
+    long int elements = (long int) bits.size();
+    if(!is.is_open() ||
+       is.tellg() != (long int) (HALF_TAG_SIZE + elements * sizeof(uint16_t)))
+    {
+        return false;
+    }
+    char tag[HALF_TAG_SIZE];
+    is.seekg(0, std::ios_base::beg);
+    is.read(tag, HALF_TAG_SIZE);
+    is.read((char *) bits.data(), elements * sizeof(uint16_t));
+    if(!is)
+    {
+        return false;
+    }
+    if(std::memcmp(tag, FP16_TAG, HALF_TAG_SIZE) == 0)
+    {
+        layout = HALF_FP16;
+        return true;
+    }
+    if(std::memcmp(tag, BF16_TAG, HALF_TAG_SIZE) == 0)
+    {
+        layout = HALF_BF16;
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Loads MLP parameters from weights & biases paths into the layers of the
+ * default topology. Weights files may be fp32 or half (as --half writes
+ * them), half ones stay half: no fp32 copy of them is made.
  * Exits (code == 1) upon failures.
  * @param paths array of programs arguments, expected to be mlp parameters
  *        path.
- * @param weights array of matrix, weigths[i] is the i'th layer weights matrix
- * @param biases array of matrix, biases[i] is the i'th layer bias matrix
- *          (which is actually a vector)
+ * @param layout the layers' weight layout, AUTO keeps half weights in
+ *        their file's half layout
+ * @param layers set to the MLP_SIZE layers
  */
-void loadParameters(char *paths[ARGS_COUNT], Matrix weights[MLP_SIZE],
-    Matrix biases[MLP_SIZE])
+void loadParameters(char *paths[ARGS_COUNT], WeightLayout layout,
+                    std::vector<Dense> &layers)
 {
+    layers.clear();
+    layers.reserve(MLP_SIZE);
     for(int i = 0; i < MLP_SIZE; i++)
     {
-        weights[i] = Matrix(weights_dims[i].rows, weights_dims[i].cols);
-        biases[i] = Matrix(bias_dims[i].rows, bias_dims[i].cols);
+        int rows = weights_dims[i].rows;
+        int cols = weights_dims[i].cols;
+        // read_binary_file fills them or exits, no need to zero them.
+        Matrix bias(bias_dims[i].rows, bias_dims[i].cols, NO_FILL);
 
         std::string weightsPath(paths[WEIGHTS_START_IDX + i]);
         std::string biasPath(paths[BIAS_START_IDX + i]);
 
-        if(!(readFileToMatrix(weightsPath, weights[i]) &&
-           readFileToMatrix(biasPath, biases[i])))
+        if(!readFileToMatrix(biasPath, bias))
         {
             std::cerr << ERROR_INAVLID_PARAMETER << (i + 1) << std::endl;
             exit(EXIT_FAILURE);
         }
+        std::vector<uint16_t> bits((size_t) rows * cols);
+        WeightLayout format = AUTO;
+        if(readHalfFile(weightsPath, bits, format))
+        {
+            layers.emplace_back(std::move(bits), format, rows, cols, bias,
+                                default_activations[i], layout);
+            continue;
+        }
+        Matrix weights(rows, cols, NO_FILL);
+        if(!readFileToMatrix(weightsPath, weights))
+        {
+            std::cerr << ERROR_INAVLID_PARAMETER << (i + 1) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        layers.emplace_back(weights, bias, default_activations[i], layout);
+    }
+}
+
+/**
+ * Points the MLP parameters at the layers of a mapped model file, which
+ * also gives the network's topology.
+ * Exits (code == 1) if the model's layers do not form a network.
+ * @param model the mapped model file, must outlive the matrices
+ * @param path the model file path, for the error message
+ * @param weights set to the layers' weights views
+ * @param biases set to the layers' bias views
+ * @param activations set to the layers' activations
+ */
+void loadModel(const MappedModel &model, const std::string &path,
+               std::vector<Matrix> &weights, std::vector<Matrix> &biases,
+               std::vector<ActivationType> &activations)
+{
+    weights.clear();
+    biases.clear();
+    activations.clear();
+    for(int i = 0; i < model.layers(); i++)
+    {
+        weights.push_back(model.weights(i));
+        biases.push_back(model.bias(i));
+        activations.push_back(model.activation(i));
+    }
+    if(!MlpNetwork::is_valid(weights.data(), biases.data(), model.layers()))
+    {
+        std::cerr << ERROR_INVALID_MODEL << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Writes the MLP parameters as one packed model file, with the default
+ * topology's activations.
+ * Exits (code == 1) if the file cannot be written.
+ * @param path the model file to write
+ * @param weights array of matrix, weigths[i] is the i'th layer weights matrix
+ * @param biases array of matrix, biases[i] is the i'th layer bias matrix
+ */
+void packCli(const std::string &path, Matrix weights[MLP_SIZE],
+             Matrix biases[MLP_SIZE])
+{
+    if(!MappedModel::write(path, weights, biases, default_activations,
+                           MLP_SIZE))
+    {
+        std::cerr << ERROR_PACK << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+/**
+ * Writes the MLP parameters to a directory, the weights rounded to fp16 or
+ * bf16 (half the bytes), the biases as they are, named w1..wN and b1..bN.
+ * Exits (code == 1) if a file cannot be written.
+ * @param format "fp16" or "bf16"
+ * @param dir the existing directory to write to
+ * @param weights array of matrix, weigths[i] is the i'th layer weights matrix
+ * @param biases array of matrix, biases[i] is the i'th layer bias matrix
+ */
+void halfCli(const std::string &format, const std::string &dir,
+             Matrix weights[MLP_SIZE], Matrix biases[MLP_SIZE])
+{
+    const SimdKernels &kernels = simd();
+    for(int i = 0; i < MLP_SIZE; i++)
+    {
+        int elements = weights[i].get_rows() * weights[i].get_cols();
+        std::vector<uint16_t> bits(elements);
+        (format == "fp16" ? kernels.fp32_to_fp16 : kernels.fp32_to_bf16)(
+            weights[i].data(), bits.data(), elements);
+        std::string weightsPath = dir + "/w" + std::to_string(i + 1);
+        std::string biasPath = dir + "/b" + std::to_string(i + 1);
+        std::ofstream ws(weightsPath, std::ios::out | std::ios::binary);
+        ws.write(format == "fp16" ? FP16_TAG : BF16_TAG, HALF_TAG_SIZE);
+        ws.write((const char *) bits.data(), elements * sizeof(uint16_t));
+        std::ofstream bs(biasPath, std::ios::out | std::ios::binary);
+        bs.write((const char *) biases[i].data(),
+                 (long) biases[i].get_rows() * biases[i].get_cols() *
+                 sizeof(float));
+        if(!ws || !bs)
+        {
+            std::cerr << ERROR_HALF << (ws ? biasPath : weightsPath) <<
+                      std::endl;
+            exit(EXIT_FAILURE);
+        }
     }
 }
 
@@ -120,10 +324,10 @@ void mlpCli(MlpNetwork &mlp)
 
     while(imgPath != QUIT)
     {
-        if(readFileToMatrix(imgPath, img))
+        if(read_image(imgPath, img.data()))
         {
-            Matrix imgVec = img;
-            digit output = mlp(imgVec.vectorize());
+            // the network reads the 28x28 image in place, no vector copy.
+            digit output = mlp.forward(img);
             std::cout << "Image processed:" << std::endl
                       << img << std::endl;
             std::cout << "Mlp result: " << output.value <<
@@ -144,6 +348,281 @@ void mlpCli(MlpNetwork &mlp)
     }
 }
 
+/**
+ * Classifies a list of image files and directories on all cores, prints
+ * one line per image in input order, then the throughput.
+ * @param mlp MlpNetwork to use in order to predict the images.
+ * @param count number of paths
+ * @param paths image files and directories of image files
+ */
+void batchCli(const MlpNetwork &mlp, int count, char **paths)
+{
+    std::vector<std::string> files =
+        BatchClassifier::expand(std::vector<std::string>(paths,
+                                                         paths + count));
+    BatchClassifier classifier(mlp);
+    std::vector<ImageResult> results = classifier.classify(files);
+    for(size_t i = 0; i < files.size(); i++)
+    {
+        if(results[i].ok)
+        {
+            std::cout << files[i] << ": " << results[i].result.value <<
+                      " at probability: " << results[i].result.probability
+                      << std::endl;
+        }
+        else
+        {
+            std::cout << ERROR_INVALID_IMG << files[i] << std::endl;
+        }
+    }
+    std::cout << "Processed " << files.size() << " images on " <<
+              classifier.threads() << " threads: " <<
+              classifier.images_per_second() << " images/sec" << std::endl;
+}
+
+/**
+ * Classifies PGM files and directories of them: a pipeline thread reads
+ * and preprocesses the next chunks while this one runs the network on the
+ * current chunk. Prints one line per image in input order, then the
+ * throughput and how long inference waited for preprocessing.
+ * Exits (code == 1) if no path follows the options.
+ * @param mlp MlpNetwork to use in order to predict the images.
+ * @param count number of arguments
+ * @param args the options, then the image files and directories
+ */
+void pgmCli(const MlpNetwork &mlp, int count, char **args)
+{
+    PreprocessOptions options = {false, false};
+    int first = 0;
+    for(; first < count && args[first][0] == '-'; first++)
+    {
+        std::string option = args[first];
+        if(option != CENTER_OPTION && option != INVERT_OPTION)
+        {
+            break;
+        }
+        options.center |= option == CENTER_OPTION;
+        options.invert |= option == INVERT_OPTION;
+    }
+    if(first == count)
+    {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    std::vector<std::string> files =
+        BatchClassifier::expand(std::vector<std::string>(args + first,
+                                                         args + count));
+    auto start = std::chrono::steady_clock::now();
+    PreprocessPipeline pipeline(files, options);
+    size_t done = 0;
+    for(int n = pipeline.next(); n > 0; n = pipeline.next())
+    {
+        std::vector<digit> results = mlp.classify_batch(pipeline.images());
+        for(int i = 0; i < n; i++, done++)
+        {
+            if(pipeline.valid(i))
+            {
+                std::cout << files[done] << ": " << results[i].value <<
+                          " at probability: " << results[i].probability <<
+                          std::endl;
+            }
+            else
+            {
+                std::cout << ERROR_INVALID_IMG << files[done] << std::endl;
+            }
+        }
+    }
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    std::cout << "Processed " << files.size() << " images: " <<
+              (seconds > 0 ? files.size() / seconds : 0) <<
+              " images/sec, waited " << pipeline.waited() <<
+              " s for preprocessing" << std::endl;
+}
+
+/**
+ * Classifies a whole IDX data set chunk by chunk, then prints the accuracy,
+ * the confusion matrix (rows are labels, columns are predictions) and the
+ * throughput, file decoding included.
+ * Exits (code == 1) if the files are invalid.
+ * @param mlp MlpNetwork to use in order to predict the images.
+ * @param imagesPath IDX3 ubyte images file
+ * @param labelsPath IDX1 ubyte labels file
+ */
+void evalCli(const MlpNetwork &mlp, const std::string &imagesPath,
+             const std::string &labelsPath)
+{
+    IdxReader reader(imagesPath, labelsPath);
+    if(reader.image_size() != img_dims.rows * img_dims.cols)
+    {
+        std::cerr << ERROR_IDX_SIZE << imagesPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    long confusion[TEN][TEN] = {};
+    long correct = 0;
+    auto start = std::chrono::steady_clock::now();
+    for(int count = reader.next(); count > 0; count = reader.next())
+    {
+        std::vector<digit> results = mlp.classify_batch(reader.images());
+        for(int i = 0; i < count; i++)
+        {
+            unsigned int label = reader.labels()[i] % TEN;
+            confusion[label][results[i].value]++;
+            correct += label == results[i].value;
+        }
+    }
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+
+    int total = reader.size();
+    std::cout << "Evaluated " << total << " images in " << seconds << " s: "
+              << (seconds > 0 ? total / seconds : 0) << " images/sec"
+              << std::endl;
+    std::cout << "Accuracy: " << (total > 0 ? 100.0 * correct / total : 0)
+              << "% (" << correct << "/" << total << ")" << std::endl;
+    std::cout << "Confusion matrix (rows: label, cols: prediction):"
+              << std::endl << "   ";
+    for(int j = 0; j < TEN; j++)
+    {
+        std::cout << std::setw(6) << j;
+    }
+    std::cout << std::endl;
+    for(int i = 0; i < TEN; i++)
+    {
+        std::cout << std::setw(3) << i;
+        for(int j = 0; j < TEN; j++)
+        {
+            std::cout << std::setw(6) << confusion[i][j];
+        }
+        std::cout << std::endl;
+    }
+}
+
+/**
+ * Compares int8 inference (dynamic and calibrated activation ranges) with
+ * the fp32 network over an IDX data set. The calibrated variant uses the
+ * first chunk of the data set as calibration images.
+ * Prints each variant's accuracy, its delta from fp32, how often it agrees
+ * with fp32, its throughput and its weights size.
+ * Exits (code == 1) if the files are invalid.
+ * @param mlp the fp32 MlpNetwork.
+ * @param imagesPath IDX3 ubyte images file
+ * @param labelsPath IDX1 ubyte labels file
+ */
+void quantEvalCli(const MlpNetwork &mlp, const std::string &imagesPath,
+                  const std::string &labelsPath)
+{
+    IdxReader reader(imagesPath, labelsPath);
+    if(reader.image_size() != img_dims.rows * img_dims.cols)
+    {
+        std::cerr << ERROR_IDX_SIZE << imagesPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    QuantizedMlp dynamic(mlp);
+    QuantizedMlp calibrated(mlp);
+    const char *names[QUANT_VARIANTS] = {"fp32", "int8 dynamic",
+                                         "int8 calibrated"};
+    long correct[QUANT_VARIANTS] = {};
+    long agree[QUANT_VARIANTS] = {};
+    double seconds[QUANT_VARIANTS] = {};
+    for(int count = reader.next(); count > 0; count = reader.next())
+    {
+        if(!calibrated.is_calibrated())
+        {
+            calibrated.calibrate(mlp, reader.images());
+        }
+        std::vector<digit> results[QUANT_VARIANTS];
+        for(int v = 0; v < QUANT_VARIANTS; v++)
+        {
+            auto start = std::chrono::steady_clock::now();
+            results[v] = v == 0 ? mlp.classify_batch(reader.images()) :
+                         v == 1 ? dynamic.classify_batch(reader.images()) :
+                         calibrated.classify_batch(reader.images());
+            seconds[v] += std::chrono::duration<double>(
+                std::chrono::steady_clock::now() - start).count();
+        }
+        for(int i = 0; i < count; i++)
+        {
+            unsigned int label = reader.labels()[i] % TEN;
+            for(int v = 0; v < QUANT_VARIANTS; v++)
+            {
+                correct[v] += results[v][i].value == label;
+                agree[v] += results[v][i].value == results[0][i].value;
+            }
+        }
+    }
+
+    int total = reader.size() > 0 ? reader.size() : 1;
+    size_t fp32_bytes = 0;
+    for(int i = 0; i < mlp.get_depth(); i++)
+    {
+        const Dense &layer = mlp.get_layer(i);
+        fp32_bytes += (size_t) layer.get_rows() * layer.get_cols() *
+                      sizeof(float);
+    }
+    std::cout << std::left << std::setw(18) << "variant" << std::right
+              << std::setw(12) << "accuracy %" << std::setw(12) << "delta %"
+              << std::setw(12) << "agree %" << std::setw(14) << "images/sec"
+              << std::setw(14) << "weight bytes" << std::endl;
+    for(int v = 0; v < QUANT_VARIANTS; v++)
+    {
+        double accuracy = 100.0 * correct[v] / total;
+        std::cout << std::left << std::setw(18) << names[v] << std::right
+                  << std::fixed << std::setprecision(2) << std::setw(12)
+                  << accuracy << std::setw(12)
+                  << accuracy - 100.0 * correct[0] / total << std::setw(12)
+                  << 100.0 * agree[v] / total << std::setprecision(0)
+                  << std::setw(14) << (seconds[v] > 0 ?
+                                       reader.size() / seconds[v] : 0)
+                  << std::setw(14) << (v == 0 ? fp32_bytes :
+                                       dynamic.weights_bytes())
+                  << std::endl;
+    }
+}
+
+// the running server, stopped by SIGINT and SIGTERM.
+static InferenceServer *server = nullptr;
+
+/**
+ * Signal handler, makes the running server return.
+ */
+static void stopServer(int)
+{
+    if(server != nullptr)
+    {
+        server->stop();
+    }
+}
+
+/**
+ * Serves requests on a Unix socket until SIGINT or SIGTERM, then prints
+ * how many requests were answered in how many batches.
+ * Exits (code == 1) if the budget or the batch size is invalid.
+ * @param mlp MlpNetwork to use in order to predict the images.
+ * @param count number of arguments
+ * @param args the socket path, then optionally the latency budget in
+ *        microseconds and the largest batch
+ */
+void serveCli(const MlpNetwork &mlp, int count, char **args)
+{
+    long budget = count > 1 ? std::atol(args[1]) : SERVE_BUDGET_US;
+    int max_batch = count > 2 ? std::atoi(args[2]) : SERVE_MAX_BATCH;
+    if(budget < 0 || max_batch <= 0)
+    {
+        usage();
+        exit(EXIT_FAILURE);
+    }
+    InferenceServer instance(mlp, args[0], budget, max_batch);
+    server = &instance;
+    std::signal(SIGINT, stopServer);
+    std::signal(SIGTERM, stopServer);
+    std::cout << "Serving on " << args[0] << std::endl;
+    instance.run();
+    server = nullptr;
+    std::cout << "Answered " << instance.requests() << " requests in " <<
+              instance.batches() << " batches" << std::endl;
+}
+
 /**
  * Program's main
  * @param argc count of args
@@ -152,17 +631,97 @@ void mlpCli(MlpNetwork &mlp)
  */
 int main(int argc, char **argv)
 {
-    if(argc != ARGS_COUNT)
+    bool from_model = argc >= MODEL_ARGS_COUNT &&
+                      std::string(argv[ARGS_START_IDX]) == MODEL_OPTION;
+    int mode_idx = from_model ? MODEL_ARGS_COUNT : ARGS_COUNT;
+    std::string mode = argc > mode_idx ? argv[mode_idx] : "";
+    int mode_args = argc - mode_idx - 1;
+    bool valid = argc >= mode_idx &&
+                 (mode.empty() || (mode == BATCH_MODE && mode_args > 0) ||
+                  (mode == PGM_MODE && mode_args > 0) ||
+                  (mode == PACK_MODE && mode_args == 1 && !from_model) ||
+                  (mode == HALF_MODE && mode_args == 2 && !from_model &&
+                   (std::string(argv[mode_idx + 1]) == "fp16" ||
+                    std::string(argv[mode_idx + 1]) == "bf16")) ||
+                  ((mode == EVAL_MODE || mode == QUANT_EVAL_MODE) &&
+                   mode_args == 2) ||
+                  (mode == SERVE_MODE && mode_args >= 1 && mode_args <= 3));
+    if(!valid)
     {
         usage();
         exit(EXIT_FAILURE);
     }
 
-    Matrix weights[MLP_SIZE];
-    Matrix biases[MLP_SIZE];
-    loadParameters(argv, weights, biases);
+    std::vector<Matrix> weights(MLP_SIZE);
+    std::vector<Matrix> biases(MLP_SIZE);
+    std::vector<ActivationType> activations(default_activations,
+                                            default_activations + MLP_SIZE);
+    std::vector<Dense> layers; // the parameters files' layers
+    std::unique_ptr<MappedModel> model; // the views below point into it
+    // AUTO keeps half files' weights half, and sparse ones sparse.
+    WeightLayout layout = Dense::layout_from_environment(AUTO);
+    if(from_model)
+    {
+        model.reset(new MappedModel(argv[MODEL_PATH_IDX]));
+        loadModel(*model, argv[MODEL_PATH_IDX], weights, biases, activations);
+    }
+    else
+    {
+        loadParameters(argv, layout, layers);
+    }
+    if(mode == PACK_MODE || mode == HALF_MODE)
+    {
+        // the layers' parameters in fp32, half weights widened.
+        for(int i = 0; i < MLP_SIZE; i++)
+        {
+            Matrix widened;
+            MatrixView w = layers[i].get_weights(widened);
+            weights[i] = Matrix(w.get_rows(), w.get_cols(), NO_FILL);
+            std::copy(w.data(), w.data() + (long) w.get_rows() * w.get_cols(),
+                      weights[i].data());
+            biases[i] = layers[i].get_bias();
+        }
+    }
+    if(mode == PACK_MODE)
+    {
+        packCli(argv[mode_idx + 1], weights.data(), biases.data());
+        return EXIT_SUCCESS;
+    }
+    if(mode == HALF_MODE)
+    {
+        halfCli(argv[mode_idx + 1], argv[mode_idx + 2], weights.data(),
+                biases.data());
+        return EXIT_SUCCESS;
+    }
 
-    MlpNetwork mlp(weights, biases);
-    mlpCli(mlp);
+    MlpNetwork mlp = from_model ?
+                     MlpNetwork(weights.data(), biases.data(),
+                                activations.data(), (int) weights.size(),
+                                layout) :
+                     MlpNetwork(std::move(layers));
+    if(mode == BATCH_MODE)
+    {
+        batchCli(mlp, mode_args, argv + mode_idx + 1);
+    }
+    else if(mode == PGM_MODE)
+    {
+        pgmCli(mlp, mode_args, argv + mode_idx + 1);
+    }
+    else if(mode == EVAL_MODE)
+    {
+        evalCli(mlp, argv[mode_idx + 1], argv[mode_idx + 2]);
+    }
+    else if(mode == QUANT_EVAL_MODE)
+    {
+        quantEvalCli(mlp, argv[mode_idx + 1], argv[mode_idx + 2]);
+    }
+    else if(mode == SERVE_MODE)
+    {
+        serveCli(mlp, mode_args, argv + mode_idx + 1);
+    }
+    else
+    {
+        mlpCli(mlp);
+    }
     return EXIT_SUCCESS;
 }
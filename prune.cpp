@@ -0,0 +1,235 @@
+// prune.cpp
+// Magnitude prunes a packed model's weights and writes them sparse, and
+// reports what each sparsity level costs in accuracy and buys in latency.
+
+#include <chrono>
+#include <iostream>
+#include <iomanip>
+#include "IdxReader.h"
+#include "ModelFile.h"
+#include "MlpNetwork.h"
+
+#define USAGE_MSG "Usage:\n" \
+                  "\t./mlpprune model.mlpm out.mlpm [options]\n" \
+                  "\tmodel.mlpm - packed model to prune\n" \
+                  "\tout.mlpm - the pruned model, its hidden layers sparse\n" \
+                  "\toptions:\n" \
+                  "\t  --sparsity X - fraction of the weights of every " \
+                  "layer but the last to zero (default 0.9)\n" \
+                  "\t  --format csr|blocks - zero single weights (csr) or " \
+                  "1x8 blocks (default csr)\n" \
+                  "\t  --report images labels - print accuracy and " \
+                  "latency at several sparsity levels"
+#define ERROR_INVALID_MODEL "Error: model does not match the network: "
+#define ERROR_SAVE "Error: failed to write the model to: "
+#define DEFAULT_SPARSITY 0.9
+#define REPORT_SECONDS 0.2 // minimal time of every latency measurement
+
+// the sparsity levels of the report.
+static const double report_levels[] = {0, 0.5, 0.7, 0.8, 0.9, 0.95, 0.98};
+
+/**
+ * Zeroes the given fraction of the weights of every layer but the last,
+ * whose few outputs carry every class.
+ * @return the density of the pruned layers together
+ */
+static double prune_layers (std::vector<Matrix> &weights, double sparsity,
+                            SparseFormat format)
+{
+  double nonzeros = 0;
+  double elements = 0;
+  for (size_t l = 0; l + 1 < weights.size (); l++)
+    {
+      SparseMatrix::prune (weights[l], sparsity, format);
+      double size = (double) weights[l].get_rows () * weights[l].get_cols ();
+      nonzeros += SparseMatrix::density (weights[l]) * size;
+      elements += size;
+    }
+  return elements > 0 ? nonzeros / elements : 1;
+}
+
+/**
+ * @return mean microseconds of classifying one image, images one by one.
+ */
+static double single_latency (const MlpNetwork &mlp, MatrixView images)
+{
+  MlpWorkspace workspace (mlp);
+  auto start = std::chrono::steady_clock::now ();
+  double seconds = 0;
+  long calls = 0;
+  while (seconds < REPORT_SECONDS)
+    {
+      for (int i = 0; i < images.get_rows (); i++)
+        {
+          mlp.forward (MatrixView (images.row (i), images.get_cols (), 1),
+                       workspace);
+        }
+      calls += images.get_rows ();
+      seconds = std::chrono::duration<double> (
+          std::chrono::steady_clock::now () - start).count ();
+    }
+  return 1e6 * seconds / calls;
+}
+
+/**
+ * Classifies the whole set as one batch.
+ * @param micros - set to the mean microseconds per image
+ * @return percentage of images classified as their label
+ */
+static double batch_accuracy (const MlpNetwork &mlp, MatrixView images,
+                              const std::vector<unsigned char> &labels,
+                              double &micros)
+{
+  auto start = std::chrono::steady_clock::now ();
+  std::vector<digit> results = mlp.classify_batch (images);
+  micros = 1e6 * std::chrono::duration<double> (
+      std::chrono::steady_clock::now () - start).count () / results.size ();
+  long correct = 0;
+  for (size_t i = 0; i < results.size (); i++)
+    {
+      correct += labels[i] % TEN == results[i].value;
+    }
+  return 100.0 * correct / results.size ();
+}
+
+/**
+ * Prunes copies of the weights to every report level and prints the
+ * density, the single image and batch latency with dense (panel packed)
+ * and with sparse weights, and the accuracy.
+ */
+static void report (const std::vector<Matrix> &weights,
+                    const std::vector<Matrix> &biases,
+                    const std::vector<ActivationType> &activations,
+                    SparseFormat format, const std::string &images_path,
+                    const std::string &labels_path)
+{
+  Matrix images;
+  std::vector<unsigned char> labels;
+  load_set (images_path, labels_path, images, labels);
+  WeightLayout sparse_layout = format == CSR ? SPARSE_CSR : SPARSE_BLOCKS;
+
+  std::cout << std::setw (9) << "sparsity" << std::setw (9) << "density"
+            << std::setw (13) << "dense us/im" << std::setw (14)
+            << "sparse us/im" << std::setw (13) << "dense batch"
+            << std::setw (14) << "sparse batch" << std::setw (10)
+            << "accuracy" << std::endl;
+  for (double level : report_levels)
+    {
+      std::vector<Matrix> pruned;
+      for (const Matrix &w : weights)
+        {
+          pruned.push_back (w);
+        }
+      double density = prune_layers (pruned, level, format);
+      MlpNetwork dense (pruned.data (), biases.data (), activations.data (),
+                        (int) pruned.size (), PANEL_PACKED);
+      MlpNetwork sparse (pruned.data (), biases.data (), activations.data (),
+                         (int) pruned.size (), sparse_layout);
+      double dense_batch, sparse_batch;
+      batch_accuracy (dense, images, labels, dense_batch);
+      double accuracy = batch_accuracy (sparse, images, labels, sparse_batch);
+      std::cout << std::fixed << std::setprecision (2) << std::setw (9)
+                << level << std::setprecision (3) << std::setw (9) << density
+                << std::setprecision (2) << std::setw (13)
+                << single_latency (dense, images) << std::setw (14)
+                << single_latency (sparse, images) << std::setw (13)
+                << dense_batch << std::setw (14) << sparse_batch
+                << std::setw (9) << accuracy << "%" << std::defaultfloat
+                << std::endl;
+    }
+}
+
+int main (int argc, char **argv)
+{
+  if (argc < 3)
+    {
+      std::cout << USAGE_MSG << std::endl;
+      return EXIT_FAILURE;
+    }
+  double sparsity = DEFAULT_SPARSITY;
+  SparseFormat format = CSR;
+  std::string test_images, test_labels;
+  bool valid = true;
+  for (int i = 3; i < argc && valid; i++)
+    {
+      std::string option = argv[i];
+      if (option == "--report" && i + 2 < argc)
+        {
+          test_images = argv[++i];
+          test_labels = argv[++i];
+        }
+      else if (i + 1 >= argc)
+        {
+          valid = false;
+        }
+      else if (option == "--sparsity")
+        {
+          sparsity = std::strtod (argv[++i], nullptr);
+        }
+      else if (option == "--format")
+        {
+          std::string name = argv[++i];
+          valid = name == "csr" || name == "blocks";
+          format = name == "csr" ? CSR : BLOCKS;
+        }
+      else
+        {
+          valid = false;
+        }
+    }
+  if (!valid || sparsity < 0 || sparsity > 1)
+    {
+      std::cout << USAGE_MSG << std::endl;
+      return EXIT_FAILURE;
+    }
+
+  std::vector<Matrix> weights, biases;
+  std::vector<ActivationType> activations;
+  {
+    MappedModel model (argv[1]);
+    for (int l = 0; l < model.layers (); l++)
+      {
+        // copied out of the mapping, so pruning never writes into it.
+        const Matrix w = model.weights (l);
+        const Matrix b = model.bias (l);
+        weights.push_back (w);
+        biases.push_back (b);
+        activations.push_back (model.activation (l));
+      }
+  }
+  if (!MlpNetwork::is_valid (weights.data (), biases.data (),
+                             (int) weights.size ()))
+    {
+      std::cerr << ERROR_INVALID_MODEL << argv[1] << std::endl;
+      return EXIT_FAILURE;
+    }
+  if (!test_images.empty ())
+    {
+      report (weights, biases, activations, format, test_images,
+              test_labels);
+    }
+
+  std::vector<Matrix> pruned;
+  for (const Matrix &w : weights)
+    {
+      pruned.push_back (w);
+    }
+  double density = prune_layers (pruned, sparsity, format);
+  std::vector<int> formats (pruned.size (), MODEL_DENSE);
+  for (size_t l = 0; l + 1 < pruned.size (); l++)
+    {
+      formats[l] = format == CSR ? MODEL_CSR : MODEL_BLOCKS;
+    }
+  if (!MappedModel::write (argv[2], pruned.data (), biases.data (),
+                           activations.data (), (int) pruned.size (),
+                           formats.data ()))
+    {
+      std::cerr << ERROR_SAVE << argv[2] << std::endl;
+      return EXIT_FAILURE;
+    }
+  std::cout << "Wrote " << argv[2] << ": hidden layers " << std::fixed
+            << std::setprecision (3) << density << " dense, "
+            << (format == CSR ? "csr" : "blocks") << std::defaultfloat
+            << std::endl;
+  return EXIT_SUCCESS;
+}
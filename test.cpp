@@ -0,0 +1,303 @@
+// test.cpp
+// Checks that the steady state of MlpNetwork::forward makes no heap
+// allocations, in every weight layout, and that the scalar kernels and
+// those of the detected instruction set agree. Run by make test.
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <random>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "Instrument.h"
+#include "MlpNetwork.h"
+#include "Simd.h"
+
+#define FORWARD_CALLS 100
+#define SPARSE_FIRST_LAYER 0.97 // fraction of zeros, so AUTO picks CSR
+// images of the batch compared across instruction sets, not a multiple of
+// any kernel's tile.
+#define SIMD_BATCH 37
+// largest difference of the scalar and vector outputs, relative to the
+// output's magnitude when above 1 (log probabilities).
+#define SIMD_TOLERANCE 1e-5f
+
+#ifdef MLP_INSTRUMENT
+// Instrument.cpp replaces the global operator new and counts already.
+static long heap_allocations ()
+{
+  return Instrument::allocations ();
+}
+#else
+static std::atomic<long> heap_count (0);
+
+void *operator new (std::size_t size)
+{
+  heap_count++;
+  void *p = std::malloc (size ? size : 1);
+  if (p == nullptr)
+    {
+      throw std::bad_alloc ();
+    }
+  return p;
+}
+
+void *operator new[] (std::size_t size)
+{
+  return operator new (size);
+}
+
+void operator delete (void *p) noexcept
+{
+  std::free (p);
+}
+
+void operator delete[] (void *p) noexcept
+{
+  std::free (p);
+}
+
+void operator delete (void *p, std::size_t) noexcept
+{
+  std::free (p);
+}
+
+void operator delete[] (void *p, std::size_t) noexcept
+{
+  std::free (p);
+}
+
+static long heap_allocations ()
+{
+  return heap_count;
+}
+#endif
+
+/**
+ * Goes to the heap on every call, as the aligned allocator does, and
+ * counts the calls: the pool would hide a matrix made per call.
+ */
+class CountingAllocator : public MatrixAllocator
+{
+ public:
+  float *allocate (long count) override
+  {
+    _count++;
+    return MatrixAllocator::aligned ().allocate (count);
+  }
+  void deallocate (float *buffer, long count) override
+  {
+    MatrixAllocator::aligned ().deallocate (buffer, count);
+  }
+  const char *name () const override
+  {
+    return "counting";
+  }
+  long count () const
+  {
+    return _count;
+  }
+
+ private:
+  std::atomic<long> _count{0};
+};
+
+/**
+ * @return a rows x cols matrix of random weights, zero with probability
+ * zeros.
+ */
+static Matrix random_matrix (std::mt19937 &rng, int rows, int cols,
+                             double zeros)
+{
+  std::uniform_real_distribution<float> value (-0.1f, 0.1f);
+  std::uniform_real_distribution<double> coin (0, 1);
+  Matrix m (rows, cols, NO_FILL);
+  for (int i = 0; i < rows * cols; i++)
+    {
+      m[i] = coin (rng) < zeros ? 0 : value (rng);
+    }
+  return m;
+}
+
+const WeightLayout layouts[] = {ROW_MAJOR, COL_MAJOR, PANEL_PACKED,
+                                SPARSE_CSR, SPARSE_BLOCKS, HALF_FP16,
+                                HALF_BF16, AUTO};
+const char *layout_names[] = {"row", "col", "panel", "csr", "blocks", "fp16",
+                              "bf16", "auto"};
+const int layout_count = (int) (sizeof (layouts) / sizeof (layouts[0]));
+
+/**
+ * @struct TestData
+ * @brief The random network and inputs every test uses, the same in every
+ *        process since the seed is fixed.
+ */
+typedef struct TestData
+{
+    std::vector<Matrix> weights, biases;
+    // a dense input, and a mostly black one as MNIST digits are.
+    Matrix dense, digit;
+    Matrix batch; // SIMD_BATCH images, half of the pixels black
+    Matrix logits; // columns of softmax inputs, over exp's whole range
+} TestData;
+
+static TestData make_data ()
+{
+  std::mt19937 rng (5);
+  TestData data;
+  for (int l = 0; l < MLP_SIZE; l++)
+    {
+      data.weights.push_back (random_matrix (rng, weights_dims[l].rows,
+                                             weights_dims[l].cols,
+                                             l == 0 ? SPARSE_FIRST_LAYER
+                                                    : 0));
+      data.biases.push_back (random_matrix (rng, bias_dims[l].rows,
+                                            bias_dims[l].cols, 0));
+    }
+  int pixels = img_dims.rows * img_dims.cols;
+  data.dense = random_matrix (rng, 1, pixels, 0);
+  data.digit = random_matrix (rng, 1, pixels, 0.8);
+  data.batch = random_matrix (rng, SIMD_BATCH, pixels, 0.5);
+  data.logits = random_matrix (rng, TEN, 7, 0);
+  for (int i = 0; i < data.logits.get_rows () * data.logits.get_cols (); i++)
+    {
+      data.logits[i] *= 800; // [-80, 80]
+    }
+  return data;
+}
+
+/**
+ * @return the single image and batch distributions of the network in
+ * every layout, then its softmax and log-softmax of the logits, as
+ * computed by the kernels simd() chose in this process.
+ */
+static std::vector<float> simd_outputs (const TestData &data)
+{
+  std::vector<float> outputs;
+  for (int i = 0; i < layout_count; i++)
+    {
+      MlpNetwork mlp (data.weights.data (), data.biases.data (),
+                      default_activations, MLP_SIZE, layouts[i]);
+      MlpWorkspace workspace (mlp);
+      float probs[TEN];
+      mlp.distribution (data.dense, workspace, probs);
+      outputs.insert (outputs.end (), probs, probs + TEN);
+      mlp.distribution (data.digit, workspace, probs);
+      outputs.insert (outputs.end (), probs, probs + TEN);
+      std::vector<float> batch ((size_t) SIMD_BATCH * TEN);
+      mlp.distribution_batch (data.batch, batch.data ());
+      outputs.insert (outputs.end (), batch.begin (), batch.end ());
+    }
+  for (ActivationType type : {SOFTMAX, LOG_SOFTMAX})
+    {
+      Matrix out = Activation (type) (data.logits);
+      outputs.insert (outputs.end (), out.data (),
+                      out.data () + out.get_rows () * out.get_cols ());
+    }
+  return outputs;
+}
+
+/**
+ * Computes the outputs with the scalar kernels in a child process, as
+ * simd() picks its table once per process, and with the detected ones
+ * here, and compares them.
+ * Must run before anything here calls simd().
+ * @return true if they agree within SIMD_TOLERANCE
+ */
+static bool test_simd_agreement ()
+{
+  int channel[2];
+  if (pipe (channel) != 0)
+    {
+      std::cout << "FAIL simd: no pipe" << std::endl;
+      return false;
+    }
+  pid_t child = fork ();
+  if (child == 0)
+    {
+      close (channel[0]);
+      setenv (SIMD_ISA_ENV, "scalar", 1);
+      std::vector<float> outputs = simd_outputs (make_data ());
+      const char *bytes = (const char *) outputs.data ();
+      size_t left = outputs.size () * sizeof (float);
+      while (left > 0)
+        {
+          ssize_t count = write (channel[1], bytes, left);
+          if (count <= 0)
+            {
+              _exit (EXIT_FAILURE);
+            }
+          bytes += count;
+          left -= count;
+        }
+      _exit (EXIT_SUCCESS);
+    }
+  close (channel[1]);
+  std::vector<float> vector = simd_outputs (make_data ());
+  std::vector<float> scalar (vector.size ());
+  char *bytes = (char *) scalar.data ();
+  size_t got = 0;
+  ssize_t count;
+  while (got < scalar.size () * sizeof (float)
+         && (count = read (channel[0], bytes + got,
+                           scalar.size () * sizeof (float) - got)) > 0)
+    {
+      got += count;
+    }
+  close (channel[0]);
+  int status = 0;
+  bool exited = child > 0 && waitpid (child, &status, 0) == child
+                && WIFEXITED (status) && WEXITSTATUS (status) == 0;
+  float worst = 0;
+  for (size_t i = 0; i < vector.size (); i++)
+    {
+      float scale = std::max (1.0f, std::abs (scalar[i]));
+      // NaN compares false, and is caught by the check below.
+      float difference = std::abs (vector[i] - scalar[i]) / scale;
+      worst = std::isnan (difference) ? INFINITY
+                                      : std::max (worst, difference);
+    }
+  bool passed = exited && got == scalar.size () * sizeof (float)
+                && worst <= SIMD_TOLERANCE;
+  std::cout << (passed ? "PASS" : "FAIL") << " simd scalar vs "
+            << simd ().name << ": " << vector.size ()
+            << " outputs, largest difference " << worst << std::endl;
+  return passed;
+}
+
+int main ()
+{
+  int failures = !test_simd_agreement ();
+  CountingAllocator counting;
+  MatrixAllocator::set_default (counting);
+  TestData data = make_data ();
+
+  for (int i = 0; i < layout_count; i++)
+    {
+      MlpNetwork mlp (data.weights.data (), data.biases.data (),
+                      default_activations, MLP_SIZE, layouts[i]);
+      // the first calls size the kernels' per thread scratch buffers.
+      mlp.forward (data.dense);
+      mlp.forward (data.digit);
+      long heap = heap_allocations ();
+      long matrices = counting.count ();
+      for (int call = 0; call < FORWARD_CALLS; call++)
+        {
+          mlp.forward (call % 2 == 0 ? data.dense : data.digit);
+        }
+      heap = heap_allocations () - heap;
+      matrices = counting.count () - matrices;
+      bool passed = heap == 0 && matrices == 0;
+      failures += !passed;
+      std::cout << (passed ? "PASS" : "FAIL") << " forward "
+                << layout_names[i] << ": " << heap << " heap allocations, "
+                << matrices << " matrix allocations in " << FORWARD_CALLS
+                << " calls"
+                << std::endl;
+    }
+  MatrixAllocator::set_default (MatrixAllocator::pool ());
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
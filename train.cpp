@@ -0,0 +1,229 @@
+// train.cpp
+// Trains the network on an IDX (MNIST ubyte) data set and writes parameters
+// that mlpnetwork loads, both as raw layer files and as a packed model.
+
+#include <chrono>
+#include <sstream>
+#include <iostream>
+#include <iomanip>
+#include <memory>
+#include "IdxReader.h"
+#include "ModelFile.h"
+#include "Trainer.h"
+
+#define USAGE_MSG "Usage:\n" \
+                  "\t./mlptrain images labels outdir [options]\n" \
+                  "\timages labels - IDX (MNIST ubyte) training set\n" \
+                  "\toutdir - existing directory for w1.., b1.. (per layer) " \
+                  "and model.mlpm\n" \
+                  "\toptions:\n" \
+                  "\t  --epochs N (default 5)\n" \
+                  "\t  --batch N - minibatch size (default 64)\n" \
+                  "\t  --lr X - learning rate (default 0.001 for adam, " \
+                  "0.05 for sgd)\n" \
+                  "\t  --momentum X - sgd momentum (default 0.9)\n" \
+                  "\t  --optimizer sgd|adam (default adam)\n" \
+                  "\t  --threads N - 0 for all cores (default 0)\n" \
+                  "\t  --seed N (default 1)\n" \
+                  "\t  --layers W1,W2,... - outputs of each layer, the last " \
+                  "must be 10 (default 128,64,20,10)\n" \
+                  "\t  --init model.mlpm - start from a packed model, of " \
+                  "its topology\n" \
+                  "\t  --test images labels - accuracy after every epoch"
+#define ERROR_INVALID_MODEL "Error: model does not match the network: "
+#define ERROR_SAVE "Error: failed to write parameters to: "
+#define DEFAULT_EPOCHS 5
+#define DEFAULT_BATCH 64
+#define DEFAULT_ADAM_LR 0.001f
+#define DEFAULT_SGD_LR 0.05f
+#define DEFAULT_MOMENTUM 0.9f
+#define DEFAULT_SEED 1
+
+/**
+ * Parses a comma separated list of layer widths.
+ * @return false if an element is not a positive number or the last is not 10
+ */
+static bool parse_widths (const std::string &list, std::vector<int> &widths)
+{
+  widths.clear ();
+  std::stringstream ss (list);
+  std::string item;
+  while (std::getline (ss, item, ','))
+    {
+      int width = std::atoi (item.c_str ());
+      if (width <= 0)
+        {
+          return false;
+        }
+      widths.push_back (width);
+    }
+  return !widths.empty () && widths.back () == TEN;
+}
+
+/**
+ * @return percentage of images the network classifies as their label.
+ */
+static double accuracy (const MlpNetwork &mlp, MatrixView images,
+                        const std::vector<unsigned char> &labels)
+{
+  std::vector<digit> results = mlp.classify_batch (images);
+  long correct = 0;
+  for (size_t i = 0; i < results.size (); i++)
+    {
+      correct += labels[i] % TEN == results[i].value;
+    }
+  return results.empty () ? 0 : 100.0 * correct / results.size ();
+}
+
+int main (int argc, char **argv)
+{
+  if (argc < 4)
+    {
+      std::cout << USAGE_MSG << std::endl;
+      return EXIT_FAILURE;
+    }
+  TrainConfig config{ADAM, 0, DEFAULT_MOMENTUM, DEFAULT_BATCH, 0,
+                     DEFAULT_SEED};
+  int epochs = DEFAULT_EPOCHS;
+  std::vector<int> widths;
+  for (const auto &dims : weights_dims)
+    {
+      widths.push_back (dims.rows);
+    }
+  std::string init_path, test_images, test_labels;
+  bool valid = true;
+  for (int i = 4; i < argc && valid; i++)
+    {
+      std::string option = argv[i];
+      bool has_value = i + 1 < argc;
+      if (option == "--test" && i + 2 < argc)
+        {
+          test_images = argv[++i];
+          test_labels = argv[++i];
+        }
+      else if (!has_value)
+        {
+          valid = false;
+        }
+      else if (option == "--epochs")
+        {
+          epochs = std::atoi (argv[++i]);
+        }
+      else if (option == "--batch")
+        {
+          config.batch_size = std::atoi (argv[++i]);
+        }
+      else if (option == "--lr")
+        {
+          config.learning_rate = std::strtof (argv[++i], nullptr);
+        }
+      else if (option == "--momentum")
+        {
+          config.momentum = std::strtof (argv[++i], nullptr);
+        }
+      else if (option == "--optimizer")
+        {
+          std::string name = argv[++i];
+          valid = name == "sgd" || name == "adam";
+          config.optimizer = name == "sgd" ? SGD : ADAM;
+        }
+      else if (option == "--threads")
+        {
+          config.threads = std::atoi (argv[++i]);
+        }
+      else if (option == "--seed")
+        {
+          config.seed = (unsigned int) std::strtoul (argv[++i], nullptr, 10);
+        }
+      else if (option == "--layers")
+        {
+          valid = parse_widths (argv[++i], widths);
+        }
+      else if (option == "--init")
+        {
+          init_path = argv[++i];
+        }
+      else
+        {
+          valid = false;
+        }
+    }
+  if (!valid || epochs <= 0 || config.batch_size <= 0 || config.threads < 0)
+    {
+      std::cout << USAGE_MSG << std::endl;
+      return EXIT_FAILURE;
+    }
+  if (config.learning_rate <= 0)
+    {
+      config.learning_rate = config.optimizer == ADAM ? DEFAULT_ADAM_LR
+                                                      : DEFAULT_SGD_LR;
+    }
+
+  Matrix images, test;
+  std::vector<unsigned char> labels, test_set_labels;
+  load_set (argv[1], argv[2], images, labels);
+  if (!test_images.empty ())
+    {
+      load_set (test_images, test_labels, test, test_set_labels);
+    }
+
+  std::unique_ptr<Trainer> trainer;
+  if (init_path.empty ())
+    {
+      trainer.reset (new Trainer (config, widths));
+    }
+  else
+    {
+      MappedModel model (init_path);
+      std::vector<Matrix> weights, biases;
+      std::vector<ActivationType> activations;
+      for (int l = 0; l < model.layers (); l++)
+        {
+          weights.push_back (model.weights (l));
+          biases.push_back (model.bias (l));
+          activations.push_back (model.activation (l));
+        }
+      if (!MlpNetwork::is_valid (weights.data (), biases.data (),
+                                 model.layers ())
+          || activations.back () != SOFTMAX)
+        {
+          std::cerr << ERROR_INVALID_MODEL << init_path << std::endl;
+          return EXIT_FAILURE;
+        }
+      trainer.reset (new Trainer (config, weights.data (), biases.data (),
+                                  activations.data (), model.layers ()));
+    }
+
+  std::cout << "Training a " << trainer->depth () << " layer network on "
+            << images.get_rows () << " images, batch "
+            << config.batch_size << ", "
+            << (config.optimizer == ADAM ? "adam" : "sgd") << " lr "
+            << config.learning_rate << std::endl;
+  for (int epoch = 1; epoch <= epochs; epoch++)
+    {
+      auto start = std::chrono::steady_clock::now ();
+      float loss = trainer->train_epoch (images, labels.data ());
+      double seconds = std::chrono::duration<double> (
+          std::chrono::steady_clock::now () - start).count ();
+      std::cout << "epoch " << epoch << ": loss " << std::fixed
+                << std::setprecision (4) << loss << ", "
+                << std::setprecision (2) << seconds << " s, "
+                << std::setprecision (0)
+                << (seconds > 0 ? images.get_rows () / seconds : 0)
+                << " images/sec";
+      if (!test_images.empty ())
+        {
+          std::cout << ", test accuracy " << std::setprecision (2)
+                    << accuracy (trainer->network (), test, test_set_labels)
+                    << "%";
+        }
+      std::cout << std::defaultfloat << std::endl;
+    }
+
+  if (!trainer->save (argv[3]))
+    {
+      std::cerr << ERROR_SAVE << argv[3] << std::endl;
+      return EXIT_FAILURE;
+    }
+  return EXIT_SUCCESS;
+}